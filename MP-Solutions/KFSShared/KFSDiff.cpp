@@ -0,0 +1,453 @@
+// File: KFSDiff.cpp
+// Differences between two directory trees: entries added, removed, or of another type
+//
+// Both trees are flattened listings, in the order of flatten_directory: in each
+// directory, the files by name, then the directories by name, each followed by
+// everything below it. So the entries below a directory are one range of the array,
+// from the directory to its subtree end, and the children of a directory are:
+//      its files, one after the other, then its subdirectories, each at the subtree
+//      end of the one before
+// The trees are compared directory by directory: the children of a directory in the
+// two trees are merged by name (like the merge step of merge sort), and the merge goes
+// on below the directories that are in both: one linear pass, no tree is copied, sorted
+// or put in a hash table.
+//
+// Snapshots also record a subtree mtime for each directory (see KFSSnapshot.cpp): when
+// a directory has the same subtree mtime in both snapshots, nothing was added, removed
+// or renamed below it, and its range is skipped without reading it. Comparing two
+// snapshots of a tree that mostly did not change reads only the changed directories
+// and the directories above them.
+//
+// A snapshot can also be compared with a directory as it is now, listed as the diff
+// goes (see diff_live_children). Before a directory of both trees is listed, the
+// directories of its range in the snapshot are stat'ed where they are now: when the
+// latest of their mtimes is still the snapshot's subtree mtime, the range is skipped
+// without listing anything below it. A stat per directory replaces the listing of
+// every directory of the tree.
+//
+#include "KFS.h"
+#include <algorithm>
+#include <climits>
+
+// One of the two trees: a flattened array or a snapshot
+struct diff_side {
+    const dir_elm_info *entries;    // nullptr for a snapshot
+    int *ends;                      // subtree end of each entry of entries
+    const dir_snapshot *snapshot;   // nullptr for an array
+    int size;
+    size_t top_length;              // length of the top directory at the start of the paths
+};
+
+// An entry of a diff_side
+struct side_entry {
+    string_view path;
+    string_view name;
+    bool is_directory;
+    int end;                // subtree end
+    long long mtime;        // subtree mtime, 0: unknown
+};
+
+// The children of a directory, in name order
+struct child_cursor {
+    int file;               // next file
+    int files_end;          // after the last file: the first subdirectory
+    int dir;                // next subdirectory
+    int end;                // end of the directory's range
+};
+
+// The tree of a directory as it is now, compared with a snapshot
+struct live_side {
+    const dir_filter *filter;   // entries listed, as when the snapshot was written
+    dir_visit_set *visited;     // directories listed (or skipped) so far
+    string prefix;              // the top directory, with a separator at the end
+    bool is_new;                // true: the live tree is the new tree
+    long long *newest;          // for each directory of the snapshot, the latest mtime now of
+                                // the directories of its range, LLONG_MAX if one is gone
+    bool *checked;              // newest is set for the directory
+};
+
+// Function: array_side
+// Returns: a diff_side for a flattened array (side.ends must be deleted by the caller)
+diff_side array_side(const dir_elm_info *entries, int num_entries) {
+    diff_side side = {entries, new int[num_entries], nullptr, num_entries, 0};
+    int *parents = parent_indices(entries, num_entries);
+    for (int i = 0; i < num_entries; i++) {
+        side.ends[i] = i + 1;
+    }
+    for (int i = num_entries - 1; i >= 0; i--) {
+        if (parents[i] >= 0) {
+            side.ends[parents[i]] = max(side.ends[parents[i]], side.ends[i]);
+        }
+    }
+    delete[] parents;
+    if (num_entries > 0) {
+        side.top_length = entries[0].path.size() - entries[0].name.size();
+    }
+    return side;
+}
+
+// Function: snapshot_side
+// Returns: a diff_side for a snapshot
+diff_side snapshot_side(const dir_snapshot &snapshot) {
+    diff_side side = {nullptr, nullptr, &snapshot, snapshot.size(), 0};
+    exported_entry first;
+    if (snapshot.entry(0, first)) {
+        side.top_length = first.path.size() - first.name.size();
+    }
+    return side;
+}
+
+// Function: get_entry
+//   index: 0 to side.size - 1
+//   entry: output
+void get_entry(const diff_side &side, int index, side_entry &entry) {
+    if (side.entries != nullptr) {
+        const dir_elm_info &info = side.entries[index];
+        entry.path = info.path;
+        entry.name = info.name;
+        entry.is_directory = info.is_directory;
+        entry.end = side.ends[index];
+        entry.mtime = 0;    // not known for a listing
+        return;
+    }
+    exported_entry exported;
+    if (!side.snapshot->entry(index, exported)) {
+        exported.path = exported.name = string_view();  // damaged file
+        exported.is_directory = false;
+    }
+    entry.path = exported.path;
+    entry.name = exported.name;
+    entry.is_directory = exported.is_directory;
+    entry.end = side.snapshot->subtree_end(index);
+    entry.mtime = side.snapshot->subtree_mtime(index);
+}
+
+// Function: start_children
+//   begin, end: range of the entries below a directory ([0, size) for the top directory)
+// Purpose: puts cursor on the first child of the directory
+void start_children(const diff_side &side, int begin, int end, child_cursor &cursor) {
+    side_entry entry;
+    int first_dir = begin;
+    while (first_dir < end) {
+        get_entry(side, first_dir, entry);
+        if (entry.is_directory) {
+            break;
+        }
+        first_dir++;
+    }
+    cursor = {begin, first_dir, first_dir, end};
+}
+
+// Function: next_child
+//   child, index: output, the next child in name order and its index
+// Returns: false when there are no more children
+bool next_child(const diff_side &side, child_cursor &cursor, side_entry &child, int &index) {
+    bool has_file = (cursor.file < cursor.files_end);
+    bool has_dir = (cursor.dir < cursor.end);
+    if (!has_file && !has_dir) {
+        return false;
+    }
+    side_entry file, dir;
+    if (has_file) {
+        get_entry(side, cursor.file, file);
+    }
+    if (has_dir) {
+        get_entry(side, cursor.dir, dir);
+    }
+    if (has_file && (!has_dir || (file.name < dir.name))) {
+        child = file;
+        index = cursor.file++;
+    } else {
+        child = dir;
+        index = cursor.dir;
+        cursor.dir = max(dir.end, cursor.dir + 1);
+    }
+    return true;
+}
+
+// Function: report_range
+// Purpose: reports the entries from begin to end (a subtree, or what is below a directory) as change
+void report_range(const diff_side &side, int begin, int end, diff_change change,
+                  const diff_reporter &report, diff_counts &counts) {
+    side_entry entry;
+    for (int i = begin; i < end; i++) {
+        get_entry(side, i, entry);
+        report({change, entry.path.substr(side.top_length), entry.is_directory});
+        ((change == DIFF_ADDED) ? counts.added : counts.removed)++;
+    }
+}
+
+// Function: diff_children
+//   old_begin, old_end, new_begin, new_end: ranges of the entries below the same
+//                                           directory in both trees
+// Purpose: merges the children of the directory by name, and goes on below the
+//          subdirectories in both trees
+void diff_children(const diff_side &old_side, int old_begin, int old_end,
+                   const diff_side &new_side, int new_begin, int new_end,
+                   const diff_reporter &report, diff_counts &counts) {
+    child_cursor old_cursor, new_cursor;
+    start_children(old_side, old_begin, old_end, old_cursor);
+    start_children(new_side, new_begin, new_end, new_cursor);
+    side_entry old_child, new_child;
+    int old_index = 0, new_index = 0;
+    bool has_old = next_child(old_side, old_cursor, old_child, old_index);
+    bool has_new = next_child(new_side, new_cursor, new_child, new_index);
+    while (has_old || has_new) {
+        int order = !has_old ? 1 : (!has_new ? -1 : old_child.name.compare(new_child.name));
+        if (order < 0) {
+            report_range(old_side, old_index, max(old_child.end, old_index + 1), DIFF_REMOVED,
+                         report, counts);
+            has_old = next_child(old_side, old_cursor, old_child, old_index);
+            continue;
+        }
+        if (order > 0) {
+            report_range(new_side, new_index, max(new_child.end, new_index + 1), DIFF_ADDED,
+                         report, counts);
+            has_new = next_child(new_side, new_cursor, new_child, new_index);
+            continue;
+        }
+
+        if (old_child.is_directory && new_child.is_directory) {
+            if ((old_child.mtime != 0) && (old_child.mtime == new_child.mtime)) {
+                counts.subtrees_skipped++;  // nothing changed below
+            } else {
+                diff_children(old_side, old_index + 1, old_child.end,
+                              new_side, new_index + 1, new_child.end, report, counts);
+            }
+        } else if (old_child.is_directory != new_child.is_directory) {
+            report({DIFF_TYPE_CHANGED, new_child.path.substr(new_side.top_length), new_child.is_directory});
+            counts.type_changed++;
+            // what was below the old directory, or is below the new one
+            report_range(old_side, old_index + 1, old_child.end, DIFF_REMOVED, report, counts);
+            report_range(new_side, new_index + 1, new_child.end, DIFF_ADDED, report, counts);
+        }
+        has_old = next_child(old_side, old_cursor, old_child, old_index);
+        has_new = next_child(new_side, new_cursor, new_child, new_index);
+    }
+}
+
+// Function: diff_sides
+// Returns: the differences between the two trees
+diff_counts diff_sides(const diff_side &old_side, const diff_side &new_side,
+                       const diff_reporter &report) {
+    diff_counts counts = {0, 0, 0, 0};
+    diff_children(old_side, 0, old_side.size, new_side, 0, new_side.size, report, counts);
+    return counts;
+}
+
+// Function: live_path
+//   path: path of an entry of the snapshot
+// Returns: the path of the same entry in the live tree
+string live_path(const diff_side &snap, const live_side &live, string_view path) {
+    return live.prefix + string(path.substr(snap.top_length));
+}
+
+// Function: check_range
+//   index: a directory of the snapshot
+// Purpose: stats the directories of the range of index in the live tree, and sets
+//          newest for each of them (children before their parent)
+void check_range(const diff_side &snap, live_side &live, int index) {
+    exported_entry entry;
+    for (int i = snap.snapshot->subtree_end(index) - 1; i >= index; i--) {
+        if (!snap.snapshot->entry(i, entry) || !entry.is_directory) {
+            continue;
+        }
+        long long mtime = mtime_of(live_path(snap, live, entry.path));
+        live.newest[i] = max(live.newest[i], (mtime == 0) ? LLONG_MAX : mtime);
+        live.checked[i] = true;
+        if ((i > index) && (entry.parent >= index)) {
+            live.newest[entry.parent] = max(live.newest[entry.parent], live.newest[i]);
+        }
+    }
+}
+
+// Function: is_unchanged
+//   index, child: a directory of the snapshot, also a directory in the live tree
+// Returns: true if nothing was added, removed or renamed below it since the snapshot
+bool is_unchanged(const diff_side &snap, live_side &live, int index, const side_entry &child) {
+    if (child.mtime == 0) {
+        return false;   // not known
+    }
+    if (!live.checked[index]) {
+        check_range(snap, live, index);
+    }
+    return live.newest[index] == child.mtime;     // a change makes one of them later
+}
+
+// Function: list_live
+//   dir_path: a directory of the live tree
+//   num_entries: output, number of entries
+// Returns: its entries kept by the filter, sorted by name, nullptr if it is not listed
+//          (already listed through another path, or on another file system)
+dir_elm_info* list_live(live_side &live, const string &dir_path, int &num_entries) {
+    num_entries = 0;
+    if (!live.visited->first_visit(dir_path)) {
+        return nullptr;
+    }
+    dir_elm_info *entries = get_directory_entries(dir_path, num_entries);
+    num_entries = live.filter->apply(entries, num_entries);
+    auto by_name = [](const dir_elm_info &a, const dir_elm_info &b) { return a.name < b.name; };
+    if (!is_sorted(entries, entries + num_entries, by_name)) {
+        sort(entries, entries + num_entries, by_name);
+    }
+    return entries;
+}
+
+// Function: report_live_below
+//   dir_path: a directory of the live tree, its entries at depth
+// Purpose: reports everything below it as change, in the order of flatten_directory
+void report_live_below(live_side &live, const string &dir_path, int depth, diff_change change,
+                       const diff_reporter &report, diff_counts &counts) {
+    int num_entries = 0;
+    dir_elm_info *entries = list_live(live, dir_path, num_entries);
+    for (int pass = 0; pass < 2; pass++) {     // files first, then each directory and its contents
+        for (int i = 0; i < num_entries; i++) {
+            if (entries[i].is_directory != (pass == 1)) {
+                continue;
+            }
+            report({change, string_view(entries[i].path).substr(live.prefix.size()),
+                    entries[i].is_directory});
+            ((change == DIFF_ADDED) ? counts.added : counts.removed)++;
+            if (entries[i].is_directory && live.filter->descends(entries[i], depth)) {
+                report_live_below(live, entries[i].path, depth + 1, change, report, counts);
+            }
+        }
+    }
+    delete[] entries;
+}
+
+// Function: diff_live_children
+//   begin, end: range of the entries below a directory of the snapshot
+//   entries, num_entries: the entries of the same directory in the live tree, at depth
+// Purpose: same as diff_children, a live directory is only listed when it is needed
+void diff_live_children(const diff_side &snap, int begin, int end, live_side &live,
+                        const dir_elm_info *entries, int num_entries, int depth,
+                        const diff_reporter &report, diff_counts &counts) {
+    diff_change snap_only = live.is_new ? DIFF_REMOVED : DIFF_ADDED;
+    diff_change live_only = live.is_new ? DIFF_ADDED : DIFF_REMOVED;
+    child_cursor cursor;
+    start_children(snap, begin, end, cursor);
+    side_entry child;
+    int index = 0;
+    bool has_snap = next_child(snap, cursor, child, index);
+    int i = 0;
+    while (has_snap || (i < num_entries)) {
+        int order = !has_snap ? 1 : ((i == num_entries) ? -1 : child.name.compare(entries[i].name));
+        if (order < 0) {
+            report_range(snap, index, max(child.end, index + 1), snap_only, report, counts);
+            has_snap = next_child(snap, cursor, child, index);
+            continue;
+        }
+        const dir_elm_info &entry = entries[i++];
+        bool descends = entry.is_directory && live.filter->descends(entry, depth);
+        if (order > 0) {
+            report({live_only, string_view(entry.path).substr(live.prefix.size()), entry.is_directory});
+            (live.is_new ? counts.added : counts.removed)++;
+            if (descends) {
+                report_live_below(live, entry.path, depth + 1, live_only, report, counts);
+            }
+            continue;
+        }
+
+        if (child.is_directory && entry.is_directory) {
+            if (descends && is_unchanged(snap, live, index, child)) {
+                counts.subtrees_skipped++;  // nothing changed below
+                for (int d = index; d < child.end; d++) {
+                    // the directories of the range, as if they had been listed
+                    exported_entry below;
+                    if (snap.snapshot->entry(d, below) && below.is_directory) {
+                        live.visited->first_visit(live_path(snap, live, below.path));
+                    }
+                }
+            } else {
+                int num_below = 0;
+                dir_elm_info *below = descends ? list_live(live, entry.path, num_below) : nullptr;
+                diff_live_children(snap, index + 1, child.end, live, below, num_below, depth + 1,
+                                   report, counts);
+                delete[] below;
+            }
+        } else if (child.is_directory != entry.is_directory) {
+            bool new_is_directory = live.is_new ? entry.is_directory : child.is_directory;
+            string_view new_path = live.is_new ? string_view(entry.path).substr(live.prefix.size())
+                                               : child.path.substr(snap.top_length);
+            report({DIFF_TYPE_CHANGED, new_path, new_is_directory});
+            counts.type_changed++;
+            // what was below the old directory, or is below the new one
+            if (!live.is_new) {
+                if (descends) {
+                    report_live_below(live, entry.path, depth + 1, DIFF_REMOVED, report, counts);
+                }
+                report_range(snap, index + 1, child.end, DIFF_ADDED, report, counts);
+            } else {
+                report_range(snap, index + 1, child.end, DIFF_REMOVED, report, counts);
+                if (descends) {
+                    report_live_below(live, entry.path, depth + 1, DIFF_ADDED, report, counts);
+                }
+            }
+        }
+        has_snap = next_child(snap, cursor, child, index);
+    }
+}
+
+// Function: diff_live
+//   path: the top directory of the live tree
+//   is_new: true if the live tree is the new tree
+// Returns: the differences between the snapshot and the live tree
+diff_counts diff_live(const dir_snapshot &snapshot, const string &path, const dir_filter &filter,
+                      bool is_new, const diff_reporter &report) {
+    diff_side snap = snapshot_side(snapshot);
+    dir_visit_set visited(filter.stays_on_file_system());
+    live_side live = {&filter, &visited, (fs::path(path) / "").string(), is_new,
+                      new long long[max(snap.size, 1)](), new bool[max(snap.size, 1)]()};
+    diff_counts counts = {0, 0, 0, 0};
+    int num_entries = 0;
+    dir_elm_info *entries = list_live(live, path, num_entries);
+    diff_live_children(snap, 0, snap.size, live, entries, num_entries, 0, report, counts);
+    delete[] entries;
+    delete[] live.checked;
+    delete[] live.newest;
+    return counts;
+}
+
+// --- Begin exported functions ---
+
+diff_counts diff_trees(const dir_elm_info *old_entries, int num_old,
+                       const dir_elm_info *new_entries, int num_new, const diff_reporter &report) {
+    diff_side old_side = array_side(old_entries, num_old);
+    diff_side new_side = array_side(new_entries, num_new);
+    diff_counts counts = diff_sides(old_side, new_side, report);
+    delete[] new_side.ends;
+    delete[] old_side.ends;
+    return counts;
+}
+
+diff_counts diff_trees(const dir_snapshot &old_tree, const dir_snapshot &new_tree,
+                       const diff_reporter &report) {
+    return diff_sides(snapshot_side(old_tree), snapshot_side(new_tree), report);
+}
+
+diff_counts diff_trees(const dir_snapshot &old_tree, const dir_elm_info *new_entries, int num_new,
+                       const diff_reporter &report) {
+    diff_side new_side = array_side(new_entries, num_new);
+    diff_counts counts = diff_sides(snapshot_side(old_tree), new_side, report);
+    delete[] new_side.ends;
+    return counts;
+}
+
+diff_counts diff_trees(const dir_elm_info *old_entries, int num_old, const dir_snapshot &new_tree,
+                       const diff_reporter &report) {
+    diff_side old_side = array_side(old_entries, num_old);
+    diff_counts counts = diff_sides(old_side, snapshot_side(new_tree), report);
+    delete[] old_side.ends;
+    return counts;
+}
+
+diff_counts diff_trees(const dir_snapshot &old_tree, const string &new_path, const dir_filter &filter,
+                       const diff_reporter &report) {
+    return diff_live(old_tree, new_path, filter, true, report);
+}
+
+diff_counts diff_trees(const string &old_path, const dir_snapshot &new_tree, const dir_filter &filter,
+                       const diff_reporter &report) {
+    return diff_live(new_tree, old_path, filter, false, report);
+}
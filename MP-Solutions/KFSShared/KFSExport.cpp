@@ -0,0 +1,299 @@
+// File: KFSExport.cpp
+// Machine-readable exports of a flattened directory listing
+//
+// NDJSON (newline delimited JSON): one JSON object per entry, per line
+//      {"path":"...","name":"...","is_directory":true,"parent":-1,"depth":0}
+// Names are written byte for byte when they are valid UTF-8, only '"', '\' and control
+// characters are escaped. A byte that is not part of a valid UTF-8 sequence (file
+// names are any bytes on Linux) is written as the escape of a lone low surrogate,
+// \udc80 to \udcff, the "surrogateescape" of Python: the line is still valid JSON,
+// and os.fsencode(json.loads(line)["path"]) gives back the original bytes.
+//
+// Binary export file format (integers in the native byte order of the machine):
+//      "KFSEXP01"                      8 bytes
+//      number of entries               4 bytes
+//      then, for each entry, in the order of the array:
+//          parent                      4 bytes (index of the containing directory, -1: none)
+//          depth                       4 bytes (0: in the top directory)
+//          is_directory                1 byte
+//          name length, path length    4 bytes + 4 bytes
+//          name, path                  name length + path length bytes
+// The file is read back with exported_listing: memory-mapped, names and paths
+// are string_views into the mapping, nothing is converted or copied.
+//
+// NDJSON format
+//      https://github.com/ndjson/ndjson-spec
+// UTF-8, RFC 3629 (section 4: the valid byte sequences)
+//      https://www.rfc-editor.org/rfc/rfc3629#section-4
+// surrogateescape, PEP 383
+//      https://peps.python.org/pep-0383/
+// mmap from the Linux manual
+//      https://man7.org/linux/man-pages/man2/mmap.2.html
+//
+#include "KFS.h"
+#include <cstring>
+#include <fstream>
+#include <string_view>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Local constants
+const char EXPORT_MAGIC[] = "KFSEXP01";
+const int EXPORT_MAGIC_SIZE = 8;
+const int EXPORT_RECORD_FIXED_SIZE = 4 + 4 + 1 + 4 + 4;
+
+// Function: utf8_sequence_length
+//   value: a string of bytes
+//   i: index of a byte of value
+// Returns: the number of bytes of the valid UTF-8 sequence starting at i, 0 if there is none
+int utf8_sequence_length(const string &value, size_t i) {
+    unsigned char lead = value[i];
+    int length = 0;
+    unsigned char low = 0x80, high = 0xBF;  // range of the second byte
+    if (lead < 0x80) {
+        return 1;
+    } else if ((lead >= 0xC2) && (lead <= 0xDF)) {
+        length = 2;
+    } else if ((lead >= 0xE0) && (lead <= 0xEF)) {
+        length = 3;
+        low = (lead == 0xE0) ? 0xA0 : 0x80;     // no overlong forms
+        high = (lead == 0xED) ? 0x9F : 0xBF;    // no surrogates
+    } else if ((lead >= 0xF0) && (lead <= 0xF4)) {
+        length = 4;
+        low = (lead == 0xF0) ? 0x90 : 0x80;     // no overlong forms
+        high = (lead == 0xF4) ? 0x8F : 0xBF;    // at most U+10FFFF
+    } else {
+        return 0;
+    }
+    if (i + length > value.size()) {
+        return 0;
+    }
+    for (int k = 1; k < length; k++) {
+        unsigned char c = value[i + k];
+        if ((k == 1) ? ((c < low) || (c > high)) : ((c & 0xC0) != 0x80)) {
+            return 0;
+        }
+    }
+    return length;
+}
+
+// Function: append_json_string
+//   line: the line being built
+//   value: string to append, quoted and escaped
+void append_json_string(string &line, const string &value) {
+    const char *HEX = "0123456789abcdef";
+    line += '"';
+    for (size_t i = 0; i < value.size(); ) {
+        unsigned char c = value[i];
+        int length = utf8_sequence_length(value, i);
+        if ((c == '"') || (c == '\\')) {
+            line += '\\';
+            line += c;
+        } else if (c < 0x20) {
+            line += "\\u00";
+            line += HEX[c >> 4];
+            line += HEX[c & 0xF];
+        } else if (length == 0) {
+            line += "\\udc";     // not UTF-8: surrogateescape
+            line += HEX[c >> 4];
+            line += HEX[c & 0xF];
+        } else {
+            line.append(value, i, length);
+            i += length;
+            continue;
+        }
+        i++;
+    }
+    line += '"';
+}
+
+// --- Begin exported functions ---
+
+// Function: parent_indices
+//   entries: pointer to a flattened array of dir_elm_info
+//   num_entries: number of entries in the array
+// Precondition: each directory is before its contents in the array
+// Returns: array of num_entries, index of the directory holding each entry,
+//          -1 for the entries of the top directory
+//
+// **NOTE**: the allocated array must be deleted by the caller
+int* parent_indices(const dir_elm_info *entries, int num_entries) {
+    unordered_map<string_view, int> directory_index;
+    int *parents = new int[num_entries];
+    for (int i = 0; i < num_entries; i++) {
+        // the directory part of the path, without the name and the '/'
+        string_view path(entries[i].path);
+        size_t slash = path.find_last_of('/');
+        auto found = (slash == string_view::npos) ? directory_index.end()
+                                                  : directory_index.find(path.substr(0, slash));
+        parents[i] = (found == directory_index.end()) ? -1 : found->second;
+        if (entries[i].is_directory) {
+            directory_index[path] = i;
+        }
+    }
+    return parents;
+}
+
+// Function: depths_of
+//   parents: parent index of each entry (see parent_indices)
+// Returns: depth of each entry, 0 for the entries of the top directory
+//
+// **NOTE**: the allocated array must be deleted by the caller
+int* depths_of(const int *parents, int num_entries) {
+    int *depths = new int[num_entries];
+    for (int i = 0; i < num_entries; i++) {
+        depths[i] = (parents[i] < 0) ? 0 : depths[parents[i]] + 1;
+    }
+    return depths;
+}
+
+// Function: export_ndjson
+//   out: output stream
+//   entries: pointer to a flattened array of dir_elm_info
+//   num_entries: number of entries in the array
+// Purpose:
+// writes one JSON object per entry, one per line
+void export_ndjson(ostream &out, const dir_elm_info *entries, int num_entries) {
+    int *parents = parent_indices(entries, num_entries);
+    int *depths = depths_of(parents, num_entries);
+    string line;
+    for (int i = 0; i < num_entries; i++) {
+        line.clear();
+        line += "{\"path\":";
+        append_json_string(line, entries[i].path);
+        line += ",\"name\":";
+        append_json_string(line, entries[i].name);
+        line += entries[i].is_directory ? ",\"is_directory\":true" : ",\"is_directory\":false";
+        line += ",\"parent\":" + to_string(parents[i]);
+        line += ",\"depth\":" + to_string(depths[i]);
+        line += "}\n";
+        out.write(line.data(), line.size());
+    }
+    out.flush();
+    delete[] depths;
+    delete[] parents;
+}
+
+// Function: export_ndjson
+//   file: path of the file to write
+// Returns: false if the file could not be written
+bool export_ndjson(const string &file, const dir_elm_info *entries, int num_entries) {
+    ofstream out(file, ios::trunc);
+    if (out) {
+        export_ndjson(out, entries, num_entries);
+        out.close();
+    }
+    if (!out) {
+        cerr << "Error: cannot write export file: " << file << endl;
+        return false;
+    }
+    return true;
+}
+
+// Function: export_binary
+//   file: path of the file to write
+//   entries: pointer to a flattened array of dir_elm_info
+//   num_entries: number of entries in the array
+// Returns: false if the file could not be written
+bool export_binary(const string &file, const dir_elm_info *entries, int num_entries) {
+    ofstream out(file, ios::binary | ios::trunc);
+    if (!out) {
+        cerr << "Error: cannot write export file: " << file << endl;
+        return false;
+    }
+    int *parents = parent_indices(entries, num_entries);
+    int *depths = depths_of(parents, num_entries);
+
+    out.write(EXPORT_MAGIC, EXPORT_MAGIC_SIZE);
+    unsigned int count = num_entries;
+    out.write((const char *)&count, sizeof(count));
+    for (int i = 0; i < num_entries; i++) {
+        char fixed[EXPORT_RECORD_FIXED_SIZE];
+        unsigned int name_len = entries[i].name.size();
+        unsigned int path_len = entries[i].path.size();
+        memcpy(fixed, &parents[i], 4);
+        memcpy(fixed + 4, &depths[i], 4);
+        fixed[8] = entries[i].is_directory ? 1 : 0;
+        memcpy(fixed + 9, &name_len, 4);
+        memcpy(fixed + 13, &path_len, 4);
+        out.write(fixed, EXPORT_RECORD_FIXED_SIZE);
+        out.write(entries[i].name.data(), name_len);
+        out.write(entries[i].path.data(), path_len);
+    }
+    delete[] depths;
+    delete[] parents;
+
+    out.close();
+    if (!out) {
+        cerr << "Error: cannot write export file: " << file << endl;
+        return false;
+    }
+    return true;
+}
+
+exported_listing::exported_listing(const string &file) :
+    map(nullptr), map_size(0), position(nullptr), num_entries(0), num_read(0)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << "Error: cannot open export file: " << file << endl;
+        return;
+    }
+    struct stat info;
+    if ((fstat(fd, &info) != 0) || (info.st_size < EXPORT_MAGIC_SIZE + 4)) {
+        close(fd);
+        cerr << "Error: not an export file: " << file << endl;
+        return;
+    }
+    void *addr = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);      // the mapping stays valid
+    if (addr == MAP_FAILED) {
+        return;
+    }
+    map = (char *)addr;
+    map_size = info.st_size;
+    if (memcmp(map, EXPORT_MAGIC, EXPORT_MAGIC_SIZE) != 0) {
+        cerr << "Error: not an export file: " << file << endl;
+        munmap(map, map_size);
+        map = nullptr;
+        return;
+    }
+    unsigned int count = 0;
+    memcpy(&count, map + EXPORT_MAGIC_SIZE, 4);
+    num_entries = count;
+    position = map + EXPORT_MAGIC_SIZE + 4;
+}
+
+exported_listing::~exported_listing() {
+    if (map != nullptr) {
+        munmap(map, map_size);
+    }
+}
+
+bool exported_listing::next(exported_entry &entry) {
+    if ((map == nullptr) || (num_read == num_entries)) {
+        return false;
+    }
+    const char *end = map + map_size;
+    unsigned int name_len = 0, path_len = 0;
+    if (end - position < EXPORT_RECORD_FIXED_SIZE) {
+        return false;   // damaged file
+    }
+    memcpy(&entry.parent, position, 4);
+    memcpy(&entry.depth, position + 4, 4);
+    entry.is_directory = (position[8] != 0);
+    memcpy(&name_len, position + 9, 4);
+    memcpy(&path_len, position + 13, 4);
+    position += EXPORT_RECORD_FIXED_SIZE;
+    if (end - position < (long)name_len + (long)path_len) {
+        return false;   // damaged file
+    }
+    entry.name = string_view(position, name_len);
+    entry.path = string_view(position + name_len, path_len);
+    position += name_len + path_len;
+    num_read++;
+    return true;
+}
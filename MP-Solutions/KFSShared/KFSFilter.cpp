@@ -0,0 +1,170 @@
+// File: KFSFilter.cpp
+// Implementation of the dir_filter class: which entries a traversal keeps
+//
+// The filter is applied to each listing during the walk (see dir_filter::apply),
+// so an excluded or pruned directory is never opened, and nothing below it is
+// listed, allocated or copied.
+//      exclude GLOB, exclude_regex PATTERN: entries whose name matches are skipped (a
+//                    directory with all of its contents)
+//      prune GLOB: directories whose name matches are kept, but their contents are not listed
+//      include GLOB, include_regex PATTERN: when given, files are kept only if their name
+//                    matches one of them (directories are kept, to reach the files below)
+//      max_depth N: directories at depth N are not opened (0: the entries of the top directory)
+//      one_file_system: directories on another file system are not opened (checked by the
+//                       traversal with a dir_visit_set, see KFSVisit.cpp)
+//
+// fnmatch from the Linux manual
+//      https://man7.org/linux/man-pages/man3/fnmatch.3.html
+// regex_search from cppreference.com
+//      https://en.cppreference.com/w/cpp/regex/regex_search
+//
+#include "KFS.h"
+#include <fnmatch.h>
+
+// Function: matches_any
+//   globs: shell wildcard patterns (*, ?, [...])
+//   name: file or directory name
+// Returns: true if name matches one of globs
+bool matches_any(const vector<string> &globs, const string &name) {
+    for (const string &glob : globs) {
+        if (fnmatch(glob.c_str(), name.c_str(), 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function: searches_any
+//   patterns: regular expressions
+//   name: file or directory name
+// Returns: true if one of patterns is found anywhere in name
+bool searches_any(const vector<regex> &patterns, const string &name) {
+    for (const regex &pattern : patterns) {
+        if (regex_search(name, pattern)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function: add_regex
+//   patterns: reference to the regular expressions to add to
+//   pattern: a regular expression (ECMAScript syntax)
+// Returns: false if pattern is not valid (an error is printed)
+bool add_regex(vector<regex> &patterns, const string &pattern) {
+    try {
+        patterns.push_back(regex(pattern));
+    } catch (const regex_error &e) {
+        cerr << "Error: invalid regular expression: " << pattern << " (" << e.what() << ")" << endl;
+        return false;
+    }
+    return true;
+}
+
+// --- Begin exported functions ---
+
+dir_filter::dir_filter() : max_depth(-1), one_file_system(false) {
+}
+
+void dir_filter::include(const string &glob) {
+    include_globs.push_back(glob);
+}
+
+bool dir_filter::include_regex(const string &pattern) {
+    return add_regex(include_regexes, pattern);
+}
+
+void dir_filter::exclude(const string &glob) {
+    exclude_globs.push_back(glob);
+}
+
+bool dir_filter::exclude_regex(const string &pattern) {
+    return add_regex(exclude_regexes, pattern);
+}
+
+void dir_filter::prune(const string &glob) {
+    prune_globs.push_back(glob);
+}
+
+void dir_filter::set_max_depth(int depth) {
+    max_depth = depth;
+}
+
+void dir_filter::set_one_file_system(bool one_file_system) {
+    this->one_file_system = one_file_system;
+}
+
+bool dir_filter::keeps_everything() const {
+    return include_globs.empty() && include_regexes.empty() && exclude_globs.empty()
+        && exclude_regexes.empty() && prune_globs.empty() && (max_depth < 0);
+}
+
+bool dir_filter::keeps(const dir_elm_info &entry) const {
+    if (matches_any(exclude_globs, entry.name) || searches_any(exclude_regexes, entry.name)) {
+        return false;
+    }
+    if (entry.is_directory || (include_globs.empty() && include_regexes.empty())) {
+        return true;
+    }
+    return matches_any(include_globs, entry.name) || searches_any(include_regexes, entry.name);
+}
+
+bool dir_filter::descends(const dir_elm_info &entry, int depth) const {
+    return entry.is_directory && ((max_depth < 0) || (depth < max_depth))
+        && !matches_any(prune_globs, entry.name);
+}
+
+int dir_filter::apply(dir_elm_info *entries, int num_entries) const {
+    if (keeps_everything()) {
+        return num_entries;
+    }
+    int num_kept = 0;
+    for (int i = 0; i < num_entries; i++) {
+        if (keeps(entries[i])) {
+            if (num_kept != i) {
+                entries[num_kept] = move(entries[i]);
+            }
+            num_kept++;
+        }
+    }
+    return num_kept;
+}
+
+bool dir_filter::is_option(const string &option) {
+    return (option == "-include") || (option == "-regex") || (option == "-exclude")
+        || (option == "-exclude_regex") || (option == "-prune") || (option == "-maxdepth");
+}
+
+bool dir_filter::is_flag(const string &option) {
+    return (option == "-xdev");
+}
+
+void dir_filter::add_flag(const string &option) {
+    if (option == "-xdev") {
+        set_one_file_system(true);
+    }
+}
+
+bool dir_filter::add_option(const string &option, const string &value) {
+    if (option == "-include") {
+        include(value);
+    } else if (option == "-regex") {
+        return include_regex(value);
+    } else if (option == "-exclude") {
+        exclude(value);
+    } else if (option == "-exclude_regex") {
+        return exclude_regex(value);
+    } else if (option == "-prune") {
+        prune(value);
+    } else if (option == "-maxdepth") {
+        try {
+            set_max_depth(stoi(value));
+        } catch (const exception &e) {
+            cerr << "Error: -maxdepth needs a number: " << value << endl;
+            return false;
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
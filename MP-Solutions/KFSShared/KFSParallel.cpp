@@ -0,0 +1,364 @@
+// File: KFSParallel.cpp
+// Parallel version of the flattening of a directory tree
+//
+// Each directory is listed exactly once, by one of the worker threads.
+// Every worker owns a deque of directories waiting to be listed:
+//      - a worker takes its own work from the back of its deque (newest first)
+//      - an idle worker steals from the front of another worker's deque (oldest first)
+//      - a worker that finds no work anywhere sleeps on a condition variable until a
+//        directory is queued or all the work is done
+// The listings are kept in a tree that mirrors the directory tree. Once all
+// directories are listed, the tree is walked in order to fill the flattened array,
+// so the result is identical to the serial flatten (flatten_directory_entries): files
+// first, then each directory followed by its contents, each directory in the order of
+// get_directory_entries.
+// A directory reached through several paths (symbolic links, bind mounts) is
+// listed once, by whichever worker gets to it first (see dir_visit_set). That path
+// is not always the one the serial flatten lists it under, the first one in
+// the order of the array: when any directory was reached twice, the tree is walked
+// again in that order with a new visit set before it is copied, the listings of the
+// later paths are dropped, and a directory first reached through a path that was not
+// listed is listed there (this is rare: only directories reached twice).
+//
+// An exception thrown by a worker (e.g., bad_alloc) stops the pool: the directories
+// still queued are dropped, and the exception is thrown again in the calling thread.
+//
+// std::thread example from cppreference.com
+//      https://en.cppreference.com/w/cpp/thread/thread
+// std::condition_variable example from cppreference.com
+//      https://en.cppreference.com/w/cpp/thread/condition_variable
+// std::exception_ptr example from cppreference.com
+//      https://en.cppreference.com/w/cpp/error/exception_ptr
+//
+#include "KFS.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+// The listing of one directory, and the listings of its subdirectories
+struct flatten_node {
+    dir_elm_info *entries = nullptr;    // sorted entries, from get_directory_entries
+    int num_entries = 0;
+    flatten_node **subdirs = nullptr;   // subdirs[i]: listing of entries[i] if it is a directory
+    bool listed = false;                // false: reached through another path first, or not listable
+};
+
+// A directory waiting to be listed, and where to store its listing
+struct flatten_task {
+    string path;
+    flatten_node *node;
+};
+
+// Per-worker deque of tasks
+struct worker_queue {
+    mutex lock;
+    deque<flatten_task> tasks;
+};
+
+// State shared by all workers
+struct flatten_pool {
+    worker_queue *queues = nullptr;
+    int num_workers = 0;
+    atomic<int> pending{0};         // tasks queued or being worked on
+    atomic<int> queued{0};          // tasks in the deques
+    atomic<int> total_entries{0};   // number of entries listed so far
+    atomic<bool> skipped{false};    // a directory was not listed (see resolve_tree)
+    dir_visit_set visited;          // directories listed so far, by (device, inode)
+
+    mutex idle_lock;                // held to test queued and pending before sleeping
+    condition_variable wake;        // a task was queued, or pending reached 0
+    exception_ptr error;            // first exception thrown by a worker, under idle_lock
+    atomic<bool> stopped{false};    // set with error: the tasks left are dropped
+};
+
+// Function: take_task
+//   pool: the shared state
+//   self: index of the calling worker
+//   task: output, the task found
+// Returns: true if a task was found in own deque or stolen from another deque
+bool take_task(flatten_pool &pool, int self, flatten_task &task) {
+    {
+        lock_guard<mutex> guard(pool.queues[self].lock);
+        if (!pool.queues[self].tasks.empty()) {
+            task = move(pool.queues[self].tasks.back());
+            pool.queues[self].tasks.pop_back();
+            pool.queued--;
+            return true;
+        }
+    }
+    for (int i = 1; i < pool.num_workers; i++) {
+        worker_queue &victim = pool.queues[(self + i) % pool.num_workers];
+        lock_guard<mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = move(victim.tasks.front());
+            victim.tasks.pop_front();
+            pool.queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function: list_directory_task
+//   pool: the shared state
+//   self: index of the calling worker
+//   task: the directory to list
+// Purpose:
+// lists the directory into task.node, queues each subdirectory on own deque, and
+// wakes the sleeping workers if any was queued
+void list_directory_task(flatten_pool &pool, int self, flatten_task &task) {
+    flatten_node *node = task.node;
+    if (!pool.visited.first_visit(task.path)) {
+        pool.skipped = true;
+        return;     // already listed through another path: left empty
+    }
+    node->entries = get_directory_entries(task.path, node->num_entries);
+    node->listed = true;
+    pool.total_entries += node->num_entries;
+    if (node->num_entries == 0) {
+        return;
+    }
+
+    node->subdirs = new flatten_node*[node->num_entries];
+    for (int i = 0; i < node->num_entries; i++) {
+        node->subdirs[i] = nullptr;
+    }
+    int num_queued = 0;
+    for (int i = 0; i < node->num_entries; i++) {
+        if (node->entries[i].is_directory) {
+            node->subdirs[i] = new flatten_node;    // deleted with the tree if push_back throws
+            {
+                lock_guard<mutex> guard(pool.queues[self].lock);
+                pool.queues[self].tasks.push_back({node->entries[i].path, node->subdirs[i]});
+            }
+            // counted once queued: until this task is done, pending stays above 0
+            pool.pending++;
+            pool.queued++;
+            num_queued++;
+        }
+    }
+    if (num_queued > 0) {
+        lock_guard<mutex> guard(pool.idle_lock);    // a worker testing queued waits for this
+        if (num_queued == 1) {
+            pool.wake.notify_one();
+        } else {
+            pool.wake.notify_all();
+        }
+    }
+}
+
+// Function: delete_tree
+// Purpose: deletes the listings of node and of everything below it, node is left empty
+void delete_tree(flatten_node *node) {
+    for (int i = 0; i < node->num_entries; ++i) {
+        if ((node->subdirs != nullptr) && (node->subdirs[i] != nullptr)) {
+            delete_tree(node->subdirs[i]);
+            delete node->subdirs[i];
+        }
+    }
+    delete[] node->entries;
+    delete[] node->subdirs;
+    node->entries = nullptr;
+    node->subdirs = nullptr;
+    node->num_entries = 0;
+}
+
+// Function: resolve_tree
+//   node: listing tree of path
+//   path: the directory of node
+//   visited: directories seen so far, in the order of the serial flatten
+//   total_entries: reference to the number of entries kept so far
+// Purpose:
+// keeps each directory listed under the path the serial flatten lists it under:
+// the listing of a directory seen before is dropped, a directory seen first here but
+// listed by the workers through another path is listed now
+void resolve_tree(flatten_node *node, const string &path, dir_visit_set &visited,
+                  int &total_entries) {
+    if (!visited.first_visit(path)) {
+        delete_tree(node);
+        return;
+    }
+    if (!node->listed) {
+        delete_tree(node);      // nothing below it was listed
+        node->entries = get_directory_entries(path, node->num_entries);
+        node->listed = true;
+        node->subdirs = new flatten_node*[node->num_entries];
+        for (int i = 0; i < node->num_entries; i++) {
+            node->subdirs[i] = node->entries[i].is_directory ? new flatten_node : nullptr;
+        }
+    }
+    total_entries += node->num_entries;
+    for (int i = 0; i < node->num_entries; ++i) {
+        if (node->entries[i].is_directory) {
+            resolve_tree(node->subdirs[i], node->entries[i].path, visited, total_entries);
+        }
+    }
+}
+
+// Function: flatten_worker
+//   pool: the shared state
+//   self: index of this worker
+// Purpose:
+// keeps listing directories until there is no more work anywhere, sleeps while the
+// deques are empty but other workers are still listing (they may queue more).
+// Once the pool is stopped, the tasks are taken but not listed.
+void flatten_worker(flatten_pool &pool, int self) {
+    flatten_task task;
+    while (true) {
+        if (take_task(pool, self, task)) {
+            if (!pool.stopped) {
+                try {
+                    list_directory_task(pool, self, task);
+                } catch (...) {
+                    lock_guard<mutex> guard(pool.idle_lock);
+                    if (!pool.error) {
+                        pool.error = current_exception();
+                    }
+                    pool.stopped = true;
+                }
+            }
+            if (--pool.pending == 0) {
+                lock_guard<mutex> guard(pool.idle_lock);
+                pool.wake.notify_all();     // all done: wake everyone to return
+            }
+            continue;
+        }
+        unique_lock<mutex> idle(pool.idle_lock);
+        pool.wake.wait(idle, [&pool]() { return (pool.queued > 0) || (pool.pending == 0); });
+        if (pool.pending == 0) {
+            return;
+        }
+    }
+}
+
+// Function: fill_from_tree
+//   node: listing tree to copy from (deleted after copying)
+//   flattened_dir_info: array to fill
+//   insert_index: reference to the index at which to insert the next entry
+// Purpose:
+// same order as the serial flatten: files first, then each directory and its contents
+void fill_from_tree(flatten_node *node, dir_elm_info *flattened_dir_info, int &insert_index) {
+    for (int i = 0; i < node->num_entries; ++i) {
+        if (!node->entries[i].is_directory) {
+            flattened_dir_info[insert_index++] = move(node->entries[i]);
+        }
+    }
+    for (int i = 0; i < node->num_entries; ++i) {
+        if (node->entries[i].is_directory) {
+            flattened_dir_info[insert_index++] = move(node->entries[i]);
+            fill_from_tree(node->subdirs[i], flattened_dir_info, insert_index);
+        }
+    }
+    delete[] node->entries;
+    delete[] node->subdirs;
+    delete node;
+}
+
+// Function: start_threads
+//   workers: array of num_threads - 1 threads
+//   start: starts thread i (1..num_threads-1) of workers[i - 1]
+// Returns: number of threads running, the calling thread included: fewer than
+//          num_threads when the system cannot start more (the others do their work)
+int start_threads(thread *workers, int num_threads, const function<thread(int)> &start) {
+    int num_started = 1;    // the calling thread
+    try {
+        for (; num_started < num_threads; num_started++) {
+            workers[num_started - 1] = start(num_started);
+        }
+    } catch (const system_error &) {
+#ifdef DEBUG
+        cerr << "Started only " << num_started << " of " << num_threads << " threads." << endl;
+#endif
+    }
+    return num_started;
+}
+
+// --- Begin exported functions ---
+
+// Function: parallel_for
+//   count: number of jobs
+//   num_threads: number of threads (the calling thread is one of them)
+//   job: called once for each job 0..count-1
+// Purpose:
+// each thread takes the next job until there are none left, returns when all are done
+void parallel_for(int count, int num_threads, const function<void(int)> &job) {
+    atomic<int> next{0};
+    auto worker = [&]() {
+        for (int i = next++; i < count; i = next++) {
+            job(i);
+        }
+    };
+    thread *workers = new thread[num_threads - 1];
+    int num_started = start_threads(workers, num_threads, [&worker](int) { return thread(worker); });
+    worker();
+    for (int t = 0; t < num_started - 1; t++) {
+        workers[t].join();
+    }
+    delete[] workers;
+}
+
+// Function: flatten_directory_entries_parallel
+//   path: path to the directory to be flattened
+//   num_entries: output parameter to return the number of entries in the array
+//   num_threads: number of worker threads, 0 means one per hardware thread
+// Returns: the flattened array, in the same order as the serial flatten
+//          (nullptr if there are no entries)
+// Throws: the first exception thrown while listing, once all the threads are joined
+//
+// **NOTE**: the allocated array must be deleted by the caller
+dir_elm_info* flatten_directory_entries_parallel(const string &path, int &num_entries,
+                    int num_threads)
+{
+    if (num_threads <= 0) {
+        num_threads = thread::hardware_concurrency();
+        if (num_threads <= 0) {
+            num_threads = 1;    // hardware_concurrency() may not know
+        }
+    }
+
+    flatten_pool pool;
+    pool.num_workers = num_threads;
+    pool.queues = new worker_queue[num_threads];
+
+    flatten_node *root = new flatten_node;
+    pool.queues[0].tasks.push_back({path, root});
+    pool.pending = 1;
+
+    thread *workers = new thread[num_threads - 1];
+    int num_started = start_threads(workers, num_threads,
+                                    [&pool](int i) { return thread(flatten_worker, ref(pool), i); });
+    flatten_worker(pool, 0);    // the calling thread is worker 0
+    for (int i = 1; i < num_started; i++) {
+        workers[i - 1].join();
+    }
+    delete[] workers;
+    delete[] pool.queues;
+    if (pool.error) {
+        delete_tree(root);
+        delete root;
+        rethrow_exception(pool.error);
+    }
+
+#ifdef DEBUG
+    cerr << "Parallel flatten of: [" << path << "] with " << num_threads
+         << " threads found " << pool.total_entries << " entries." << endl;
+#endif
+    num_entries = pool.total_entries;
+    if (pool.skipped) {
+        // some directory was reached twice: keep the paths of the serial order
+        dir_visit_set visited;
+        num_entries = 0;
+        resolve_tree(root, path, visited, num_entries);
+    }
+    dir_elm_info *flattened_dir_info = nullptr;
+    if (num_entries > 0) {
+        flattened_dir_info = new dir_elm_info[num_entries];
+    }
+    int insert_index = 0;
+    fill_from_tree(root, flattened_dir_info, insert_index);
+    return flattened_dir_info;
+}
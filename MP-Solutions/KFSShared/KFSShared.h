@@ -0,0 +1,349 @@
+// File: KFSShared.h
+// Purpose: Declarations of the modules shared by all the copies of KFSLib
+//          (MP3, MP4, MP5, MP6 and New_KFSLib_ForMP5)
+// Functions exported:
+//      dir_visit_set class (in KFSVisit.cpp)
+//      dir_filter class (in KFSFilter.cpp)
+//      parent_indices, depths_of, export_ndjson, export_binary, exported_listing class
+//          (in KFSExport.cpp)
+//      write_snapshot, snapshot_time, mtime_of, dir_snapshot class (in KFSSnapshot.cpp)
+//      diff_trees (in KFSDiff.cpp)
+//      flatten_directory_entries_parallel, parallel_for (in KFSParallel.cpp)
+//
+// NOTE: not included on its own: each KFS.h includes it right after dir_elm_info.
+// The modules are compiled by each library against its own KFS.h (see the Makefiles),
+// they only use dir_elm_info and get_directory_entries, which all the copies declare.
+//
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <regex>
+#include <string_view>
+#include <vector>
+
+// Class: dir_visit_set (in KFSVisit.cpp)
+// The directories already listed by a traversal, by (device, inode): each physical
+// directory is listed once, even when it is reached again through a symbolic link
+// or a bind mount, and a link to a parent directory does not loop forever.
+// Can be used by several threads at the same time.
+// Usage:
+//      dir_visit_set visited;
+//      if (visited.first_visit(dir_path)) { ... list dir_path ... }
+class dir_visit_set {
+    static const int VISIT_SHARDS = 64;     // a lock and a hash table each
+    struct shard {
+        mutex lock;
+        unsigned long long *slots;  // (device, inode) pairs, inode 0: empty slot
+        int capacity;               // in pairs, a power of 2
+        int size;
+    };
+    shard shards[VISIT_SHARDS];
+    bool one_file_system;
+    atomic<long long> root_device;  // device of the first directory, -1: none yet
+
+public:
+    // one_file_system: directories on another device than the first directory
+    //                  visited are not listed (like find -xdev)
+    dir_visit_set(bool one_file_system = false);
+    ~dir_visit_set();
+
+    // the set belongs to one traversal
+    dir_visit_set(const dir_visit_set &other) = delete;
+    dir_visit_set& operator=(const dir_visit_set &other) = delete;
+
+    // Function: first_visit
+    //   dir_path: a directory about to be listed
+    // Returns: true if the directory should be listed: it was not visited before
+    //          (through any path), and it can be stat'ed
+    bool first_visit(const string &dir_path);
+    // same, for a directory already stat'ed by the caller (st_dev, st_ino)
+    bool first_visit(unsigned long long device_id, unsigned long long inode);
+
+    // Returns: number of directories visited
+    long size();
+};
+
+// Class: dir_filter (in KFSFilter.cpp)
+// Which entries a traversal keeps. The filter is applied to each listing during
+// the walk: an excluded or pruned directory is never opened.
+// Usage:
+//      dir_filter filter;
+//      filter.prune(".git");
+//      filter.prune("node_modules");
+//      filter.include("*.cpp");
+//      num_entries = filter.apply(entries, num_entries);     // for each listing
+//      if (filter.descends(entries[i], depth)) { ... list entries[i] ... }
+class dir_filter {
+    vector<string> include_globs;
+    vector<regex> include_regexes;
+    vector<string> exclude_globs;
+    vector<regex> exclude_regexes;
+    vector<string> prune_globs;
+    int max_depth;              // -1: no limit
+    bool one_file_system;
+
+public:
+    dir_filter();               // keeps everything
+
+    // when any include is given, a file is kept only if its name matches one of them
+    // (directories are always kept, to reach the files below them)
+    void include(const string &glob);               // shell wildcards: *, ?, [...]
+    bool include_regex(const string &pattern);      // matched anywhere in the name,
+                                                    // false if pattern is not valid
+    // entries whose name matches are skipped, a directory with all of its contents
+    void exclude(const string &glob);
+    bool exclude_regex(const string &pattern);      // matched anywhere in the name,
+                                                    // false if pattern is not valid
+    // directories whose name matches are kept, but their contents are not listed
+    void prune(const string &glob);
+    // directories at depth are not listed (0: the entries of the top directory)
+    void set_max_depth(int depth);
+    // directories on another file system than the top directory are not listed
+    void set_one_file_system(bool one_file_system);
+    bool stays_on_file_system() const { return one_file_system; }
+
+    bool keeps_everything() const;
+    // Function: keeps
+    // Returns: true if entry passes the include and exclude patterns
+    bool keeps(const dir_elm_info &entry) const;
+    // Function: descends
+    //   depth: depth of entry (0: an entry of the top directory)
+    // Returns: true if entry is a directory whose contents should be listed
+    bool descends(const dir_elm_info &entry, int depth) const;
+    // Function: apply
+    // Purpose: removes the entries that are not kept from a listing, in place, in order
+    // Returns: the number of entries kept
+    int apply(dir_elm_info *entries, int num_entries) const;
+
+    // command line options of the programs: -include GLOB, -regex PATTERN,
+    // -exclude GLOB, -exclude_regex PATTERN, -prune GLOB, -maxdepth N, and the flag -xdev
+    static bool is_option(const string &option);
+    static bool is_flag(const string &option);
+    // Returns: false if value is not valid for option (an error is printed)
+    bool add_option(const string &option, const string &value);
+    void add_flag(const string &option);
+};
+
+// Function: parent_indices
+//   entries: pointer to a flattened array of dir_elm_info
+//   num_entries: number of entries in the array
+// Precondition: each directory is before its contents in the array
+// Returns: array of num_entries, index of the directory holding each entry,
+//          -1 for the entries of the top directory
+//
+// **NOTE**: the allocated array must be deleted by the caller
+int* parent_indices(const dir_elm_info *entries, int num_entries);
+
+// Function: depths_of
+//   parents: parent index of each entry (see parent_indices)
+//   num_entries: number of entries
+// Returns: array of num_entries, depth of each entry, 0 for the entries of the top directory
+//
+// **NOTE**: the allocated array must be deleted by the caller
+int* depths_of(const int *parents, int num_entries);
+
+// Function: export_ndjson
+//   out: output stream
+//   entries: pointer to a flattened array of dir_elm_info
+//   num_entries: number of entries in the array
+// Purpose:
+// writes one JSON object per entry, one per line, with path, name,
+// is_directory, parent (index in the array) and depth
+void export_ndjson(ostream &out, const dir_elm_info *entries, int num_entries);
+
+// Function: export_ndjson
+//   file: path of the file to write
+// Returns: false if the file could not be written
+bool export_ndjson(const string &file, const dir_elm_info *entries, int num_entries);
+
+// Function: export_binary
+//   file: path of the file to write
+//   entries: pointer to a flattened array of dir_elm_info
+//   num_entries: number of entries in the array
+// Returns: false if the file could not be written
+// Purpose:
+// writes the entries as length-prefixed binary records, read back with exported_listing
+bool export_binary(const string &file, const dir_elm_info *entries, int num_entries);
+
+// An entry read back from a binary export file or a snapshot
+struct exported_entry {
+    string_view path;       // points into the mapped file
+    string_view name;       // points into the mapped file
+    bool is_directory;
+    int parent;             // index of the directory holding the entry, -1: top directory
+    int depth;              // 0: in the top directory
+};
+
+// Class: exported_listing
+// A binary export file, memory-mapped, entries are read in order without any conversion.
+// Usage:
+//      exported_listing listing(file);
+//      exported_entry entry;
+//      while (listing.next(entry)) { ... }
+class exported_listing {
+    char *map;
+    long map_size;
+    const char *position;   // next record
+    int num_entries;
+    int num_read;
+
+public:
+    exported_listing(const string &file);
+    ~exported_listing();
+
+    // the mapping cannot be shared
+    exported_listing(const exported_listing &other) = delete;
+    exported_listing& operator=(const exported_listing &other) = delete;
+
+    bool is_open() const { return map != nullptr; }
+    int size() const { return num_entries; }
+
+    // Function: next
+    //   entry: output, the next entry, valid as long as the listing is
+    // Returns: false when there are no more entries (or the file is damaged)
+    bool next(exported_entry &entry);
+};
+
+// Function: write_snapshot (in KFSSnapshot.cpp)
+//   file: path of the file to write (replaced if it exists)
+//   entries: pointer to a flattened array of dir_elm_info
+//   num_entries: number of entries in the array
+//   listed_at: snapshot_time() before the entries were listed, 0: unknown (the
+//              snapshot then has no subtree mtimes, a diff never skips a subtree)
+// Precondition: entries are in the order of flatten_directory
+// Returns: false if the file could not be written
+// Purpose:
+// writes the entries as a snapshot, an offset table and a packed string heap,
+// read back with dir_snapshot
+bool write_snapshot(const string &file, const dir_elm_info *entries, int num_entries,
+                    long long listed_at = 0);
+
+// Function: snapshot_time (in KFSSnapshot.cpp)
+// Returns: the current time, for the listed_at parameter of write_snapshot
+long long snapshot_time();
+
+// Function: mtime_of (in KFSSnapshot.cpp)
+//   dir_path: path to a directory
+// Returns: its modification time, in the unit of snapshot_time, 0 if it could not be read
+long long mtime_of(const string &dir_path);
+
+// Class: dir_snapshot (in KFSSnapshot.cpp)
+// A snapshot file, memory-mapped and shared: entry i is read in O(1), in place,
+// without reading the rest of the file. Many processes can map the same snapshot.
+// Usage:
+//      dir_snapshot snapshot(file);
+//      exported_entry entry;
+//      if (snapshot.entry(i, entry)) { ... }
+class dir_snapshot {
+    char *map;
+    long map_size;
+    const char *records;    // the offset table
+    const char *heap;       // the string heap
+    unsigned long long heap_size;
+    int num_entries;
+
+public:
+    dir_snapshot(const string &file);
+    ~dir_snapshot();
+
+    // the mapping cannot be shared
+    dir_snapshot(const dir_snapshot &other) = delete;
+    dir_snapshot& operator=(const dir_snapshot &other) = delete;
+
+    bool is_open() const { return map != nullptr; }
+    int size() const { return num_entries; }
+
+    // Function: entry
+    //   index: 0 to size() - 1, the index of the entry in the flattened array
+    //   entry: output, valid as long as the snapshot is
+    // Returns: false if there is no such entry (or the file is damaged)
+    bool entry(int index, exported_entry &entry) const;
+
+    // Function: subtree_end
+    // Returns: the index after the last entry below entry index (index + 1 for a file)
+    int subtree_end(int index) const;
+
+    // Function: subtree_mtime
+    // Returns: the latest modification time of the directories from entry index to its
+    //          subtree end, 0 if unknown (and for a file)
+    long long subtree_mtime(int index) const;
+};
+
+// A difference between two trees, reported by diff_trees
+enum diff_change {
+    DIFF_ADDED,             // only in the new tree
+    DIFF_REMOVED,           // only in the old tree
+    DIFF_TYPE_CHANGED       // a file in one tree, a directory in the other
+};
+
+struct diff_entry {
+    diff_change change;
+    string_view path;       // relative to the top directory, e.g., "KFSLib/KFS.h"
+    bool is_directory;      // in the new tree (in the old tree for DIFF_REMOVED)
+};
+
+// Called once per difference, the path is valid during the call only
+typedef function<void(const diff_entry &entry)> diff_reporter;
+
+// Number of differences found by a diff
+struct diff_counts {
+    long added;
+    long removed;
+    long type_changed;
+    long subtrees_skipped;  // directories whose subtree mtime had not changed
+};
+
+// Function: diff_trees (in KFSDiff.cpp)
+//   old_entries, new_entries: flattened arrays (as from flatten_directory), or snapshots
+//   report: called for each difference, in the order of the new tree
+// Precondition: the entries of each directory are sorted by name (get_directory_entries)
+// Returns: the number of differences of each kind
+// Purpose:
+// merges the two trees in one pass, directory by directory. A directory of both snapshots
+// with the same subtree mtime is skipped without reading what is below it.
+diff_counts diff_trees(const dir_elm_info *old_entries, int num_old,
+                       const dir_elm_info *new_entries, int num_new, const diff_reporter &report);
+diff_counts diff_trees(const dir_snapshot &old_tree, const dir_snapshot &new_tree,
+                       const diff_reporter &report);
+diff_counts diff_trees(const dir_snapshot &old_tree, const dir_elm_info *new_entries, int num_new,
+                       const diff_reporter &report);
+diff_counts diff_trees(const dir_elm_info *old_entries, int num_old, const dir_snapshot &new_tree,
+                       const diff_reporter &report);
+
+// Function: diff_trees (in KFSDiff.cpp)
+//   old_tree / new_tree: a snapshot
+//   new_path / old_path: a directory, as it is now
+//   filter: entries listed in the directory (the filter the snapshot was written with)
+// Returns: the same differences as with the directory flattened with filter
+// Purpose:
+// the directory is listed as the diff goes: a directory whose snapshot subtree has
+// not been modified since the snapshot (its directories are stat'ed) is not listed.
+diff_counts diff_trees(const dir_snapshot &old_tree, const string &new_path, const dir_filter &filter,
+                       const diff_reporter &report);
+diff_counts diff_trees(const string &old_path, const dir_snapshot &new_tree, const dir_filter &filter,
+                       const diff_reporter &report);
+
+// Function: flatten_directory_entries_parallel (in KFSParallel.cpp)
+//   path: path to the directory to be flattened
+//   num_entries: output parameter to return the number of entries in the array
+//   num_threads: number of worker threads, 0 means one per hardware thread
+// Precondition: path is a valid directory path
+// Postcondition: returns the flattened array, in the order of the serial flatten: in each
+//                directory, the files, then each subdirectory followed by its contents
+// Purpose:
+// each directory is listed only once, and subdirectories are listed concurrently by a
+// work-stealing thread pool. An exception thrown while listing is thrown again here.
+//
+// **NOTE**: the allocated array must be deleted by the caller
+dir_elm_info* flatten_directory_entries_parallel(const string &path, int &num_entries,
+                    int num_threads = 0);
+
+// Function: parallel_for (in KFSParallel.cpp)
+//   count: number of jobs
+//   num_threads: number of threads, at least 1 (the calling thread is one of them)
+//   job: called once for each job 0..count-1, jobs may run at the same time
+// Purpose:
+// each thread takes the next job until there are none left, returns when all are done
+void parallel_for(int count, int num_threads, const function<void(int)> &job);
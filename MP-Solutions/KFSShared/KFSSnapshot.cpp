@@ -0,0 +1,283 @@
+// File: KFSSnapshot.cpp
+// Snapshot of a flattened directory listing: a file that any number of processes
+// can map and read entry i of, in O(1), without reading the file or converting it
+//
+// Snapshot file format (integers in the native byte order of the machine):
+//      header, SNAPSHOT_HEADER_SIZE bytes:
+//          "KFSSNP02"                  8 bytes
+//          number of entries           4 bytes
+//          size of a record            4 bytes (SNAPSHOT_RECORD_SIZE)
+//          offset of the string heap   8 bytes (from the start of the file)
+//          size of the string heap     8 bytes
+//      offset table, one record per entry, in the order of the array:
+//          path offset, name offset    8 bytes + 8 bytes (in the string heap)
+//          subtree mtime               8 bytes (see below, 0: unknown, and for files)
+//          path length, name length    4 bytes + 4 bytes
+//          parent                      4 bytes (index of the containing directory, -1: none)
+//          depth                       4 bytes (0: in the top directory)
+//          subtree end                 4 bytes (index after the last entry below a directory)
+//          is_directory                1 byte, then 3 bytes of padding (0)
+//      string heap: the paths, packed, no separators. A name is the end of its path,
+//      and points there; it is stored on its own only when it is not.
+// Records are at a fixed size and 8 byte aligned: entry i is at header + i * record size,
+// and is read in place from the mapping (pages are only read when they are touched).
+//
+// The entries below a directory follow it in the array (as from flatten_directory),
+// from the directory to its subtree end. The subtree mtime of a directory is the latest
+// modification time (ns) of the directories of that range, itself included: adding,
+// removing or renaming an entry anywhere below changes it, so a diff can skip a
+// subtree whose subtree mtime has not changed (see KFSDiff.cpp). A directory modified
+// after the listing started may have changed after it was listed: its subtree mtime,
+// and those of the directories above it, are recorded as unknown, never skipped.
+//
+// The file is written under a temporary name, then renamed: a process mapping the
+// snapshot sees the old file or the new one, never a part of one.
+//
+// mmap from the Linux manual
+//      https://man7.org/linux/man-pages/man2/mmap.2.html
+// rename from the Linux manual
+//      https://man7.org/linux/man-pages/man2/rename.2.html
+//
+#include "KFS.h"
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Local constants
+const char SNAPSHOT_MAGIC[] = "KFSSNP02";
+const int SNAPSHOT_MAGIC_SIZE = 8;
+const int SNAPSHOT_HEADER_SIZE = 32;
+const long long RACY_MARGIN = 1000000000LL;    // ns, file system timestamps lag the clock
+
+// An entry of the offset table, as it is in the file
+struct snapshot_record {
+    unsigned long long path_offset;
+    unsigned long long name_offset;
+    long long subtree_mtime;
+    unsigned int path_length;
+    unsigned int name_length;
+    int parent;
+    int depth;
+    int subtree_end;
+    unsigned char is_directory;
+    unsigned char padding[3];
+};
+
+const int SNAPSHOT_RECORD_SIZE = sizeof(snapshot_record);
+static_assert(sizeof(snapshot_record) == 48, "snapshot records are 48 bytes");
+
+// The header, as it is in the file
+struct snapshot_header {
+    char magic[SNAPSHOT_MAGIC_SIZE];
+    unsigned int num_entries;
+    unsigned int record_size;
+    unsigned long long heap_offset;
+    unsigned long long heap_size;
+};
+
+static_assert(sizeof(snapshot_header) == SNAPSHOT_HEADER_SIZE, "the snapshot header is 32 bytes");
+
+// Function: name_in_path
+// Returns: true if name is the last name_length bytes of path, and so is not stored
+bool name_in_path(const dir_elm_info &entry) {
+    return (entry.path.size() >= entry.name.size())
+        && (entry.path.compare(entry.path.size() - entry.name.size(), string::npos, entry.name) == 0);
+}
+
+// --- Begin exported functions ---
+
+// Function: mtime_of
+//   dir_path: path to a directory
+// Returns: its modification time, ns since the epoch, 0 if it could not be read
+long long mtime_of(const string &dir_path) {
+    struct stat info;
+    if (stat(dir_path.c_str(), &info) != 0) {
+        return 0;
+    }
+    return info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+}
+
+// Function: snapshot_time
+// Returns: the current time, in the unit of the listed_at parameter of write_snapshot
+long long snapshot_time() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Function: write_snapshot
+//   file: path of the file to write (replaced if it exists)
+//   entries: pointer to a flattened array of dir_elm_info
+//   num_entries: number of entries in the array
+//   listed_at: snapshot_time() before the entries were listed, 0: unknown (no subtree
+//              mtimes are recorded)
+// Returns: false if the file could not be written
+bool write_snapshot(const string &file, const dir_elm_info *entries, int num_entries,
+                    long long listed_at) {
+    int *parents = parent_indices(entries, num_entries);
+    int *depths = depths_of(parents, num_entries);
+
+    // subtree ends and mtimes, children before their parent (-1: unknown)
+    int *ends = new int[num_entries];
+    long long *mtimes = new long long[num_entries];
+    for (int i = 0; i < num_entries; i++) {
+        ends[i] = i + 1;
+        mtimes[i] = 0;
+        if (entries[i].is_directory && (listed_at != 0)) {
+            mtimes[i] = mtime_of(entries[i].path);
+            if ((mtimes[i] == 0) || (mtimes[i] >= listed_at - RACY_MARGIN)) {
+                mtimes[i] = -1;     // may have changed after it was listed
+            }
+        }
+    }
+    for (int i = num_entries - 1; i >= 0; i--) {
+        int parent = parents[i];
+        if (parent < 0) {
+            continue;
+        }
+        ends[parent] = max(ends[parent], ends[i]);
+        if (entries[i].is_directory && (mtimes[parent] > 0)) {
+            mtimes[parent] = (mtimes[i] < 0) ? -1 : max(mtimes[parent], mtimes[i]);
+        }
+    }
+
+    // the offset table first: the strings are then written in the same order
+    snapshot_record *records = new snapshot_record[num_entries];
+    unsigned long long heap_size = 0;
+    for (int i = 0; i < num_entries; i++) {
+        snapshot_record &record = records[i];
+        memset(&record, 0, sizeof(record));
+        record.path_offset = heap_size;
+        record.path_length = entries[i].path.size();
+        heap_size += record.path_length;
+        record.name_length = entries[i].name.size();
+        if (name_in_path(entries[i])) {
+            record.name_offset = record.path_offset + record.path_length - record.name_length;
+        } else {
+            record.name_offset = heap_size;
+            heap_size += record.name_length;
+        }
+        record.parent = parents[i];
+        record.depth = depths[i];
+        record.subtree_end = ends[i];
+        record.subtree_mtime = max(mtimes[i], 0LL);
+        record.is_directory = entries[i].is_directory ? 1 : 0;
+    }
+    delete[] mtimes;
+    delete[] ends;
+    delete[] depths;
+    delete[] parents;
+
+    snapshot_header header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE);
+    header.num_entries = num_entries;
+    header.record_size = SNAPSHOT_RECORD_SIZE;
+    header.heap_offset = SNAPSHOT_HEADER_SIZE + (unsigned long long)num_entries * SNAPSHOT_RECORD_SIZE;
+    header.heap_size = heap_size;
+
+    string temporary = file + ".tmp";
+    ofstream out(temporary, ios::binary | ios::trunc);
+    if (out) {
+        out.write((const char *)&header, SNAPSHOT_HEADER_SIZE);
+        out.write((const char *)records, (long)num_entries * SNAPSHOT_RECORD_SIZE);
+        for (int i = 0; i < num_entries; i++) {
+            out.write(entries[i].path.data(), entries[i].path.size());
+            if (!name_in_path(entries[i])) {
+                out.write(entries[i].name.data(), entries[i].name.size());
+            }
+        }
+        out.close();
+    }
+    delete[] records;
+    if (!out || (rename(temporary.c_str(), file.c_str()) != 0)) {
+        cerr << "Error: cannot write snapshot file: " << file << endl;
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+dir_snapshot::dir_snapshot(const string &file) :
+    map(nullptr), map_size(0), records(nullptr), heap(nullptr), heap_size(0), num_entries(0)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << "Error: cannot open snapshot file: " << file << endl;
+        return;
+    }
+    struct stat info;
+    if ((fstat(fd, &info) != 0) || (info.st_size < SNAPSHOT_HEADER_SIZE)) {
+        close(fd);
+        cerr << "Error: not a snapshot file: " << file << endl;
+        return;
+    }
+    void *addr = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);      // the mapping stays valid
+    if (addr == MAP_FAILED) {
+        return;
+    }
+    map = (char *)addr;
+    map_size = info.st_size;
+
+    // the header is checked once, the records are not read before they are used
+    const snapshot_header *header = (const snapshot_header *)map;
+    unsigned long long table_end = SNAPSHOT_HEADER_SIZE
+                                 + (unsigned long long)header->num_entries * SNAPSHOT_RECORD_SIZE;
+    if ((memcmp(header->magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0)
+        || (header->record_size != SNAPSHOT_RECORD_SIZE) || (header->heap_offset < table_end)
+        || (header->heap_offset > (unsigned long long)map_size)
+        || (header->heap_size > (unsigned long long)map_size - header->heap_offset)) {
+        cerr << "Error: not a snapshot file: " << file << endl;
+        munmap(map, map_size);
+        map = nullptr;
+        map_size = 0;
+        return;
+    }
+    records = map + SNAPSHOT_HEADER_SIZE;
+    heap = map + header->heap_offset;
+    heap_size = header->heap_size;
+    num_entries = header->num_entries;
+}
+
+dir_snapshot::~dir_snapshot() {
+    if (map != nullptr) {
+        munmap(map, map_size);
+    }
+}
+
+bool dir_snapshot::entry(int index, exported_entry &entry) const {
+    if ((index < 0) || (index >= num_entries)) {
+        return false;
+    }
+    const snapshot_record &record = ((const snapshot_record *)records)[index];
+    if ((record.path_offset > heap_size) || (record.path_length > heap_size - record.path_offset)
+        || (record.name_offset > heap_size) || (record.name_length > heap_size - record.name_offset)) {
+        return false;   // damaged file
+    }
+    entry.path = string_view(heap + record.path_offset, record.path_length);
+    entry.name = string_view(heap + record.name_offset, record.name_length);
+    entry.is_directory = (record.is_directory != 0);
+    entry.parent = record.parent;
+    entry.depth = record.depth;
+    return true;
+}
+
+int dir_snapshot::subtree_end(int index) const {
+    if ((index < 0) || (index >= num_entries)) {
+        return index + 1;
+    }
+    int end = ((const snapshot_record *)records)[index].subtree_end;
+    return ((end > index) && (end <= num_entries)) ? end : index + 1;
+}
+
+long long dir_snapshot::subtree_mtime(int index) const {
+    if ((index < 0) || (index >= num_entries)) {
+        return 0;
+    }
+    return ((const snapshot_record *)records)[index].subtree_mtime;
+}
@@ -0,0 +1,119 @@
+// File: KFSVisit.cpp
+// Implementation of the dir_visit_set class: the directories a traversal has listed
+//
+// A directory is identified by its (device, inode) pair, not by its path: through
+// a symbolic link or a bind mount, the same directory has several paths, and a
+// link to one of its parents makes the paths go on forever. A traversal asks
+// first_visit before listing a directory, and lists it only the first time.
+//
+// The set is an open addressing hash table (linear probing) of (device, inode)
+// pairs, 16 bytes per directory, split in VISIT_SHARDS shards with a lock each,
+// so threads listing different directories rarely wait for each other.
+// Inode 0 is never used by a file system, it marks the empty slots.
+//
+// stat from the Linux manual
+//      https://man7.org/linux/man-pages/man2/stat.2.html
+// find -xdev from the GNU findutils manual
+//      https://www.gnu.org/software/findutils/manual/html_mono/find.html#Filesystems
+//
+#include "KFS.h"
+#include <sys/stat.h>
+
+// Local constants
+const int INITIAL_SHARD_CAPACITY = 64;      // pairs, a power of 2
+
+// Function: mix_key
+// Purpose: hash of a (device, inode) pair (the splitmix64 finalizer)
+unsigned long long mix_key(unsigned long long device, unsigned long long inode) {
+    unsigned long long h = device * 0x9E3779B97F4A7C15ULL ^ inode;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+// Function: shard_insert
+//   slots: table of 2 * capacity words, (device, inode) pairs
+// Returns: false if the pair was already in the table
+bool shard_insert(unsigned long long *slots, int capacity, unsigned long long hash,
+                  unsigned long long device, unsigned long long inode) {
+    for (int i = hash & (capacity - 1); ; i = (i + 1) & (capacity - 1)) {
+        if (slots[2 * i + 1] == 0) {
+            slots[2 * i] = device;
+            slots[2 * i + 1] = inode;
+            return true;
+        }
+        if ((slots[2 * i] == device) && (slots[2 * i + 1] == inode)) {
+            return false;
+        }
+    }
+}
+
+// --- Begin exported functions ---
+
+dir_visit_set::dir_visit_set(bool one_file_system) :
+    one_file_system(one_file_system), root_device(-1)
+{
+    for (int s = 0; s < VISIT_SHARDS; s++) {
+        shards[s].slots = nullptr;
+        shards[s].capacity = 0;
+        shards[s].size = 0;
+    }
+}
+
+dir_visit_set::~dir_visit_set() {
+    for (int s = 0; s < VISIT_SHARDS; s++) {
+        delete[] shards[s].slots;
+    }
+}
+
+bool dir_visit_set::first_visit(const string &dir_path) {
+    struct stat info;
+    if (stat(dir_path.c_str(), &info) != 0) {
+#ifdef DEBUG
+        cerr << "Cannot stat directory, not listed: " << dir_path << endl;
+#endif
+        return false;   // e.g., too many levels of symbolic links
+    }
+    return first_visit(info.st_dev, info.st_ino);
+}
+
+bool dir_visit_set::first_visit(unsigned long long device_id, unsigned long long inode) {
+    long long device = device_id;
+    long long expected = -1;
+    if (!root_device.compare_exchange_strong(expected, device) && one_file_system
+        && (expected != device)) {
+        return false;   // on another file system than the first directory
+    }
+
+    unsigned long long hash = mix_key(device_id, inode);
+    shard &part = shards[hash >> 58];       // the top bits: VISIT_SHARDS is 64
+    lock_guard<mutex> guard(part.lock);
+    if (2 * (part.size + 1) > part.capacity) {
+        // keep the table at most half full
+        int capacity = (part.capacity == 0) ? INITIAL_SHARD_CAPACITY : part.capacity * 2;
+        unsigned long long *slots = new unsigned long long[2 * capacity]();
+        for (int i = 0; i < part.capacity; i++) {
+            if (part.slots[2 * i + 1] != 0) {
+                unsigned long long old_hash = mix_key(part.slots[2 * i], part.slots[2 * i + 1]);
+                shard_insert(slots, capacity, old_hash, part.slots[2 * i], part.slots[2 * i + 1]);
+            }
+        }
+        delete[] part.slots;
+        part.slots = slots;
+        part.capacity = capacity;
+    }
+    if (!shard_insert(part.slots, part.capacity, hash, device_id, inode)) {
+        return false;   // already listed through another path
+    }
+    part.size++;
+    return true;
+}
+
+long dir_visit_set::size() {
+    long total = 0;
+    for (int s = 0; s < VISIT_SHARDS; s++) {
+        lock_guard<mutex> guard(shards[s].lock);
+        total += shards[s].size;
+    }
+    return total;
+}
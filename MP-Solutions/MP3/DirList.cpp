@@ -2,9 +2,14 @@
 // Breadth-first-traversal of file system, print names
 //
 #include "KFSLib/KFS.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
 
-extern int num_subdir(const string &dir_path);
-extern int num_items(const string &dir_path);
+// pending entries of the breadth-first print kept in memory, unless -frontier is given
+const int DEFAULT_FRONTIER = 100000;
 
 // function: print_dir_entries
 // print the names of the entries in a directory
@@ -25,25 +30,146 @@ void print_dir_entries(const string path, string blanks, const dir_elm_info *ent
     }
 }
 
+// An entry waiting to be printed by depth_first_print or breadth_first_print
+struct pending_entry {
+    string path;
+    bool is_directory;
+    int depth;          // level in the directory tree (for indentation)
+};
+
+// Stack of pending entries for depth_first_print, a growable array
+struct pending_stack {
+    pending_entry *items;
+    int size;
+    int capacity;
+};
+
+// function: stack_push
+// add an entry on top of the stack, growing the array when it is full
+void stack_push(pending_stack &stack, const pending_entry &entry) {
+    if (stack.size == stack.capacity) {
+        int new_capacity = (stack.capacity == 0) ? 16 : stack.capacity * 2;
+        pending_entry *bigger = new pending_entry[new_capacity];
+        for (int i = 0; i < stack.size; i++) {
+            bigger[i] = move(stack.items[i]);
+        }
+        delete[] stack.items;
+        stack.items = bigger;
+        stack.capacity = new_capacity;
+    }
+    stack.items[stack.size++] = entry;
+}
+
 // function: depth_first_print 
-// print the directory entries in depth-first order (based on recursion)
+// print the directory entries in depth-first order (based on an explicit stack)
+// The entries of a directory are pushed in reverse order, so they are popped
+// (printed, or listed if a directory) in order, each after all of the contents
+// of the entries before it. A listing is deleted as soon as its entries are pushed,
+// and the depth of the tree is only limited by memory, not by the call stack.
+// Entries not kept by filter are not printed, and a directory is listed only
+// if filter descends into it (a pruned directory is printed in its parent's listing).
+// Each physical directory is listed once: reached again through a symbolic link or
+// a bind mount, it is only printed in its parent's listing (see dir_visit_set).
 // parameters:
 //   dir_path: path of the directory to print
-//   depth: current depth in the directory tree (for indentation)
+//   depth: depth of dir_path in the directory tree (for indentation)
+//   filter: entries to print (see dir_filter)
 // return: none 
-void depth_first_print(const string &dir_path, int depth) {
+void depth_first_print(const string &dir_path, int depth, const dir_filter &filter) {
+    pending_stack stack = {nullptr, 0, 0};
+    stack_push(stack, {dir_path, true, depth});
+    dir_visit_set visited(filter.stays_on_file_system());
+
+    while (stack.size > 0) {
+        pending_entry entry = move(stack.items[--stack.size]);
+        string blanks(entry.depth * 2, ' ');
+        if (!entry.is_directory) {
+            cout << blanks << entry.path << ": is a file" << endl;
+            continue;
+        }
+        if (!visited.first_visit(entry.path)) {
+            continue;   // already listed through another path
+        }
+        // get all entries of the directory and print them,
+        // then its entries are printed (and subdirectories listed) one by one
+        int num_entries = 0;
+        dir_elm_info* entries = get_directory_entries(entry.path, num_entries);
+        num_entries = filter.apply(entries, num_entries);
+        print_dir_entries(entry.path, blanks, entries, num_entries);
+        for (int i = num_entries - 1; i >= 0; i--) {
+            if (!entries[i].is_directory || filter.descends(entries[i], entry.depth - depth)) {
+                stack_push(stack, {entries[i].path, entries[i].is_directory, entry.depth + 1});
+            }
+        }
+        delete[] entries;
+    }
+    delete[] stack.items;
+}
+
+// function: depth_first_collect
+// collect the directory entries in depth-first order: each entry, and right
+// after a directory, all of its contents (each directory is before its contents)
+// parameters:
+//   dir_path: path of the directory to collect
+//   collected: reference to the growable array to append to
+//   num_collected: reference to the number of entries in the array
+//   capacity: reference to the size of the array
+//   filter: entries to collect (see dir_filter)
+//   depth: depth of the entries of dir_path (0: the top directory)
+//   visited: directories already collected, each physical directory is collected once
+// return: none
+void depth_first_collect(const string &dir_path, dir_elm_info *&collected,
+                         int &num_collected, int &capacity, const dir_filter &filter, int depth,
+                         dir_visit_set &visited) {
+    if (!visited.first_visit(dir_path)) {
+        return;     // already collected through another path
+    }
     int num_entries = 0;
-    string blanks(depth * 2, ' ');
-    // get all entries of currentdir_path
     dir_elm_info* entries = get_directory_entries(dir_path, num_entries);
-    // print the entries, and then, recursively perform for each subdirectory
-    print_dir_entries(dir_path, blanks, entries, num_entries);
-    if (num_entries > 0) {
+    num_entries = filter.apply(entries, num_entries);
+    for (int i = 0; i < num_entries; i++) {
+        if (num_collected == capacity) {
+            collected = grow_entries(collected, num_collected, capacity);
+        }
+        collected[num_collected++] = entries[i];
+        if (filter.descends(entries[i], depth)) {
+            depth_first_collect(entries[i].path, collected, num_collected, capacity, filter, depth + 1,
+                                visited);
+        }
+    }
+    delete[] entries;
+}
+
+// function: flatten_collect
+// collect the directory entries in the order of flatten_directory (the order a snapshot
+// is written in): the files of a directory by name, then each of its directories by
+// name, followed by all of its contents
+// parameters: the same as depth_first_collect
+// return: none
+void flatten_collect(const string &dir_path, dir_elm_info *&collected,
+                     int &num_collected, int &capacity, const dir_filter &filter, int depth,
+                     dir_visit_set &visited) {
+    if (!visited.first_visit(dir_path)) {
+        return;     // already collected through another path
+    }
+    int num_entries = 0;
+    dir_elm_info* entries = get_directory_entries(dir_path, num_entries);
+    num_entries = filter.apply(entries, num_entries);
+    sort(entries, entries + num_entries, [](const dir_elm_info &a, const dir_elm_info &b) {
+        return a.name < b.name;
+    });
+    for (int pass = 0; pass < 2; pass++) {     // files first, then directories
         for (int i = 0; i < num_entries; i++) {
-            if (entries[i].is_directory) {
-                depth_first_print(entries[i].path, depth + 1);
-            } else {
-                cout << blanks << "  " << entries[i].path << ": is a file" << endl;
+            if (entries[i].is_directory != (pass == 1)) {
+                continue;
+            }
+            if (num_collected == capacity) {
+                collected = grow_entries(collected, num_collected, capacity);
+            }
+            collected[num_collected++] = entries[i];
+            if (entries[i].is_directory && filter.descends(entries[i], depth)) {
+                flatten_collect(entries[i].path, collected, num_collected, capacity, filter, depth + 1,
+                                visited);
             }
         }
     }
@@ -57,60 +183,284 @@ dir_elm_info* traverse_dir(const string path_name, int &dir_size, string blanks)
     return entries;
 }
 
-int total_sub_elms(dir_elm_info *entries, int num_entries) {
-    int total = 0;
-    for (int i = 0; i < num_entries; i++) {
-        if (entries[i].is_directory) {
-            total += num_items(entries[i].path);
+// FIFO queue of pending entries with bounded memory: at most capacity entries
+// are in memory (the oldest ones), newer entries wait in a temporary spill file,
+// in order, and are read back when the entries in memory are used up.
+struct pending_queue {
+    pending_entry *ring;    // in-memory part, a circular array
+    int capacity;
+    int head;               // index of the oldest entry in ring
+    int count;              // number of entries in ring
+    FILE *spill;            // newer entries, nullptr until needed
+    long spill_read;        // offset of the oldest entry in spill
+    long spill_write;       // offset after the newest entry in spill
+    bool spill_writing;     // last spill operation was a write (a seek is needed to switch)
+    long num_spilled;       // total entries that went through spill
+};
+
+// function: queue_init
+// start with an empty queue that keeps at most capacity entries in memory
+void queue_init(pending_queue &queue, int capacity) {
+    queue.capacity = capacity;
+    queue.ring = new pending_entry[capacity];
+    queue.head = 0;
+    queue.count = 0;
+    queue.spill = nullptr;
+    queue.spill_read = 0;
+    queue.spill_write = 0;
+    queue.spill_writing = true;
+    queue.num_spilled = 0;
+}
+
+// function: queue_free
+void queue_free(pending_queue &queue) {
+    delete[] queue.ring;
+    if (queue.spill != nullptr) {
+        fclose(queue.spill);    // a tmpfile is removed when closed
+    }
+}
+
+// function: spill_entry
+// append an entry at the end of the spill file
+// (format: depth, is_directory, path length, path)
+void spill_entry(pending_queue &queue, const pending_entry &entry) {
+    if (queue.spill == nullptr) {
+        queue.spill = tmpfile();
+        if (queue.spill == nullptr) {
+            cerr << "**Error**: cannot create a temporary file for the breadth-first queue" << endl;
+            exit(1);
         }
     }
-    return total;
+    if (!queue.spill_writing) {
+        fseek(queue.spill, queue.spill_write, SEEK_SET);
+        queue.spill_writing = true;
+    }
+    char is_directory = entry.is_directory ? 1 : 0;
+    int path_len = entry.path.size();
+    fwrite(&entry.depth, sizeof(entry.depth), 1, queue.spill);
+    fwrite(&is_directory, 1, 1, queue.spill);
+    fwrite(&path_len, sizeof(path_len), 1, queue.spill);
+    fwrite(entry.path.data(), 1, path_len, queue.spill);
+    queue.spill_write += sizeof(entry.depth) + 1 + sizeof(path_len) + path_len;
+    queue.num_spilled++;
+}
+
+// function: unspill_entries
+// move the oldest entries of the spill file to memory, until memory is full
+void unspill_entries(pending_queue &queue) {
+    if (queue.spill_writing) {
+        fseek(queue.spill, queue.spill_read, SEEK_SET);
+        queue.spill_writing = false;
+    }
+    while ((queue.count < queue.capacity) && (queue.spill_read < queue.spill_write)) {
+        pending_entry &entry = queue.ring[(queue.head + queue.count) % queue.capacity];
+        char is_directory = 0;
+        int path_len = 0;
+        bool ok = (fread(&entry.depth, sizeof(entry.depth), 1, queue.spill) == 1)
+               && (fread(&is_directory, 1, 1, queue.spill) == 1)
+               && (fread(&path_len, sizeof(path_len), 1, queue.spill) == 1);
+        entry.path.resize(ok ? path_len : 0);
+        if (!ok || (fread(&entry.path[0], 1, path_len, queue.spill) != (size_t)path_len)) {
+            cerr << "**Error**: cannot read back the breadth-first queue" << endl;
+            exit(1);
+        }
+        entry.is_directory = (is_directory != 0);
+        queue.spill_read += sizeof(entry.depth) + 1 + sizeof(path_len) + path_len;
+        queue.count++;
+    }
+    if (queue.spill_read == queue.spill_write) {
+        queue.spill_read = queue.spill_write = 0;   // all read back: start over
+        queue.spill_writing = true;
+        fseek(queue.spill, 0, SEEK_SET);
+    }
+}
+
+// function: queue_push
+// add an entry at the end of the queue
+void queue_push(pending_queue &queue, const pending_entry &entry) {
+    // anything already in the spill file is older: new entries go after it
+    if ((queue.count == queue.capacity) || (queue.spill_write > 0)) {
+        spill_entry(queue, entry);
+    } else {
+        queue.ring[(queue.head + queue.count) % queue.capacity] = entry;
+        queue.count++;
+    }
+}
+
+// function: queue_pop
+// take the oldest entry of the queue
+// return: false if the queue is empty
+bool queue_pop(pending_queue &queue, pending_entry &entry) {
+    if ((queue.count == 0) && (queue.spill_write > 0)) {
+        unspill_entries(queue);
+    }
+    if (queue.count == 0) {
+        return false;
+    }
+    entry = move(queue.ring[queue.head]);
+    queue.head = (queue.head + 1) % queue.capacity;
+    queue.count--;
+    return true;
+}
+
+// Listings of the directories of a batch: made by the listing threads, in the order
+// of the batch, and printed (then deleted) in the same order by the main thread
+struct batch_listings {
+    dir_elm_info **entries;     // entries[i]: listing of batch entry i, kept by filter
+    int *sizes;
+    bool *done;                 // done[i]: entries[i] and sizes[i] are set
+    int next_to_list;           // next batch entry a thread will list
+    long in_flight;             // entries listed and not printed yet
+    long max_in_flight;         // no listing is started while in_flight is at this
+    mutex lock;
+    condition_variable changed; // a listing is done, or printed
+};
+
+// function: list_batch
+// list the directories of a batch, in order, until all are taken (run by each thread)
+// A directory is only taken while fewer than max_in_flight listed entries wait to be
+// printed: the listings in memory are bounded by entries, not by directories (each
+// thread may go over by the directory it is listing).
+// parameters:
+//   batch: entries taken from the queue, in order
+//   batch_size: number of entries in batch
+//   listings: output, the listings
+//   filter: entries to keep (see dir_filter)
+void list_batch(const pending_entry *batch, int batch_size, batch_listings &listings,
+                const dir_filter &filter) {
+    while (true) {
+        int i = 0;
+        {
+            unique_lock<mutex> guard(listings.lock);
+            listings.changed.wait(guard, [&listings, batch_size]() {
+                return (listings.in_flight < listings.max_in_flight)
+                    || (listings.next_to_list >= batch_size);   // nothing left to take
+            });
+            if (listings.next_to_list >= batch_size) {
+                return;
+            }
+            i = listings.next_to_list++;
+        }
+        dir_elm_info *entries = nullptr;
+        int num_entries = 0;
+        if (batch[i].is_directory) {
+            entries = get_directory_entries(batch[i].path, num_entries);
+            num_entries = filter.apply(entries, num_entries);
+        }
+        lock_guard<mutex> guard(listings.lock);
+        listings.entries[i] = entries;
+        listings.sizes[i] = num_entries;
+        listings.done[i] = true;
+        listings.in_flight += num_entries;
+        listings.changed.notify_all();
+    }
+}
+
+// function: queue_next_depth
+// return: depth of the oldest entry in memory, -1 if there is none in memory
+int queue_next_depth(const pending_queue &queue) {
+    return (queue.count > 0) ? queue.ring[queue.head].depth : -1;
 }
 
 // function: breadth_first_print
-// print the directory entries in breadth-first order (based on recursion)
+// print the directory entries in breadth-first order (based on a queue)
+// each directory is listed once, its entries are queued for the next level
+// With more than one thread, the entries at the front of the queue (a level, or
+// as much of it as is in memory) are taken as a batch, and their directories are
+// listed by the threads while this thread prints the listings and queues their
+// entries in order: the output is the same as with one thread. A listing is deleted
+// once printed, and the listings waiting to be printed hold at most max_in_memory
+// entries (see list_batch), the queued entries go to the queue's spill file.
 // parameters:
 //   start_path: path of the directory to print     
-//   depth: current depth in the directory tree (for indentation of formatted output)
+//   max_in_memory: most entries of the queue kept in memory, the rest wait on disk
+//   num_threads: number of threads listing directories
+//   filter: entries to print, as in depth_first_print
 // return: none
-void breadth_first_print(dir_elm_info *entries, int num_entries, int depth) {
-        // Collect all subdirectory entries
-    if (num_entries > 0) {
-        string blanks(depth * 2, ' '); 
+void breadth_first_print(const string &start_path, int max_in_memory, int num_threads,
+                         const dir_filter &filter) {
+    pending_queue queue;
+    queue_init(queue, max_in_memory);
+    queue_push(queue, {start_path, true, 0});
 
-        int subdir_size = total_sub_elms(entries, num_entries);
-        dir_elm_info *subdirs = new dir_elm_info[subdir_size];
+    dir_visit_set visited(filter.stays_on_file_system());
 
-#ifdef DEBUG
-        cerr << blanks << "NumEntries:" << num_entries << " SubdirSize: " << subdir_size << endl;
-#endif
-        int total_copied = 0;
-        for (int i = 0; i < num_entries; i++) {
-            // each of the subdirectories
-            if (entries[i].is_directory) {
-                int info_size = 0;
-                dir_elm_info *info = get_directory_entries(entries[i].path, info_size);
-                print_dir_entries(entries[i].path, blanks, info, info_size);
-#ifdef DEBUG
-        cerr << blanks << "Info Size: " << info_size << endl;
-#endif
-                for (int i=0; i < info_size; i++) {
-                    subdirs[total_copied++] = info[i];
+    int max_batch = (num_threads > 1) ? max_in_memory : 1;
+    pending_entry *batch = new pending_entry[max_batch];
+    batch_listings listings;
+    listings.entries = new dir_elm_info*[max_batch];
+    listings.sizes = new int[max_batch];
+    listings.done = new bool[max_batch];
+    listings.max_in_flight = max_in_memory;
+    thread *workers = new thread[num_threads];
+
+    int num_popped = 0;
+    do {
+        // the next entries of the same level, without the directories already
+        // listed through another path (checked in order: the output does not
+        // depend on the threads)
+        int batch_size = 0;
+        num_popped = 0;
+        while ((batch_size < max_batch) && queue_pop(queue, batch[batch_size])) {
+            const pending_entry &popped = batch[batch_size];
+            num_popped++;
+            if (!popped.is_directory || visited.first_visit(popped.path)) {
+                batch_size++;
+            }
+            if (queue_next_depth(queue) != popped.depth) {
+                break;  // end of the level (or of the part of it in memory)
+            }
+        }
+        for (int b = 0; b < batch_size; b++) {
+            listings.done[b] = false;
+        }
+        listings.next_to_list = 0;
+        listings.in_flight = 0;
+        int num_workers = (batch_size > 1) ? min(num_threads, batch_size) : 0;
+        for (int t = 0; t < num_workers; t++) {
+            workers[t] = thread(list_batch, batch, batch_size, ref(listings), cref(filter));
+        }
+        if (num_workers == 0) {
+            list_batch(batch, batch_size, listings, filter);    // one entry: list it here
+        }
+
+        for (int b = 0; b < batch_size; b++) {
+            {
+                unique_lock<mutex> guard(listings.lock);
+                listings.changed.wait(guard, [&listings, b]() { return listings.done[b]; });
+            }
+            const pending_entry &entry = batch[b];
+            string blanks(entry.depth * 2, ' ');
+            if (entry.is_directory) {
+                print_dir_entries(entry.path, blanks, listings.entries[b], listings.sizes[b]);
+                for (int i = 0; i < listings.sizes[b]; i++) {
+                    const dir_elm_info &info = listings.entries[b][i];
+                    if (!info.is_directory || filter.descends(info, entry.depth)) {
+                        queue_push(queue, {info.path, info.is_directory, entry.depth + 1});
+                    }
                 }
-                delete[] info;
+                delete[] listings.entries[b];
             } else {
-                cout << blanks << entries[i].path << ": " << "is a file" << endl;
+                cout << blanks << entry.path << ": " << "is a file" << endl;
             }
+            lock_guard<mutex> guard(listings.lock);
+            listings.in_flight -= listings.sizes[b];
+            listings.changed.notify_all();
         }
-        delete[] entries;
-        
+        for (int t = 0; t < num_workers; t++) {
+            workers[t].join();
+        }
+    } while (num_popped > 0);
+
 #ifdef DEBUG
-        cerr << blanks << "Total: " << total_copied 
-             << " vs computedSieze=" << subdir_size << endl;
+    cerr << "Entries spilled to disk: " << queue.num_spilled << endl;
 #endif
-
-        breadth_first_print(subdirs, total_copied, depth + 1);
-    }
+    delete[] workers;
+    delete[] listings.done;
+    delete[] listings.sizes;
+    delete[] listings.entries;
+    delete[] batch;
+    queue_free(queue);
 }
 
 // main function
@@ -120,10 +470,68 @@ void breadth_first_print(dir_elm_info *entries, int num_entries, int depth) {
 // Prints the entered folder in depth-first and then in breadth-first orders
 // return: always 0  
 // usage: 
-//      ./DirList [directory_path]
+//      ./DirList [-threads N] [-frontier N] [-ndjson export_file | -binary export_file | -snapshot export_file]
+//                [filter options] [-xdev] [directory_path]
+//   -threads N: optional, the breadth-first print lists the directories of a level
+//               with N threads (0: one per hardware thread), the output is the same
+//   -frontier N: optional, the breadth-first print keeps at most N pending entries
+//                in memory, the others wait in a temporary file (default: DEFAULT_FRONTIER)
+//   -ndjson, -binary: optional, instead of printing, export the entries in depth-first
+//                     order to export_file as NDJSON or as binary records (see KFSExport.cpp)
+//   -snapshot: optional, same, in the order of flatten_directory, as a snapshot other
+//              processes can map (see KFSSnapshot.cpp)
+//   filter options: optional, any of -include GLOB, -regex PATTERN, -exclude GLOB,
+//                   -exclude_regex PATTERN, -prune GLOB, -maxdepth N (see dir_filter), e.g., -prune node_modules
+//   -xdev: optional, do not list directories on other file systems
+//   directory_path: optional (default: the current directory), after all the options
+//                   (a directory whose name starts with '-' is given as ./-name)
 int main(int argc, char* argv[]) {
     string input_path = ".";
     cout << "argc: " << argc << endl;
+    string export_format;   // optional: "-ndjson", "-binary" or "-snapshot"
+    string export_file;
+    int max_in_memory = DEFAULT_FRONTIER;
+    int num_threads = 1;
+    dir_filter filter;
+    // options first, until the first argument that is not one: the directory
+    while ((argc > 1) && (argv[1][0] == '-')) {
+        string option = argv[1];
+        if (dir_filter::is_flag(option)) {
+            filter.add_flag(option);
+            argc -= 1;
+            argv += 1;
+            continue;
+        }
+        bool takes_value = (option == "-ndjson") || (option == "-binary") || (option == "-snapshot")
+                        || (option == "-frontier") || (option == "-threads")
+                        || dir_filter::is_option(option);
+        if (!takes_value) {
+            cerr << "Error: unknown option: " << option << endl;
+            return 1;
+        }
+        if (argc < 3) {
+            cerr << "Error: " << option << " needs a value" << endl;
+            return 1;
+        }
+        if ((option == "-ndjson") || (option == "-binary") || (option == "-snapshot")) {
+            export_format = option;
+            export_file = argv[2];
+        } else if (option == "-frontier") {
+            max_in_memory = max(1, stoi(argv[2]));
+        } else if (option == "-threads") {
+            num_threads = stoi(argv[2]);
+            if (num_threads <= 0)
+                num_threads = max(1u, thread::hardware_concurrency());
+        } else if (!filter.add_option(option, argv[2])) {
+            return 1;   // error
+        }
+        argc -= 2;
+        argv += 2;  // the remaining arguments are as usual
+    }
+    if (argc > 2) {
+        cerr << "Error: options must come before the directory: " << argv[2] << endl;
+        return 1;
+    }
     if (argc > 1) {
         input_path = argv[1];
     }
@@ -133,19 +541,36 @@ int main(int argc, char* argv[]) {
     }
 
     cout << "Checking directory: " << fs::absolute(input_path) << endl;
+    if (!export_format.empty()) {
+        int num_collected = 0;
+        int capacity = 0;
+        dir_elm_info *collected = nullptr;
+        dir_visit_set visited(filter.stays_on_file_system());
+        long long listed_at = snapshot_time();
+        if (export_format == "-snapshot") {
+            flatten_collect(input_path, collected, num_collected, capacity, filter, 0, visited);
+        } else {
+            depth_first_collect(input_path, collected, num_collected, capacity, filter, 0, visited);
+        }
+        bool exported = false;
+        if (export_format == "-ndjson") {
+            exported = export_ndjson(export_file, collected, num_collected);
+        } else if (export_format == "-binary") {
+            exported = export_binary(export_file, collected, num_collected);
+        } else {
+            exported = write_snapshot(export_file, collected, num_collected, listed_at);
+        }
+        if (exported) {
+            cout << "Exported " << num_collected << " entries to: " << export_file << endl;
+        }
+        delete[] collected;
+        return exported ? 0 : 1;
+    }
     cout << "Depth First Print (like the \"ls -R\" command):" << endl;
-    depth_first_print(input_path, 0);
+    depth_first_print(input_path, 0, filter);
     cout << "-----------" << endl << endl;
     cout << "Breadth First Print (an alternative way of printing):" << endl;
-    // begin the process
-    int num_entries = 1;
-    dir_elm_info *entries = new dir_elm_info[1];
-                            // Must allocate as an array, 
-                            // as all deletion expects arrays!
-        entries->path = input_path;
-        entries->name = fs::path(input_path).filename().string();
-        entries->is_directory = true;
-    breadth_first_print(entries, num_entries, 0);
+    breadth_first_print(input_path, max_in_memory, num_threads, filter);
     cout << endl;
     return 0;
 } 
\ No newline at end of file
@@ -11,36 +11,26 @@
 //
 #include "KFS.h"
 
-// These two functions are local to this file, not exported via the KFS.h header
+const int INITIAL_CAPACITY = 16;   // initial size of a growable entry array
 
-// Function to count number of subdirectories in a directory
-// Input: directory path (string)
-// Output: number of subdirectories (int)
-// Uses C++17 filesystem library
-int num_subdir(const string &dir_path) {
-    int count = 0;
-    for (const auto& entry : fs::directory_iterator(dir_path)) {
-        if (entry.is_directory()) {
-            count++;
-        }
-    }
-    return count;
-}
+// --- Begin exported functions ---
 
-// Function to count number of items (files + subdirectories) in a directory
-// Input: directory path (string)
-// Output: number of items (int)
-// Uses C++17 filesystem library
-int num_items(const string &dir_path) {
-    int count = 0;
-    for (const auto& entry : fs::directory_iterator(dir_path)) {
-        count++;
+// Function to grow a dynamically allocated dir_elm_info array
+// Input: entries: array to grow (may be nullptr when capacity is 0)
+//        num_used: number of valid entries in the array
+//        capacity: current size of the array (by reference, updated)
+// Output: pointer to the new array, the old array is deleted
+dir_elm_info* grow_entries(dir_elm_info *entries, int num_used, int &capacity) {
+    int new_capacity = (capacity == 0) ? INITIAL_CAPACITY : capacity * 2;
+    dir_elm_info *bigger = new dir_elm_info[new_capacity];
+    for (int i = 0; i < num_used; i++) {
+        bigger[i] = move(entries[i]);
     }
-    return count;
+    delete[] entries;
+    capacity = new_capacity;
+    return bigger;
 }
 
-// --- Begin exported functions ---
-
 // Function to determine if the input string is a valid directory
 // Input: directory path (string)
 // Output: T/F if the input is a valid directory
@@ -63,19 +53,25 @@ bool is_directory(const string &dir_path) {
 dir_elm_info* get_directory_entries(const string &dir_path, int &num_entries) {
     is_directory(dir_path);
 
-    num_entries = num_items(dir_path);
+    // Single pass: read each entry once, growing the array as needed.
+    // Entries created or removed while reading cannot overflow or under-fill
+    // the array, since num_entries is whatever was actually read.
+    int capacity = 0;
+    dir_elm_info *entries = nullptr;
+    num_entries = 0;
+    for (const auto& entry : fs::directory_iterator(dir_path)) {
+        if (num_entries == capacity) {
+            entries = grow_entries(entries, num_entries, capacity);
+        }
+        entries[num_entries].path = entry.path().string();
+        entries[num_entries].name = entry.path().filename().string();
+        entries[num_entries].is_directory = entry.is_directory();
+        num_entries++;
+    }
     if (num_entries == 0) {
         return nullptr;    // empty directory
     }
-    
-    dir_elm_info *entries = new dir_elm_info[num_entries];
-    int i = 0;
-    for (const auto& entry : fs::directory_iterator(dir_path)) {
-        entries[i].path = entry.path().string();
-        entries[i].name = entry.path().filename().string();
-        entries[i].is_directory = entry.is_directory();
-        i++;
-    }
+
     return entries;
 }
 
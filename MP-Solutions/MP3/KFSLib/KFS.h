@@ -3,11 +3,23 @@
 // Purpose: Header file for a library to work with file system
 // 
 // NOTE: the allocated array must be deleted by the caller
+// Exports, snapshots, diffs and filtered traversals (in ../../KFSShared, see KFSShared.h):
+//      parent_indices, export_ndjson, export_binary, exported_listing class
+//      write_snapshot, snapshot_time, dir_snapshot class
+//      diff_trees
+//      dir_filter class, dir_visit_set class
+//      flatten_directory_entries_parallel, parallel_for
 // 
 #pragma once
 
 #include <iostream>
+#include <atomic>
 #include <filesystem>
+#include <functional>
+#include <mutex>
+#include <regex>
+#include <string_view>
+#include <vector>
 
 namespace fs = std::filesystem;  // shorthand for std::filesystem
 using namespace std;
@@ -19,6 +31,10 @@ struct dir_elm_info {     // this is the data type
     bool is_directory;      // true if directory, false otherwise
 };
 
+// Classes and functions shared with the other copies of KFSLib: dir_visit_set, dir_filter,
+// exports, snapshots and diffs (the sources are in ../../KFSShared)
+#include "../../KFSShared/KFSShared.h"
+
 
 // Function to check if a path is a valid directory
 // dir_path: path to the directory to check (full or relative path)
@@ -31,4 +47,13 @@ bool is_directory(const string &dir_path);
 // returns: pointer to an array of dir_elm_info structures
 //
 // **NOTE**: the allocated array must be deleted by the caller
-dir_elm_info* get_directory_entries(const string &dir_path, int &num_entries);
\ No newline at end of file
+dir_elm_info* get_directory_entries(const string &dir_path, int &num_entries);
+
+// Function to grow a dynamically allocated dir_elm_info array
+// entries: array to grow (may be nullptr when capacity is 0)
+// num_used: number of valid entries in the array, moved to the new array
+// capacity: current size of the array (by reference, updated)
+// returns: pointer to the new array, the old array is deleted
+//
+// **NOTE**: the allocated array must be deleted by the caller
+dir_elm_info* grow_entries(dir_elm_info *entries, int num_used, int &capacity);
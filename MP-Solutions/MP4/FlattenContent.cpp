@@ -1,13 +1,16 @@
 // Created by ksung on 2025-10-12. 
 // Flattens the contents of a directory and all of its subdirectories
 // Receives a directory path, 
-//   1. finds out how many entries are in the directory and all of the subdirectories
-//   2. fills in the entries in a dynamically allocated array of dir_elm_info
-//   3. returns the pointer to the array and the number of entries via reference parameter
+//   1. flattens it with flatten_directory (KFSLib): the entries in a dynamically allocated
+//      array of dir_elm_info, grown as entries are found (one traversal of the tree)
+//   2. prints the entries, or exports them
 #include "KFSLib/KFS.h"
 #include <iostream>
 #include <iomanip>
+#include <fstream>
 #include <string>
+#include <chrono>
+#include <thread>
 using namespace std;
 
 const int NAME_WIDTH = 25;
@@ -50,72 +53,308 @@ void print_dir_entries(const dir_elm_info *entries, int num_entries) {
     cout << endl;
 }
 
-// Function: num_dir_entries
-//   dir_path: path to a directory
-// Precondition: dir_path is a valid directory path
-// Postcondition: returns number of entries in the directory and all of its subdirectories
-int num_dir_entries(const string &dir_path) {
-    int count = 0;
-    // Get a list of all files and directories in the current directory
-    dir_elm_info* entries = nullptr;
-    int num_entries = 0;
-    // cerr << "Getting info for: [" << dir_path << "]" << endl;
-    entries = get_directory_entries(dir_path, num_entries);
+void debug_print_entry(const dir_elm_info *entry, int num_entries, int index) {
+    if (index < num_entries) {
+        cout << "Entry " << index << ": ";
+        print_dir_entry(entry[index]);
+        cout << endl;
+    } else {
+        cout << "**Warning**: index(" << index << ") out of bounds of: " << num_entries << endl;
+    }
+}
 
-    // Count the number of entries
-    for (int i = 0; i < num_entries; ++i) {
-        count++;
-        if (entries[i].is_directory) {
-            // If the entry is a directory, count its contents recursively
-            count += num_dir_entries(entries[i].path);
-        }
+// Function: debug_print_snapshot_entry
+//   snapshot: a snapshot written by write_snapshot (see -snapshot)
+// Purpose:
+// same as debug_print_entry, entry index is read from the mapped snapshot
+void debug_print_snapshot_entry(const dir_snapshot &snapshot, int index) {
+    exported_entry entry;
+    if (snapshot.entry(index, entry)) {
+        string to_print = string(entry.name) + (entry.is_directory ? "/ " : " ");
+        cout << "Entry " << index << ": " << left << setw(NAME_WIDTH) << to_print << endl;
+    } else {
+        cout << "**Warning**: index(" << index << ") out of bounds of: " << snapshot.size() << endl;
     }
-    delete[] entries; // Clean up dynamically allocated memory
-    return count;
 }
 
-// Function: flatten_directory_entries
-//   path: path to the directory to be flattened
-//   flattened_dir_info: pointer to the array to fill with flattened directory info
-//   insert_index: reference to the index at which to insert the next entry
-// Precondition: flattened_dir_info points to an array large enough to hold all entries
-// Postcondition: flattened_dir_info is filled with the entries in the directory and its subdirectories
+// Function: check_snapshot
+//   file: a snapshot just written by write_snapshot
+//   entries: pointer to the flattened array it was written from
+//   num_entries: number of entries in the array
+// Returns: true if every entry read back from file is the entry of the array
 // Purpose:
-// fills in the entries with the entries in the directory and all of its subdirectories
-void flatten_directory_entries(const string &path,
-                    dir_elm_info *flattened_dir_info, int &insert_index)
-{
-    int num_entries = 0;
-    dir_elm_info* entries = get_directory_entries(path, num_entries);
+// maps the snapshot (see dir_snapshot) and compares each entry with the array: path,
+// name, type, parent, depth, and the subtree end
+bool check_snapshot(const string &file, const dir_elm_info *entries, int num_entries) {
+    dir_snapshot snapshot(file);
+    if (!snapshot.is_open()) {
+        return false;   // error
+    }
+    int *parents = parent_indices(entries, num_entries);
+    int *depths = depths_of(parents, num_entries);
+    int *ends = new int[num_entries];   // subtree end: after the last entry below
+    for (int i = 0; i < num_entries; i++) {
+        ends[i] = i + 1;
+    }
+    for (int i = num_entries - 1; i >= 0; i--) {
+        if (parents[i] >= 0) {
+            ends[parents[i]] = max(ends[parents[i]], ends[i]);
+        }
+    }
 
-#ifdef DEBUG
-    cerr << "Filling entries for: [" << path << "] with " << num_entries << " entries." << endl;
-#endif
-    // First:  info of files skipping all directories 
-    for (int i = 0; i < num_entries; ++i) {
-        if (!entries[i].is_directory) {
-            flattened_dir_info[insert_index++] = entries[i];
+    int first_difference = (snapshot.size() == num_entries) ? -1 : min(snapshot.size(), num_entries);
+    exported_entry entry;
+    for (int i = 0; (first_difference < 0) && (i < num_entries); i++) {
+        if (!snapshot.entry(i, entry) || (entry.path != entries[i].path)
+            || (entry.name != entries[i].name) || (entry.is_directory != entries[i].is_directory)
+            || (entry.parent != parents[i]) || (entry.depth != depths[i])
+            || (snapshot.subtree_end(i) != ends[i])) {
+            first_difference = i;
         }
     }
+    if (first_difference < 0) {
+        cout << "Snapshot read back: " << snapshot.size() << " entries, same as the array" << endl;
+    } else {
+        cout << "**Error**: snapshot differs from the array at entry " << first_difference << endl;
+    }
+    delete[] parents;
+    delete[] depths;
+    delete[] ends;
+    return first_difference < 0;
+}
 
-    // Second: info of directories and recursively fill their contents
-    for (int i = 0; i < num_entries; ++i) {
-        if (entries[i].is_directory) {
-            flattened_dir_info[insert_index++] = entries[i];
-            flatten_directory_entries(entries[i].path, flattened_dir_info, insert_index);
+// Function: same_entries
+//   a, b: flattened arrays, of num_a and num_b entries
+// Returns: true if both arrays have the same entries (path and type) in the same order
+bool same_entries(const dir_elm_info *a, int num_a, const dir_elm_info *b, int num_b) {
+    if (num_a != num_b) {
+        return false;
+    }
+    for (int i = 0; i < num_a; i++) {
+        if ((a[i].path != b[i].path) || (a[i].is_directory != b[i].is_directory)) {
+            return false;
         }
     }
-    delete[] entries; // Clean up dynamically allocated memory
+    return true;
 }
 
-void debug_print_entry(const dir_elm_info *entry, int num_entries, int index) {
-    if (index < num_entries) {
-        cout << "Entry " << index << ": ";
-        print_dir_entry(entry[index]);
-        cout << endl;
+// Function: benchmark_flatten
+//   path: a directory
+// Purpose:
+// times the serial flatten (flatten_directory) and flatten_directory_entries_parallel with
+// 1, 2, 4, ... threads, up to one per hardware thread, and checks that each parallel
+// result is the serial one. The tree is flattened once before timing, so that every
+// run finds the directories in the cache.
+void benchmark_flatten(const string &path) {
+    const int COL_WIDTH = 14;
+    int num_serial = 0;
+    delete[] flatten_directory(path, num_serial);     // warm up the cache
+
+    auto start = chrono::steady_clock::now();
+    dir_elm_info *serial = flatten_directory(path, num_serial);
+    auto stop = chrono::steady_clock::now();
+    double serial_ms = chrono::duration<double, milli>(stop - start).count();
+
+    cout << setw(COL_WIDTH) << right << "threads" << setw(COL_WIDTH) << "ms"
+         << setw(COL_WIDTH) << "speedup" << setw(COL_WIDTH) << "entries" << endl;
+    cout << setw(COL_WIDTH) << "serial" << fixed << setprecision(3)
+         << setw(COL_WIDTH) << serial_ms << setw(COL_WIDTH) << 1.0
+         << setw(COL_WIDTH) << num_serial << endl;
+
+    int max_threads = max(1u, thread::hardware_concurrency());
+    int num_threads = 1;
+    while (num_threads > 0) {
+        if (num_threads > max_threads)
+            num_threads = max_threads;
+        int num_entries = 0;
+        start = chrono::steady_clock::now();
+        dir_elm_info *entries = flatten_directory_entries_parallel(path, num_entries, num_threads);
+        stop = chrono::steady_clock::now();
+        double ms = chrono::duration<double, milli>(stop - start).count();
+        cout << setw(COL_WIDTH) << num_threads << setw(COL_WIDTH) << ms
+             << setw(COL_WIDTH) << ((ms > 0) ? serial_ms / ms : 0.0)
+             << setw(COL_WIDTH) << num_entries
+             << (same_entries(serial, num_serial, entries, num_entries) ? ""
+                                                                        : "  **Error**: results differ")
+             << endl;
+        delete[] entries;
+
+        num_threads = (num_threads == max_threads) ? 0 : num_threads * 2;  // 0: done
+    }
+    delete[] serial;
+}
+
+// Function: report_diff
+//   old_path, new_path: each a directory (flattened now) or a snapshot file (see -snapshot)
+//   filter: entries to keep in the directories
+// Returns: 0, 1 if a snapshot cannot be read
+// Purpose:
+// prints the entries added (+), removed (-), and changed from file to directory or
+// back (~) from the old tree to the new one. Directories with nothing changed below
+// them are skipped (see KFSDiff.cpp): between two snapshots, or between a snapshot
+// and a directory (which is then only listed where it changed).
+int report_diff(const string &old_path, const string &new_path, const dir_filter &filter) {
+    dir_snapshot *old_snapshot = nullptr, *new_snapshot = nullptr;
+    dir_elm_info *old_entries = nullptr, *new_entries = nullptr;
+    int num_old = 0, num_new = 0;
+    bool old_is_directory = fs::is_directory(old_path);
+    bool new_is_directory = fs::is_directory(new_path);
+    if (!old_is_directory) {
+        old_snapshot = new dir_snapshot(old_path);
+    } else if (new_is_directory) {
+        old_entries = flatten_directory(old_path, num_old, filter);
+    }
+    if (!new_is_directory) {
+        new_snapshot = new dir_snapshot(new_path);
+    } else if (old_is_directory) {
+        new_entries = flatten_directory(new_path, num_new, filter);
+    }
+
+    int result = 0;
+    if (((old_snapshot != nullptr) && !old_snapshot->is_open())
+        || ((new_snapshot != nullptr) && !new_snapshot->is_open())) {
+        result = 1;     // error
     } else {
-        cout << "**Warning**: index(" << index << ") out of bounds of: " << num_entries << endl;
+        cout << "Differences from: " << old_path << " to: " << new_path << endl;
+        auto print = [](const diff_entry &entry) {
+            const char *CHANGE_MARKS = "+-~";   // in the order of diff_change
+            cout << CHANGE_MARKS[entry.change] << " " << entry.path
+                 << (entry.is_directory ? "/" : "") << endl;
+        };
+        diff_counts counts;
+        if ((old_snapshot != nullptr) && (new_snapshot != nullptr)) {
+            counts = diff_trees(*old_snapshot, *new_snapshot, print);
+        } else if (old_snapshot != nullptr) {
+            counts = diff_trees(*old_snapshot, new_path, filter, print);
+        } else if (new_snapshot != nullptr) {
+            counts = diff_trees(old_path, *new_snapshot, filter, print);
+        } else {
+            counts = diff_trees(old_entries, num_old, new_entries, num_new, print);
+        }
+        cout << "Added: " << counts.added << ", removed: " << counts.removed
+             << ", type changed: " << counts.type_changed << endl;
+#ifdef DEBUG
+        cerr << "Unchanged subtrees skipped: " << counts.subtrees_skipped << endl;
+#endif
     }
+    delete old_snapshot;
+    delete new_snapshot;
+    delete[] old_entries;
+    delete[] new_entries;
+    return result;
+}
+
+// Function: write_file
+// Purpose: creates (or replaces) a small file, for check_diff
+void write_file(const fs::path &file) {
+    ofstream out(file);
+    out << file.filename().string() << endl;
+}
+
+// Function: report_check
+//   what: the two trees compared
+//   counts: returned by diff_trees
+//   lines: differences reported by diff_trees, one line each ("+ path", ...)
+//   expected: the differences expected
+//   skips: true if the unchanged subtree must have been skipped
+// Returns: true if the differences are the expected ones
+bool report_check(const string &what, const diff_counts &counts, const vector<string> &lines,
+                  const vector<string> &expected, bool skips) {
+    long num_lines = lines.size();
+    bool ok = (lines == expected)
+              && (counts.added + counts.removed + counts.type_changed == num_lines)
+              && (!skips || (counts.subtrees_skipped > 0));
+    cout << left << setw(NAME_WIDTH) << what << "added: " << counts.added
+         << ", removed: " << counts.removed << ", type changed: " << counts.type_changed
+         << ", unchanged subtrees skipped: " << counts.subtrees_skipped
+         << (ok ? "" : "  **Error**: not the expected differences") << endl;
+    return ok;
+}
+
+// Function: check_diff
+// Returns: true if every diff found the expected differences
+// Purpose:
+// builds a scratch tree in the temporary directory, its directories dated an hour back
+// (older than the racy margin of snapshots), flattens it and writes a snapshot. Then
+// changes it: a file removed, a file replaced by a directory, a file added, a directory
+// added with a file in it, and the subtree keep/ left as it was. The tree is flattened
+// and written again, and compared:
+//      array with array: the differences expected (3 added, 1 removed, 1 type changed)
+//      snapshot with snapshot, and the old snapshot with the live tree: the same
+//      differences, and keep/ skipped without reading it (subtrees_skipped > 0)
+bool check_diff() {
+    const long EXPECTED_ADDED = 3, EXPECTED_REMOVED = 1, EXPECTED_TYPE_CHANGED = 1;
+    fs::path top = fs::temp_directory_path() / ("kfs_check_diff_" + to_string(snapshot_time()));
+    string old_file = top.string() + ".old.snap";
+    string new_file = top.string() + ".new.snap";
+    dir_elm_info *old_entries = nullptr, *new_entries = nullptr;
+    bool ok = false;
+    try {
+        fs::create_directories(top / "keep" / "sub");
+        fs::create_directory(top / "mod");
+        write_file(top / "keep" / "a.txt");
+        write_file(top / "keep" / "sub" / "b.txt");
+        write_file(top / "gone.txt");
+        write_file(top / "flip");
+        write_file(top / "mod" / "x.txt");
+        auto an_hour_ago = fs::file_time_type::clock::now() - chrono::hours(1);
+        for (const fs::directory_entry &entry : fs::recursive_directory_iterator(top)) {
+            if (entry.is_directory()) {
+                fs::last_write_time(entry.path(), an_hour_ago);
+            }
+        }
+        fs::last_write_time(top, an_hour_ago);
+
+        int num_old = 0, num_new = 0;
+        long long listed_at = snapshot_time();
+        old_entries = flatten_directory(top.string(), num_old);
+        bool written = write_snapshot(old_file, old_entries, num_old, listed_at);
+
+        fs::remove(top / "gone.txt");
+        fs::remove(top / "flip");
+        fs::create_directory(top / "flip");
+        write_file(top / "mod" / "new.txt");
+        fs::create_directory(top / "added");
+        write_file(top / "added" / "c.txt");
+
+        listed_at = snapshot_time();
+        new_entries = flatten_directory(top.string(), num_new);
+        written = written && write_snapshot(new_file, new_entries, num_new, listed_at);
+
+        dir_snapshot old_snapshot(old_file), new_snapshot(new_file);
+        if (written && old_snapshot.is_open() && new_snapshot.is_open()) {
+            vector<string> expected, lines;
+            auto record = [&lines](const diff_entry &entry) {
+                const char *CHANGE_MARKS = "+-~";   // in the order of diff_change
+                lines.push_back(CHANGE_MARKS[entry.change] + string(" ") + string(entry.path)
+                                + (entry.is_directory ? "/" : ""));
+            };
+            cout << "Checking diffs on: " << top << endl;
+            diff_counts counts = diff_trees(old_entries, num_old, new_entries, num_new, record);
+            expected = lines;
+            ok = (counts.added == EXPECTED_ADDED) && (counts.removed == EXPECTED_REMOVED)
+                 && (counts.type_changed == EXPECTED_TYPE_CHANGED)
+                 && report_check("array, array:", counts, lines, expected, false);
+
+            lines.clear();
+            counts = diff_trees(old_snapshot, new_snapshot, record);
+            ok = report_check("snapshot, snapshot:", counts, lines, expected, true) && ok;
+
+            lines.clear();
+            counts = diff_trees(old_snapshot, top.string(), dir_filter(), record);
+            ok = report_check("snapshot, live:", counts, lines, expected, true) && ok;
+        }
+    } catch (const fs::filesystem_error &e) {
+        cerr << "**Error**: " << e.what() << endl;
+    }
+    delete[] old_entries;
+    delete[] new_entries;
+    error_code ec;      // removing what was made, errors ignored
+    fs::remove_all(top, ec);
+    fs::remove(old_file, ec);
+    fs::remove(new_file, ec);
+    cout << (ok ? "Diff check passed" : "**Error**: diff check failed") << endl;
+    return ok;
 }
 
 // main function
@@ -123,7 +362,31 @@ void debug_print_entry(const dir_elm_info *entry, int num_entries, int index) {
 //   argc: number of command line arguments
 //   argv: array of command line arguments: argv[1] is the directory path
 // usage:  
-//      ./FlattenContent [directory_path]
+//      ./FlattenContent [-threads N] [-ndjson export_file | -binary export_file | -snapshot export_file]
+//                       [filter options] [-xdev] [directory_path]
+//      ./FlattenContent -read_snapshot snapshot_file
+//      ./FlattenContent [filter options] [-xdev] -diff old new
+//      ./FlattenContent -benchmark [directory_path]
+//      ./FlattenContent -check_diff
+//   -threads: optional, flatten with flatten_directory_entries_parallel on N threads
+//             (0: one per hardware thread), same entries in the same order;
+//             cannot be used with filter options or -xdev
+//   -ndjson, -binary: optional, instead of printing the entries, export them to
+//                     export_file as NDJSON or as binary records (see KFSExport.cpp)
+//   -snapshot: optional, instead of printing the entries, write them to export_file
+//              as a snapshot (see KFSSnapshot.cpp), then read it back and check it
+//              against the entries (see check_snapshot)
+//   -read_snapshot: instead of flattening a directory, run the debug check of entries
+//                   on snapshot_file, without reading the whole file
+//   -diff: instead of flattening a directory, print what changed from old to new, each
+//          a directory or a snapshot file (e.g., -snapshot before.snap, later -diff before.snap .)
+//   filter options: optional, any of -include GLOB, -regex PATTERN, -exclude GLOB,
+//                   -exclude_regex PATTERN, -prune GLOB, -maxdepth N (see dir_filter), e.g., -prune .git
+//   -xdev: optional, do not list directories on other file systems
+//   -benchmark: instead of printing the entries, time the serial and the parallel
+//               flatten (see benchmark_flatten)
+//   -check_diff: check -diff on a scratch tree, between arrays, snapshots, and a snapshot
+//                and the live tree (see check_diff)
 int main(int argc, char* argv[]) {
     string input_path = "."; // Default to current directory
     cout << "Your command: ";
@@ -132,24 +395,120 @@ int main(int argc, char* argv[]) {
     } 
     cout << endl;
 
+    if ((argc > 1) && (string(argv[1]) == "-check_diff")) {
+        return check_diff() ? 0 : 1;
+    }
+
+    bool benchmark = (argc > 1) && (string(argv[1]) == "-benchmark");
+    if (benchmark) {
+        argc -= 1;
+        argv += 1;
+    }
+
+    int num_threads = -1;   // optional: -threads N, -1: serial flatten
+    string export_format;   // optional: "-ndjson", "-binary" or "-snapshot"
+    string export_file;
+    string snapshot_file;   // optional: snapshot to check
+    string diff_old, diff_new;  // optional: trees to compare
+    dir_filter filter;
+    while (argc > 2) {
+        string option = argv[1];
+        if (dir_filter::is_flag(option)) {
+            filter.add_flag(option);
+            argc -= 1;
+            argv += 1;
+            continue;
+        }
+        if ((option == "-diff") && (argc > 3)) {
+            diff_old = argv[2];
+            diff_new = argv[3];
+            argc -= 3;
+            argv += 3;
+            continue;
+        }
+        if (option == "-threads") {
+            num_threads = max(0, stoi(argv[2]));
+        } else if ((option == "-ndjson") || (option == "-binary") || (option == "-snapshot")) {
+            export_format = option;
+            export_file = argv[2];
+        } else if (option == "-read_snapshot") {
+            snapshot_file = argv[2];
+        } else if (dir_filter::is_option(option)) {
+            if (!filter.add_option(option, argv[2])) {
+                return 1;   // error
+            }
+        } else {
+            break;
+        }
+        argc -= 2;
+        argv += 2;  // the remaining arguments are as usual
+    }
     if (argc > 1) {
         input_path = argv[1];
     }
 
+    if (!diff_old.empty()) {
+        return report_diff(diff_old, diff_new, filter);
+    }
+
+    if (!snapshot_file.empty()) {
+        dir_snapshot snapshot(snapshot_file);
+        if (!snapshot.is_open()) {
+            return 1;   // error
+        }
+        cout << "Snapshot: " << snapshot_file << ", number of entries: " << snapshot.size() << endl;
+        cout << "Final debug check of entries:" << endl;
+        for (size_t i = 0; i < DEBUG_CHECK_SIZE; i++)
+        {
+            debug_print_snapshot_entry(snapshot, DEBUG_CHECK_INDICES[i]);
+        }
+        return 0;
+    }
+
     if (!is_directory(input_path)) {
         cerr << "**Error**: Input path is not a valid directory: " << input_path << endl;
         return 1;   // error
     }
+    if ((num_threads >= 0) && (!filter.keeps_everything() || filter.stays_on_file_system())) {
+        cerr << "**Error**: -threads cannot be used with filter options or -xdev" << endl;
+        return 1;   // error
+    }
+
+    if (benchmark) {
+        cout << "Benchmarking flatten of: " << fs::absolute(input_path) << endl;
+        benchmark_flatten(input_path);
+        return 0;
+    }
 
     // Inform the user: 
     cout << "Flattening directory: " << fs::absolute(input_path) << endl;
 
-    int num_entries = num_dir_entries(input_path);
+    long long listed_at = snapshot_time();     // for -snapshot
+    int num_entries = 0;
+    dir_elm_info* entries = nullptr;
+    if (num_threads >= 0) {
+        entries = flatten_directory_entries_parallel(input_path, num_entries, num_threads);
+    } else {
+        entries = flatten_directory(input_path, num_entries, filter);
+    }
     cout << "Total number of entries (files + directories): " << num_entries << endl;
 
-    dir_elm_info* entries = new dir_elm_info[num_entries];
-    int insert_index = 0;
-    flatten_directory_entries(input_path, entries, insert_index);  
+    if (!export_format.empty()) {
+        bool exported = false;
+        if (export_format == "-ndjson") {
+            exported = export_ndjson(export_file, entries, num_entries);
+        } else if (export_format == "-binary") {
+            exported = export_binary(export_file, entries, num_entries);
+        } else {
+            exported = write_snapshot(export_file, entries, num_entries, listed_at)
+                       && check_snapshot(export_file, entries, num_entries);
+        }
+        if (exported) {
+            cout << "Exported to: " << export_file << endl;
+        }
+        delete[] entries;
+        return exported ? 0 : 1;
+    }
     print_dir_entries(entries, num_entries);
 
     // for debugging and verifying purposes
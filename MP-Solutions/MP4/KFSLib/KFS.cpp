@@ -12,36 +12,73 @@
 #include "KFS.h"
 #include <algorithm>
 
-// These two functions are local to this file, not exported via the KFS.h header
+const int INITIAL_CAPACITY = 16;   // initial size of a growable entry array
 
-// Function to count number of subdirectories in a directory
-// Input: directory path (string)
-// Output: number of subdirectories (int)
-// Uses C++17 filesystem library
-int num_subdir(const string &dir_path) {
-    int count = 0;
-    for (const auto& entry : fs::directory_iterator(dir_path)) {
-        if (entry.is_directory()) {
-            count++;
+// Function to append the entries of a directory and its subdirectories to a growable array
+// Input: path: the directory
+//        flattened_dir_info: growable array (by reference, may be reallocated)
+//        num_entries, capacity: entries used and size of the array (by reference, updated)
+//        filter: entries to keep, excluded and pruned directories are not listed
+//        depth: depth of the entries of path (0: the top directory)
+//        visited: directories already listed, each physical directory is listed once
+// Output: none, the entries are appended: files first, then each directory followed by
+//         its contents
+void flatten_into(const string &path, dir_elm_info *&flattened_dir_info, int &num_entries,
+                  int &capacity, const dir_filter &filter, int depth, dir_visit_set &visited) {
+    if (!visited.first_visit(path)) {
+        return;     // already listed through another path (or on another file system)
+    }
+    int dir_size = 0;
+    dir_elm_info* entries = get_directory_entries(path, dir_size);
+    dir_size = filter.apply(entries, dir_size);
+#ifdef DEBUG
+    cerr << "Filling entries for: [" << path << "] with " << dir_size << " entries." << endl;
+#endif
+
+    // First:  info of files skipping all directories
+    for (int i = 0; i < dir_size; ++i) {
+        if (!entries[i].is_directory) {
+            if (num_entries == capacity) {
+                flattened_dir_info = grow_entries(flattened_dir_info, num_entries, capacity);
+            }
+            flattened_dir_info[num_entries++] = move(entries[i]);
         }
     }
-    return count;
-}
 
-// Function to count number of items (files + subdirectories) in a directory
-// Input: directory path (string)
-// Output: number of items (int)
-// Uses C++17 filesystem library
-int num_items(const string &dir_path) {
-    int count = 0;
-    for (const auto& entry : fs::directory_iterator(dir_path)) {
-        count++;
+    // Second: info of directories and recursively append their contents
+    for (int i = 0; i < dir_size; ++i) {
+        if (entries[i].is_directory) {
+            if (num_entries == capacity) {
+                flattened_dir_info = grow_entries(flattened_dir_info, num_entries, capacity);
+            }
+            flattened_dir_info[num_entries++] = entries[i];
+            if (filter.descends(entries[i], depth)) {
+                flatten_into(entries[i].path, flattened_dir_info, num_entries, capacity,
+                             filter, depth + 1, visited);
+            }
+        }
     }
-    return count;
+    delete[] entries; // Clean up dynamically allocated memory
 }
 
 // --- Begin exported functions ---
 
+// Function to grow a dynamically allocated dir_elm_info array
+// Input: entries: array to grow (may be nullptr when capacity is 0)
+//        num_used: number of valid entries in the array
+//        capacity: current size of the array (by reference, updated)
+// Output: pointer to the new array, the old array is deleted
+dir_elm_info* grow_entries(dir_elm_info *entries, int num_used, int &capacity) {
+    int new_capacity = (capacity == 0) ? INITIAL_CAPACITY : capacity * 2;
+    dir_elm_info *bigger = new dir_elm_info[new_capacity];
+    for (int i = 0; i < num_used; i++) {
+        bigger[i] = move(entries[i]);
+    }
+    delete[] entries;
+    capacity = new_capacity;
+    return bigger;
+}
+
 // Function to determine if the input string is a valid directory
 // Input: directory path (string)
 // Output: T/F if the input is a valid directory
@@ -64,19 +101,24 @@ bool is_directory(const string &dir_path) {
 dir_elm_info* get_directory_entries(const string &dir_path, int &num_entries) {
     is_directory(dir_path);
 
-    num_entries = num_items(dir_path);
+    // Single pass: read each entry once, growing the array as needed.
+    // Entries created or removed while reading cannot overflow or under-fill
+    // the array, since num_entries is whatever was actually read.
+    int capacity = 0;
+    dir_elm_info *entries = nullptr;
+    num_entries = 0;
+    for (const auto& entry : fs::directory_iterator(dir_path)) {
+        if (num_entries == capacity) {
+            entries = grow_entries(entries, num_entries, capacity);
+        }
+        entries[num_entries].path = entry.path().string();
+        entries[num_entries].name = entry.path().filename().string();
+        entries[num_entries].is_directory = entry.is_directory();
+        num_entries++;
+    }
     if (num_entries == 0) {
         return nullptr;    // empty directory
     }
-    
-    dir_elm_info *entries = new dir_elm_info[num_entries];
-    int i = 0;
-    for (const auto& entry : fs::directory_iterator(dir_path)) {
-        entries[i].path = entry.path().string();
-        entries[i].name = entry.path().filename().string();
-        entries[i].is_directory = entry.is_directory();
-        i++;
-    }
 
     // make sure names are properly sorted.
     sort(entries, entries + num_entries, [](const dir_elm_info &a, const dir_elm_info &b) {
@@ -85,3 +127,17 @@ dir_elm_info* get_directory_entries(const string &dir_path, int &num_entries) {
     return entries;
 }
 
+// Function to flatten a directory and all of its subdirectories
+// Input: path: the directory
+//        num_entries: number of entries in the array (by reference)
+//        filter: entries to keep (keeps everything if not given)
+// Output: pointer to the array, nullptr if there are no entries
+// The tree is traversed once, the array grows as the entries are found
+dir_elm_info* flatten_directory(const string &path, int &num_entries, const dir_filter &filter) {
+    num_entries = 0;
+    int capacity = 0;
+    dir_elm_info* entries = nullptr;
+    dir_visit_set visited(filter.stays_on_file_system());
+    flatten_into(path, entries, num_entries, capacity, filter, 0, visited);
+    return entries;
+}
@@ -0,0 +1,242 @@
+// File: KFSCompact.cpp
+// Implementation of compact_dir_table and flatten_directory_compact
+//
+// Each entry is a small fixed-size compact_dir_elm (no strings), the names live
+// in one character arena. An intern hash table (open addressing, linear probing)
+// makes sure each distinct name is stored once. Sorting a directory's entries
+// only moves the small compact_dir_elm structs.
+//
+#include "KFS.h"
+#include <algorithm>
+#include <cstring>
+
+// Local constants
+const int INITIAL_NAMES_CAPACITY = 4096;    // bytes
+const int INITIAL_INTERN_CAPACITY = 1024;   // slots, must be a power of 2
+const int INITIAL_ELMS_CAPACITY = 256;      // entries
+
+// Function to grow a dynamically allocated array of any type
+// Input: arr: array to grow
+//        num_used: number of valid elements in the array
+//        capacity: current size of the array (by reference, doubled)
+// Output: pointer to the new array, the old array is deleted
+template <typename T>
+T* grow_array(T *arr, int num_used, int &capacity) {
+    capacity = capacity * 2;
+    T *bigger = new T[capacity];
+    for (int i = 0; i < num_used; i++) {
+        bigger[i] = arr[i];
+    }
+    delete[] arr;
+    return bigger;
+}
+
+compact_dir_table::compact_dir_table(const string &root_path) :
+    root(root_path),
+    names_size(0), names_capacity(INITIAL_NAMES_CAPACITY),
+    intern_capacity(INITIAL_INTERN_CAPACITY), num_names(0),
+    num_elms(0), elms_capacity(INITIAL_ELMS_CAPACITY)
+{
+    names = new char[names_capacity];
+    intern_slots = new int[intern_capacity];
+    for (int i = 0; i < intern_capacity; i++) {
+        intern_slots[i] = -1;
+    }
+    elms = new compact_dir_elm[elms_capacity];
+}
+
+compact_dir_table::~compact_dir_table() {
+    delete[] names;
+    delete[] intern_slots;
+    delete[] elms;
+}
+
+// Function: grow_intern_slots
+// Purpose:
+// doubles the intern hash table and re-inserts all names
+void compact_dir_table::grow_intern_slots() {
+    int old_capacity = intern_capacity;
+    int *old_slots = intern_slots;
+
+    intern_capacity = intern_capacity * 2;
+    intern_slots = new int[intern_capacity];
+    for (int i = 0; i < intern_capacity; i++) {
+        intern_slots[i] = -1;
+    }
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_slots[i] >= 0) {
+            const char *name = names + old_slots[i];
+            size_t slot = hash<string_view>()(string_view(name)) & (intern_capacity - 1);
+            while (intern_slots[slot] >= 0) {
+                slot = (slot + 1) & (intern_capacity - 1);
+            }
+            intern_slots[slot] = old_slots[i];
+        }
+    }
+    delete[] old_slots;
+}
+
+int compact_dir_table::intern(const string_view &name) {
+    // keep the table at most half full
+    if (2 * (num_names + 1) > intern_capacity) {
+        grow_intern_slots();
+    }
+
+    size_t slot = hash<string_view>()(name) & (intern_capacity - 1);
+    while (intern_slots[slot] >= 0) {
+        const char *existing = names + intern_slots[slot];
+        if ((strncmp(existing, name.data(), name.size()) == 0) && (existing[name.size()] == '\0')) {
+            return intern_slots[slot];  // already in the arena
+        }
+        slot = (slot + 1) & (intern_capacity - 1);
+    }
+
+    // new name: copy into the arena, '\0' terminated
+    int needed = names_size + name.size() + 1;
+    if (needed > names_capacity) {
+        while (needed > names_capacity) {
+            names_capacity = names_capacity * 2;
+        }
+        char *bigger = new char[names_capacity];
+        memcpy(bigger, names, names_size);
+        delete[] names;
+        names = bigger;
+    }
+    int offset = names_size;
+    memcpy(names + offset, name.data(), name.size());
+    names[offset + name.size()] = '\0';
+    names_size = needed;
+
+    intern_slots[slot] = offset;
+    num_names++;
+    return offset;
+}
+
+int compact_dir_table::add(int parent, int name_offset, int name_length, bool is_directory) {
+    if (num_elms == elms_capacity) {
+        elms = grow_array(elms, num_elms, elms_capacity);
+    }
+    elms[num_elms].parent = parent;
+    elms[num_elms].name_offset = name_offset;
+    elms[num_elms].name_length = name_length;
+    elms[num_elms].is_directory = is_directory;
+    return num_elms++;
+}
+
+string_view compact_dir_table::name(int index) const {
+    return arena_name(elms[index].name_offset, elms[index].name_length);
+}
+
+// Function: path
+//   index: index of the entry
+// Returns: full path of the entry, the same string get_directory_entries would give
+string compact_dir_table::path(int index) const {
+    // collect the names from the entry up to the top directory
+    int depth = 0;
+    for (int i = index; i >= 0; i = elms[i].parent) {
+        depth++;
+    }
+    int *chain = new int[depth];
+    int d = depth;
+    for (int i = index; i >= 0; i = elms[i].parent) {
+        chain[--d] = i;
+    }
+
+    fs::path full(root);
+    for (int i = 0; i < depth; i++) {
+        full /= name(chain[i]);
+    }
+    delete[] chain;
+    return full.string();
+}
+
+dir_elm_info compact_dir_table::info(int index) const {
+    dir_elm_info entry;
+    entry.path = path(index);
+    entry.name = string(name(index));
+    entry.is_directory = elms[index].is_directory;
+    entry.name_hash = hash_name(entry.name);
+    return entry;
+}
+
+long compact_dir_table::memory_used() const {
+    return names_capacity
+         + (long)intern_capacity * sizeof(int)
+         + (long)elms_capacity * sizeof(compact_dir_elm);
+}
+
+// Function: append_compact_entries
+//   table: table to append to
+//   dir_path: path of the directory to list
+//   parent: index of dir_path in the table, -1 for the top directory
+//   listing: reference to a growable scratch array, reused by all directories
+//   listing_capacity: reference to the size of listing
+//   listing_start: where this directory's entries begin in listing
+//   visited: directories already listed
+// Purpose:
+// same order as flatten_directory_entries: files first, then each directory and its contents
+void append_compact_entries(compact_dir_table &table, const string &dir_path, int parent,
+                    compact_dir_elm *&listing, int &listing_capacity, int listing_start,
+                    dir_visit_set &visited)
+{
+    if (!visited.first_visit(dir_path)) {
+        return;     // already listed through another path (or on another file system)
+    }
+    // read the directory once, names go straight into the arena
+    int num_listed = 0;
+    for_each_directory_entry(dir_path, [&](const string &name, bool entry_is_directory) {
+        if (listing_start + num_listed == listing_capacity) {
+            listing = grow_array(listing, listing_start + num_listed, listing_capacity);
+        }
+        compact_dir_elm &elm = listing[listing_start + num_listed++];
+        elm.parent = parent;
+        elm.name_offset = table.intern(name);
+        elm.name_length = name.size();
+        elm.is_directory = entry_is_directory;
+    });
+
+    // sort by name, only the small structs are moved
+    compact_dir_elm *first = listing + listing_start;
+    sort(first, first + num_listed, [&table](const compact_dir_elm &a, const compact_dir_elm &b) {
+        return table.arena_name(a.name_offset, a.name_length)
+             < table.arena_name(b.name_offset, b.name_length);
+    });
+
+    // First:  info of files skipping all directories
+    for (int i = 0; i < num_listed; i++) {
+        compact_dir_elm elm = listing[listing_start + i];
+        if (!elm.is_directory) {
+            table.add(parent, elm.name_offset, elm.name_length, false);
+        }
+    }
+
+    // Second: info of directories and recursively append their contents
+    // (subdirectories use the scratch array after this directory's entries)
+    for (int i = 0; i < num_listed; i++) {
+        compact_dir_elm elm = listing[listing_start + i];
+        if (elm.is_directory) {
+            int index = table.add(parent, elm.name_offset, elm.name_length, true);
+            append_compact_entries(table, table.path(index), index,
+                                   listing, listing_capacity, listing_start + num_listed, visited);
+        }
+    }
+}
+
+// --- Begin exported functions ---
+
+// Function: flatten_directory_compact
+//   path: path to the directory to be flattened
+//   one_file_system: directories on another device than path are not listed
+// Precondition: path is a valid directory path
+// Postcondition: returns a table in the same order as flatten_directory_entries
+//
+// **NOTE**: the allocated table must be deleted by the caller
+compact_dir_table* flatten_directory_compact(const string &path, bool one_file_system) {
+    compact_dir_table *table = new compact_dir_table(path);
+    int listing_capacity = INITIAL_ELMS_CAPACITY;
+    compact_dir_elm *listing = new compact_dir_elm[listing_capacity];
+    dir_visit_set visited(one_file_system);
+    append_compact_entries(*table, path, -1, listing, listing_capacity, 0, visited);
+    delete[] listing;
+    return table;
+}
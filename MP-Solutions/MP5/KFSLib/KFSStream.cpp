@@ -0,0 +1,119 @@
+// File: KFSStream.cpp
+// Implementation of the dir_stream class: a lazy version of flatten_directory_entries
+//
+// With keep_order, the walk is flatten_directory_entries without recursion:
+// each directory on the current path is a Frame on a linked stack. A Frame
+// first produces its files, then, for each of its directories, produces the
+// directory and pushes a Frame for it. A Frame is popped (and its listing
+// deleted) once all of its entries are produced. Each physical directory is
+// listed once (see dir_visit_set): a directory reached again through another
+// path is produced, but its Frame is empty.
+//
+// Without keep_order, the walk is a recursive_directory_iterator, with the same
+// visit set: a directory reached again is produced, but not entered, so a link to
+// a parent directory does not loop forever.
+//
+// recursive_directory_iterator example from cppreference.com
+//      https://en.cppreference.com/w/cpp/filesystem/recursive_directory_iterator
+//
+#include "KFS.h"
+
+// Function: push_frame
+//   path: directory to list
+// Purpose:
+// lists path and makes it the current directory
+void dir_stream::push_frame(const string &path) {
+    Frame *frame = new Frame;
+    frame->entries = nullptr;
+    frame->num_entries = 0;
+    if (visited.first_visit(path)) {
+        frame->entries = get_directory_entries(path, frame->num_entries);
+    }
+    frame->index = 0;
+    frame->files_done = false;
+    frame->next = top;
+    top = frame;
+}
+
+// Function: pop_frame
+// Purpose:
+// done with the current directory, go back to its parent
+void dir_stream::pop_frame() {
+    Frame *frame = top;
+    top = top->next;
+    delete[] frame->entries;
+    delete frame;
+}
+
+dir_stream::dir_stream(const string &path, bool keep_order, bool one_file_system) :
+    top(nullptr), keep_order(keep_order), visited(one_file_system)
+{
+    if (keep_order) {
+        push_frame(path);
+    } else if (is_directory(path) && visited.first_visit(path)) {
+        // follow symbolic links to directories, like flatten_directory_entries
+        unordered = fs::recursive_directory_iterator(path,
+                        fs::directory_options::follow_directory_symlink);
+    }
+}
+
+dir_stream::~dir_stream() {
+    while (top != nullptr) {
+        pop_frame();
+    }
+}
+
+bool dir_stream::next(dir_elm_info &entry) {
+    if (!keep_order) {
+        if (unordered == fs::recursive_directory_iterator()) {
+            return false;
+        }
+        entry.path = unordered->path().string();
+        entry.name = unordered->path().filename().string();
+        entry.is_directory = unordered->is_directory();
+        entry.name_hash = hash_name(entry.name);
+        if (entry.is_directory && !visited.first_visit(entry.path)) {
+            unordered.disable_recursion_pending();  // listed through another path
+        }
+        ++unordered;
+        return true;
+    }
+
+    while (top != nullptr) {
+        // First: info of files skipping all directories
+        if (!top->files_done) {
+            while ((top->index < top->num_entries) && top->entries[top->index].is_directory) {
+                top->index++;
+            }
+            if (top->index < top->num_entries) {
+                entry = move(top->entries[top->index++]);
+                return true;
+            }
+            top->files_done = true;
+            top->index = 0;
+        }
+
+        // Second: info of each directory, followed by its contents
+        while ((top->index < top->num_entries) && !top->entries[top->index].is_directory) {
+            top->index++;
+        }
+        if (top->index < top->num_entries) {
+            entry = top->entries[top->index++];
+            push_frame(entry.path);
+            return true;
+        }
+        pop_frame();
+    }
+    return false;
+}
+
+dir_stream::iterator::iterator(dir_stream *s) : stream(s) {
+    ++(*this);  // move to the first entry
+}
+
+dir_stream::iterator& dir_stream::iterator::operator++() {
+    if ((stream != nullptr) && !stream->next(current)) {
+        stream = nullptr;   // no more entries: becomes end()
+    }
+    return *this;
+}
@@ -0,0 +1,326 @@
+// File: KFSWatch.cpp
+// Implementation of dir_watcher: a flattened directory kept up to date with inotify
+//
+// Linux only. Each directory is watched just before it is listed, so no change
+// can be missed between listing a directory and watching it; a change that is
+// both listed and reported is only applied once.
+//
+// The watcher keeps the listing of each directory, files and subdirectories each
+// sorted by name, found by the path of the directory. A change is applied to the
+// listing of its directory only: a binary search and an insert or erase in that
+// directory, without reading any directory other than a newly created (or moved in)
+// one. The flattened array is built from the listings when it is asked for, once
+// for all the changes since the last time: entries() copies the whole tree again
+// after any change, so it is O(number of entries) per batch of changes; size() is
+// kept up to date with each change and does not build the array.
+//
+// A directory reached through several paths (symbolic links) is listed once, under
+// the first path it is listed under: inotify gives the same watch descriptor for all
+// of them, so the table of watch descriptors is also the set of directories listed,
+// for the first scan and for every directory created later. A directory removed (or
+// moved away) is unwatched, and is listed again if it comes back. If the watched
+// directory itself is removed or moved, the paths in the array are gone: the watcher
+// stops watching and its array is emptied (is_watching() returns false).
+//
+// inotify from the Linux manual
+//      https://man7.org/linux/man-pages/man7/inotify.7.html
+//
+#include "KFS.h"
+#include <algorithm>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+// Local constants
+const int EVENT_BUFFER_SIZE = 64 * 1024;
+const unsigned int WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+// Function: find_name
+//   entries: a part of a listing, sorted by name
+// Returns: the first entry whose name is not less than name
+vector<dir_elm_info>::iterator find_name(vector<dir_elm_info> &entries, const string &name) {
+    return lower_bound(entries.begin(), entries.end(), name,
+                       [](const dir_elm_info &entry, const string &key) { return entry.name < key; });
+}
+
+dir_watcher::dir_watcher(const string &path) : root(path), num_listed(0), flattened_stale(true) {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        cerr << "Warning: inotify is not available, " << path << " will not be watched." << endl;
+    }
+    rescan();
+}
+
+dir_watcher::~dir_watcher() {
+    if (inotify_fd >= 0) {
+        close(inotify_fd);  // also removes all the watches
+    }
+}
+
+// Function: list_directory
+//   dir_path: directory to watch, then list with its subdirectories
+//   visited: directories listed by this call (stops links to a parent directory
+//            even when the watch cannot be added)
+// Returns: false if dir_path was not listed: already listed through another path
+bool dir_watcher::list_directory(const string &dir_path, dir_visit_set &visited) {
+    if (!visited.first_visit(dir_path)) {
+        return false;
+    }
+    int wd = -1;
+    if (inotify_fd >= 0) {
+        wd = inotify_add_watch(inotify_fd, dir_path.c_str(), WATCH_MASK);
+        if (wd >= 0) {
+            if (watched.count(wd) > 0) {
+                return false;   // same directory, already listed under another path
+            }
+            watched[wd] = dir_path;
+        }
+    }
+
+    int num_entries = 0;
+    dir_elm_info *entries = nullptr;
+    try {
+        entries = get_directory_entries(dir_path, num_entries);
+    } catch (const fs::filesystem_error &) {
+        num_entries = 0;    // already gone again: its removal event follows
+    }
+    dir_listing &listing = listings[dir_path];
+    num_listed += num_entries - int(listing.files.size() + listing.subdirs.size());
+    listing.files.clear();
+    listing.subdirs.clear();
+    listing.wd = wd;
+    for (int i = 0; i < num_entries; i++) {
+        (entries[i].is_directory ? listing.subdirs : listing.files).push_back(move(entries[i]));
+    }
+    delete[] entries;
+
+    // listing may move when the table grows: go through the subdirectories by path
+    vector<string> subdir_paths;
+    for (const dir_elm_info &subdir : listing.subdirs) {
+        subdir_paths.push_back(subdir.path);
+    }
+    for (const string &subdir_path : subdir_paths) {
+        list_directory(subdir_path, visited);
+    }
+    return true;
+}
+
+// Function: unwatch_subtree
+//   dir_path: directory removed or moved away
+// Purpose:
+// stops watching dir_path and all of its subdirectories, and forgets their listings
+void dir_watcher::unwatch_subtree(const string &dir_path) {
+    auto found = listings.find(dir_path);
+    if (found == listings.end()) {
+        return;     // not listed under this path
+    }
+    dir_listing listing = move(found->second);
+    listings.erase(found);
+    num_listed -= listing.files.size() + listing.subdirs.size();
+    if (listing.wd >= 0) {
+        inotify_rm_watch(inotify_fd, listing.wd);   // may already be gone, that is ok
+        watched.erase(listing.wd);
+    }
+    for (const dir_elm_info &subdir : listing.subdirs) {
+        unwatch_subtree(subdir.path);
+    }
+}
+
+// Function: rescan
+// Purpose:
+// (re)lists the whole tree, watching every directory
+void dir_watcher::rescan() {
+    for (auto &item : watched) {
+        inotify_rm_watch(inotify_fd, item.first);
+    }
+    watched.clear();
+    listings.clear();
+    num_listed = 0;
+    dir_visit_set visited;
+    list_directory(root, visited);
+    flattened_stale = true;
+}
+
+// Function: append_flattened
+//   dir_path: a directory of the tree
+// Purpose:
+// same order as flatten_directory_entries: files first, then each directory and its contents
+void dir_watcher::append_flattened(const string &dir_path) const {
+    auto found = listings.find(dir_path);
+    if (found == listings.end()) {
+        return;     // listed under another path
+    }
+    const dir_listing &listing = found->second;
+    flattened.insert(flattened.end(), listing.files.begin(), listing.files.end());
+    for (const dir_elm_info &subdir : listing.subdirs) {
+        flattened.push_back(subdir);
+        append_flattened(subdir.path);
+    }
+}
+
+// Function: flattened_entries
+// Returns: the flattened array, built again only if a listing changed since the last time
+const vector<dir_elm_info>& dir_watcher::flattened_entries() const {
+    if (flattened_stale) {
+        flattened.clear();
+        append_flattened(root);
+        flattened_stale = false;
+    }
+    return flattened;
+}
+
+// Function: insert_entry
+//   dir_path: directory where the entry appeared
+//   name: name of the new entry
+//   is_directory: true if the new entry is a directory
+// Returns: true if the flattened array was changed
+bool dir_watcher::insert_entry(const string &dir_path, const string &name, bool is_directory) {
+    auto found = listings.find(dir_path);
+    if (found == listings.end()) {
+        return false;   // not part of the flattened tree (anymore)
+    }
+    dir_listing &listing = found->second;
+    for (vector<dir_elm_info> *part : {&listing.files, &listing.subdirs}) {
+        auto at = find_name(*part, name);
+        if ((at != part->end()) && (at->name == name)) {
+            return false;   // already listed
+        }
+    }
+
+    dir_elm_info entry;
+    entry.path = (fs::path(dir_path) / name).string();
+    entry.name = name;
+    entry.is_directory = is_directory;
+    entry.name_hash = hash_name(name);
+    vector<dir_elm_info> &part = is_directory ? listing.subdirs : listing.files;
+    part.insert(find_name(part, name), entry);
+    num_listed++;
+
+    if (is_directory) {
+        // a new directory may already have contents (e.g., moved in)
+        dir_visit_set visited;
+        list_directory(entry.path, visited);
+    }
+    flattened_stale = true;
+    return true;
+}
+
+// Function: remove_entry
+//   dir_path: directory where the entry disappeared
+//   name: name of the removed entry
+// Returns: true if the flattened array was changed
+bool dir_watcher::remove_entry(const string &dir_path, const string &name) {
+    auto found = listings.find(dir_path);
+    if (found == listings.end()) {
+        return false;
+    }
+    dir_listing &listing = found->second;
+    for (vector<dir_elm_info> *part : {&listing.files, &listing.subdirs}) {
+        auto at = find_name(*part, name);
+        if ((at != part->end()) && (at->name == name)) {
+            string path = at->path;
+            bool was_directory = at->is_directory;
+            part->erase(at);
+            num_listed--;
+            if (was_directory) {
+                unwatch_subtree(path);  // may change listings: listing is not used after this
+            }
+            flattened_stale = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function: refresh_entry
+//   dir_path: a listed subdirectory that was itself removed or moved
+// Returns: the number of changes applied to the flattened array
+// Purpose:
+// its parent reports the change too, except when dir_path is a symbolic link to the
+// directory: the entry is removed from the listing of its parent, and put back if
+// dir_path still names something (e.g., the link, now dangling or to another file)
+int dir_watcher::refresh_entry(const string &dir_path) {
+    fs::path path(dir_path);
+    string parent = path.parent_path().string();
+    if ((fs::path(parent) / "") == (fs::path(root) / "")) {
+        parent = root;  // root may be given with a trailing separator
+    }
+    string name = path.filename().string();
+    int num_changes = remove_entry(parent, name) ? 1 : 0;
+    error_code ec;
+    if (fs::exists(fs::symlink_status(path, ec))) {
+        num_changes += insert_entry(parent, name, fs::is_directory(path, ec)) ? 1 : 0;
+    }
+    return num_changes;
+}
+
+// Function: invalidate
+// Purpose:
+// the watched directory itself was removed or moved: stops watching, and empties the array
+void dir_watcher::invalidate() {
+    cerr << "Warning: " << root << " was removed or moved, it is no longer watched." << endl;
+    close(inotify_fd);  // also removes all the watches
+    inotify_fd = -1;
+    watched.clear();
+    listings.clear();
+    num_listed = 0;
+    flattened.clear();
+    flattened_stale = false;
+}
+
+int dir_watcher::process_events(int timeout_ms) {
+    if (inotify_fd < 0) {
+        return 0;
+    }
+
+    int num_changes = 0;
+    char buffer[EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = {inotify_fd, POLLIN, 0};
+
+    // wait for the first events, then take all that are ready
+    while (poll(&pfd, 1, timeout_ms) > 0) {
+        timeout_ms = 0;
+        ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            break;
+        }
+        for (char *p = buffer; p < buffer + len; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                rescan();       // events were lost: start over
+                num_changes++;
+                continue;
+            }
+            auto found = watched.find(event->wd);
+            if (found == watched.end()) {
+                continue;       // e.g., IN_IGNORED for a removed watch
+            }
+            string dir_path = found->second;   // copy: changes may unwatch
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                if (dir_path == root) {
+                    invalidate();
+                    return num_changes + 1;     // the remaining events are for old paths
+                }
+                num_changes += refresh_entry(dir_path);
+                continue;
+            }
+            if (event->len == 0) {
+                continue;
+            }
+            string name(event->name);
+
+            if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                // symbolic links to directories are directories in the flattened array
+                error_code ec;
+                bool is_dir = (event->mask & IN_ISDIR) || fs::is_directory(fs::path(dir_path) / name, ec);
+                num_changes += insert_entry(dir_path, name, is_dir) ? 1 : 0;
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                num_changes += remove_entry(dir_path, name) ? 1 : 0;
+            }
+        }
+    }
+    return num_changes;
+}
@@ -2,13 +2,32 @@
 // Delete repeated entires from MP4 array
 //
 // Receives a directory path, 
-//   1. finds out how many entries are in the directory and all of the subdirectories
-//   2. construct the flattened array of dir_elm_info
-//   3. examine and remove all entries with duplicated (simple) names
+//   1. construct the flattened array of dir_elm_info (one traversal of the directory tree)
+//   2. examine and remove all entries with duplicated (simple) names
+//
+// usage:
+//      ./RemoveDuplicate [directory_path] [index_file]
+//   index_file: optional, listings of directories that did not change since the
+//               last run are read from this file instead of the file system
+//      ./RemoveDuplicate -benchmark [directory_path]
+//   times remove_duplicate against remove_duplicate_hashed for growing array sizes
+//      ./RemoveDuplicate -stream [directory_path]
+//   same duplicates, found while the tree is walked (see remove_duplicate_stream):
+//   the unique entries are printed one path per line, the array is never built
+//      ./RemoveDuplicate -compact [directory_path]
+//   flattens the tree both as an array and as a compact_dir_table, checks that they
+//   hold the same entries, and prints the memory used by each (see report_compact)
+//      ./RemoveDuplicate -sorted N [directory_path]
+//   checks flatten_directory_sorted, and for_each_sorted_entry keeping at most N entries
+//   in memory (a small N: the external merge), against a sort of the array (see check_sorted)
 
 
 #include <iostream>
+#include <iomanip>
 #include <string>
+#include <chrono>
+#include <algorithm>
+#include <unordered_set>
 #include "KFSLib/KFS.h"
 using namespace std;
 
@@ -26,11 +45,12 @@ using namespace std;
 // Function: remove_duplicate
 //   entries: pointer to an array of dir_elm_info
 //   num_entries: reference to the number of entries in the array
+//   print_removed: print each removed entry
 // Precondition: entries points to an array of at least num_entries elements
 // Postcondition: entries contains only unique entries in the first num_entries positions
 // Purpose:
 // deletes repeated entries from the array  
-void remove_duplicate(dir_elm_info* entries, int &num_entries) {
+void remove_duplicate(dir_elm_info* entries, int &num_entries, bool print_removed = true) {
     if (num_entries <= 1) 
         return; // No repeats possible
 
@@ -53,7 +73,7 @@ void remove_duplicate(dir_elm_info* entries, int &num_entries) {
             // last_unique: is the next position to store a unique entry
             entries[last_unique] = entries[index_to_examine];
             last_unique++;  // one more unique found
-        } else {
+        } else if (print_removed) {
             // duplicate found, print out the details of the duplicate
             cout << "** Removing duplicated name index=" << index_to_examine << ": " << entries[index_to_examine].path << endl;
         }
@@ -62,6 +82,235 @@ void remove_duplicate(dir_elm_info* entries, int &num_entries) {
     num_entries = last_unique; // Update the size to initially,  entries
 }
 
+// Algorithm (same result as remove_duplicate, in O(n) instead of O(n^2)):
+// Instead of comparing with every entry in the unique part, a hash table remembers
+// where each unique name is kept. The table is an array of indices into the unique
+// part (-1: empty slot), the slot of a name is found from its name_hash (computed
+// when the directory was listed), moving to the next slot while the slot is taken
+// by a different name (linear probing).
+//
+// Function: remove_duplicate_hashed
+//   entries: pointer to an array of dir_elm_info
+//   num_entries: reference to the number of entries in the array
+//   print_removed: print each removed entry
+// Precondition: entries points to an array of at least num_entries elements
+// Postcondition: entries contains only unique entries in the first num_entries positions,
+//                in the same order as remove_duplicate
+// Purpose:
+// deletes repeated entries from the array
+void remove_duplicate_hashed(dir_elm_info* entries, int &num_entries, bool print_removed = true) {
+    if (num_entries <= 1)
+        return; // No repeats possible
+
+    // table size: a power of 2, at least twice the number of entries
+    int table_size = 1;
+    while (table_size < 2 * num_entries) {
+        table_size *= 2;
+    }
+    int *table = new int[table_size];
+    for (int i = 0; i < table_size; i++) {
+        table[i] = -1;
+    }
+
+    int last_unique = 0;
+    for (int index_to_examine = 0; index_to_examine < num_entries; ++index_to_examine) {
+        const dir_elm_info &entry = entries[index_to_examine];
+        int slot = entry.name_hash & (table_size - 1);
+        bool dup_found = false;
+        while ((!dup_found) && (table[slot] >= 0)) {
+            const dir_elm_info &kept = entries[table[slot]];
+            dup_found = (kept.name_hash == entry.name_hash) && (kept.name == entry.name);
+            if (!dup_found)
+                slot = (slot + 1) & (table_size - 1);
+        }
+
+        if (!dup_found) {
+            // unique: keep it, and remember where
+            if (last_unique != index_to_examine)
+                entries[last_unique] = entries[index_to_examine];
+            table[slot] = last_unique;
+            last_unique++;
+        } else if (print_removed) {
+            cout << "** Removing duplicated name index=" << index_to_examine << ": " << entries[index_to_examine].path << endl;
+        }
+    }
+    delete[] table;
+    num_entries = last_unique;
+}
+
+// Function: remove_duplicate_stream
+//   path: a directory
+//   num_entries: output, number of entries walked
+// Returns: number of entries removed
+// Purpose:
+// same result as flatten_directory + remove_duplicate_hashed, but the entries come from
+// a dir_stream (same order as the flattened array, so the same indices are reported)
+// and are printed as they are found: the unique entries one path per line, each removed
+// entry as by remove_duplicate. Only the distinct names are kept in memory, and the
+// listings of the directories on the current path (see dir_stream).
+int remove_duplicate_stream(const string &path, int &num_entries) {
+    unordered_set<string> names_seen;
+    dir_entry_writer writer(cout, PRINT_LINES);
+    int num_removed = 0;
+    num_entries = 0;
+    for (const dir_elm_info &entry : dir_stream(path)) {
+        if (names_seen.insert(entry.name).second) {
+            writer.write(entry);
+        } else {
+            writer.flush();     // the unique entries before this one come first
+            cout << "** Removing duplicated name index=" << num_entries << ": " << entry.path << endl;
+            num_removed++;
+        }
+        num_entries++;
+    }
+    writer.finish();
+    return num_removed;
+}
+
+// Function: heap_bytes
+// Returns: bytes allocated on the heap by str, 0 when the characters are kept
+//          inside the string object itself (short strings)
+long heap_bytes(const string &str) {
+    const char *object = reinterpret_cast<const char*>(&str);
+    bool in_object = (str.data() >= object) && (str.data() < object + sizeof(str));
+    return in_object ? 0 : str.capacity() + 1;
+}
+
+// Function: report_compact
+//   path: the directory flattened into entries
+//   entries: pointer to an array of dir_elm_info, from flatten_directory
+//   num_entries: number of entries in the array
+// Returns: true if the compact table of path holds the same entries
+// Purpose:
+// flattens path again with flatten_directory_compact, compares each entry of the table
+// (see compact_dir_table::info) with the array, and prints the memory of both layouts
+bool report_compact(const string &path, const dir_elm_info *entries, int num_entries) {
+    compact_dir_table *table = flatten_directory_compact(path);
+    bool same = (table->size() == num_entries);
+    int first_difference = -1;
+    for (int i = 0; same && (i < num_entries); i++) {
+        dir_elm_info entry = table->info(i);
+        same = (entry.path == entries[i].path) && (entry.name == entries[i].name)
+               && (entry.is_directory == entries[i].is_directory);
+        if (!same)
+            first_difference = i;
+    }
+
+    long array_bytes = (long)num_entries * sizeof(dir_elm_info);
+    for (int i = 0; i < num_entries; i++) {
+        array_bytes += heap_bytes(entries[i].path) + heap_bytes(entries[i].name);
+    }
+    cout << "Array: " << num_entries << " entries, " << array_bytes << " bytes" << endl;
+    cout << "Compact table: " << table->size() << " entries, " << table->num_distinct_names()
+         << " distinct names, " << table->memory_used() << " bytes" << endl;
+    if (same) {
+        cout << "Compact table holds the same entries as the array" << endl;
+    } else if (first_difference >= 0) {
+        cout << "**Error**: results differ at entry " << first_difference << endl;
+    } else {
+        cout << "**Error**: results differ in the number of entries" << endl;
+    }
+    delete table;
+    return same;
+}
+
+// Function: check_sorted
+//   path: the directory flattened into entries
+//   entries: pointer to an array of dir_elm_info, from flatten_directory
+//   num_entries: number of entries in the array
+//   max_in_memory: for for_each_sorted_entry, entries kept in memory (0: no limit)
+// Returns: true if both sorted versions are the array sorted by name
+// Purpose:
+// the array, stable sorted by name (entries of the same name stay in the flattened
+// order), is the expected result of flatten_directory_sorted and of for_each_sorted_entry
+bool check_sorted(const string &path, const dir_elm_info *entries, int num_entries,
+                  int max_in_memory) {
+    dir_elm_info *expected = new dir_elm_info[num_entries];
+    for (int i = 0; i < num_entries; i++) {
+        expected[i] = entries[i];
+    }
+    stable_sort(expected, expected + num_entries, [](const dir_elm_info &a, const dir_elm_info &b) {
+        return a.name < b.name;
+    });
+
+    int num_sorted = 0;
+    dir_elm_info *sorted = flatten_directory_sorted(path, num_sorted);
+    int first_difference = (num_sorted == num_entries) ? -1 : min(num_sorted, num_entries);
+    for (int i = 0; (first_difference < 0) && (i < num_entries); i++) {
+        if (sorted[i].path != expected[i].path)
+            first_difference = i;
+    }
+    delete[] sorted;
+    cout << "flatten_directory_sorted: " << num_sorted << " entries";
+    if (first_difference < 0)
+        cout << ", same order as the sorted array" << endl;
+    else
+        cout << "  **Error**: results differ at entry " << first_difference << endl;
+    bool same = (first_difference < 0);
+
+    int num_visited = 0;
+    first_difference = -1;
+    for_each_sorted_entry(path, [&](const dir_elm_info &entry) {
+        if ((first_difference < 0)
+            && ((num_visited >= num_entries) || (entry.path != expected[num_visited].path)))
+            first_difference = num_visited;
+        num_visited++;
+    }, max_in_memory);
+    if ((first_difference < 0) && (num_visited != num_entries))
+        first_difference = num_visited;
+    cout << "for_each_sorted_entry (at most " << max_in_memory << " entries in memory): "
+         << num_visited << " entries";
+    if (first_difference < 0)
+        cout << ", same order as the sorted array" << endl;
+    else
+        cout << "  **Error**: results differ at entry " << first_difference << endl;
+    same = same && (first_difference < 0);
+
+    delete[] expected;
+    return same;
+}
+
+// Function: benchmark_remove_duplicate
+//   entries: pointer to an array of dir_elm_info
+//   num_entries: number of entries in the array
+// Purpose:
+// times both versions on the first 16, 32, 64, ... entries (and on all entries),
+// to show from which size the hashed version is faster
+void benchmark_remove_duplicate(const dir_elm_info *entries, int num_entries) {
+    const int COL_WIDTH = 14;
+    cout << setw(COL_WIDTH) << right << "entries" << setw(COL_WIDTH) << "O(n^2) ms"
+         << setw(COL_WIDTH) << "hashed ms" << setw(COL_WIDTH) << "unique" << endl;
+
+    int size = 16;
+    while (size > 0) {
+        if (size > num_entries)
+            size = num_entries;
+        double ms[2];
+        int num_unique[2];
+        for (int version = 0; version < 2; version++) {
+            dir_elm_info *copy = new dir_elm_info[size];
+            for (int i = 0; i < size; i++) {
+                copy[i] = entries[i];
+            }
+            num_unique[version] = size;
+            auto start = chrono::steady_clock::now();
+            if (version == 0)
+                remove_duplicate(copy, num_unique[version], false);
+            else
+                remove_duplicate_hashed(copy, num_unique[version], false);
+            auto stop = chrono::steady_clock::now();
+            ms[version] = chrono::duration<double, milli>(stop - start).count();
+            delete[] copy;
+        }
+        cout << setw(COL_WIDTH) << size << fixed << setprecision(3)
+             << setw(COL_WIDTH) << ms[0] << setw(COL_WIDTH) << ms[1]
+             << setw(COL_WIDTH) << num_unique[1]
+             << (num_unique[0] == num_unique[1] ? "" : "  **Error**: results differ") << endl;
+
+        size = (size == num_entries) ? 0 : size * 2;  // 0: done
+    }
+}
+
 int main(int argc, char* argv[]) {
     string input_path = "."; // Default to current directory
     cout << "Your command: ";
@@ -70,28 +319,97 @@ int main(int argc, char* argv[]) {
     } 
     cout << endl;
 
+    bool benchmark = false, stream = false, compact = false;
+    int sorted_in_memory = -1;  // optional: -sorted N, -1: not given
+    while (argc > 1) {
+        string option = argv[1];
+        if (option == "-benchmark")
+            benchmark = true;
+        else if (option == "-stream")
+            stream = true;
+        else if (option == "-compact")
+            compact = true;
+        else if ((option == "-sorted") && (argc > 2)) {
+            sorted_in_memory = max(0, stoi(argv[2]));
+            argc--;
+            argv++;
+        } else
+            break;
+        argc--;
+        argv++;     // the remaining arguments are as usual
+    }
+    if ((int)benchmark + (int)stream + (int)compact + (int)(sorted_in_memory >= 0) > 1) {
+        cerr << "**Error**: use only one of -benchmark, -stream, -compact and -sorted" << endl;
+        return 1;   // error
+    }
     if (argc > 1) {
         input_path = argv[1];
     }
+    string index_file;      // optional: index of listings from earlier runs
+    if (argc > 2) {
+        index_file = argv[2];
+    }
 
     if (!is_directory(input_path)) {
         cerr << "**Error**: Input path is not a valid directory: " << input_path << endl;
         return 1;   // error
     }
 
+    if (stream) {
+        if (!index_file.empty()) {
+            cerr << "**Error**: -stream cannot be used with an index_file" << endl;
+            return 1;   // error
+        }
+        cout << "Walking directory: " << fs::absolute(input_path) << endl;
+        cout << "And, remove all duplicated names as they are found." << endl << endl;
+        int num_entries = 0;
+        int num_removed = remove_duplicate_stream(input_path, num_entries);
+        cout << endl;
+        cout << "Number of entries (files + directories)=" << num_entries
+             << ", after removing dupliated=" << (num_entries - num_removed) << endl;
+        cout << "Total removed: " << num_removed << endl;
+        cout << endl;
+        return 0;
+    }
+
     // Inform the user: 
     cout << "Flattening directory: " << fs::absolute(input_path) << endl;
     cout << "And, remove all duplicated names." << endl << endl;
 
-    int num_entries = num_dir_entries(input_path);
-    dir_elm_info* entries = new dir_elm_info[num_entries];
-    int insert_index = 0;
-    flatten_directory_entries(input_path, entries, insert_index);  
+    int num_entries = 0;
+    dir_elm_info* entries = nullptr;
+    if (index_file.empty()) {
+        entries = flatten_directory(input_path, num_entries);
+    } else {
+        // only directories changed since the last run are read again
+        dir_index_cache cache(index_file);
+        entries = flatten_directory(input_path, num_entries, cache.lister());
+        cache.save();
+#ifdef DEBUG
+        cerr << "Index " << index_file << ": " << cache.hits() << " directories unchanged, "
+             << cache.misses() << " read" << endl;
+#endif
+    }
+    if (benchmark) {
+        benchmark_remove_duplicate(entries, num_entries);
+        delete[] entries;
+        return 0;
+    }
+    if (compact) {
+        bool same = report_compact(input_path, entries, num_entries);
+        delete[] entries;
+        return same ? 0 : 1;
+    }
+    if (sorted_in_memory >= 0) {
+        bool same = check_sorted(input_path, entries, num_entries, sorted_in_memory);
+        delete[] entries;
+        return same ? 0 : 1;
+    }
     cout << "Before removing dupliated number of entries (files + directories)=" << num_entries << endl;
     print_dir_entries(entries, num_entries);
 
     int original_num_entries = num_entries;
-    remove_duplicate(entries, num_entries);
+    remove_duplicate_hashed(entries, num_entries);
 
     cout << endl;
     cout << "After removing dupliated number of entries (files + directories)=" << num_entries << endl;
@@ -100,6 +418,10 @@ int main(int argc, char* argv[]) {
     cout << "Total removed: " << (original_num_entries - num_entries) << endl;
     cout << endl;
 
+#ifdef DEBUG
+    cerr << "stat calls made: " << stat_calls_made()
+         << " avoided: " << stat_calls_avoided() << endl;
+#endif
     delete[] entries; // Clean up dynamically allocated memory
     return 0;
 }
\ No newline at end of file
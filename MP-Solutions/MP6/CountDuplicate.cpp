@@ -3,12 +3,37 @@
 // and keep track of the duplicate names and their counts in a separate dup array, make sure
 // the dup array is kept sorted by name.
 //
-// Note: keeping an array sorted requires shifting elements when inserting a new element, this 
-//       may not be the most efficient way, but for learning purposes, this is acceptable.   
+// Note: keeping an array sorted requires shifting elements when inserting a new element,
+//       instead, the dup array is sorted once at the end (see remove_and_count_duplicate).
+//
+// usage:
+//      ./CountDuplicate -watch SECONDS [directory_path]
+//      ./CountDuplicate [-threads N] [-contents | -usage N] [-io_uring] [-sort ORDER] [filter options] [-xdev] [directory_path] [index_file]
+//   -threads N: optional, look for duplicates with N threads (0: one per hardware thread)
+//   -contents: optional, instead of duplicate names, report files with identical contents
+//   -usage N: optional, instead of duplicate names, report the disk usage (like du)
+//             and the N directories using the most disk space; with -xdev, only on
+//             this file system (the other filter options cannot be used with -usage)
+//   -watch SECONDS: instead of duplicate names, keep the flattened directory up to date
+//                   with dir_watcher for SECONDS, and check it after each change (see
+//                   watch_directory); no other option can be used with -watch
+//   -io_uring: optional, read directories with the io_uring backend (see KFSUring.cpp)
+//   -sort ORDER: optional, order of the entries of each directory: name (default),
+//                natural, dirs-first, or none (file system order, no sorting); only
+//                name with index_file, the index keeps its listings by name
+//   filter options: optional, any of -include GLOB, -regex PATTERN, -exclude GLOB,
+//                   -exclude_regex PATTERN, -prune GLOB, -maxdepth N (see dir_filter), e.g., -exclude .git
+//   -xdev: optional, do not list directories on other file systems
+//   index_file: optional, listings of directories that did not change since the
+//               last run are read from this file instead of the file system
 //
 
 #include <iostream>
+#include <iomanip>
 #include <string>
+#include <algorithm>
+#include <thread>
+#include <chrono>
 #include "KFSLib/KFS.h"
 using namespace std;
 
@@ -23,70 +48,152 @@ struct dup_info {
 };
 
 
-// Function: insert_name_at
-// Purpose: Insert a new duplicate name into the dup_array at the specified index
+// Algorithm:
+// The dup array is still reported sorted by name, and each removal still reports the
+// index where the name is in the sorted dup array at that time, but without keeping
+// a sorted array up to date (which shifts the array tail on every insert):
+//   1. hash tables find the first entry with each name: the array is split in one
+//      chunk per thread, each thread sorts the indices of its chunk into shards by
+//      name hash (partition), then each thread finds the first entries of one shard,
+//      with a hash table sized for that shard. The results of the shards are merged
+//      by one pass over the entries, which removes the duplicates (same as MP5) and
+//      counts the duplicates of each unique name, remembering the removals in order
+//   2. the names with duplicates are sorted once: this is the final dup array, of
+//      exactly the right size
+//   3. the removals are replayed in order: a Fenwick tree (binary indexed tree) over
+//      the final sorted positions counts how many of the names before a name are
+//      already in the dup array, that is the index the name has at that time.
+// Lookups and inserts are O(1) (hash table) and O(log d) (Fenwick tree), the sort is O(d log d).
+
+// Fenwick tree: prefix sums over positions 0..size-1, update and query in O(log size)
+// https://en.wikipedia.org/wiki/Fenwick_tree
+struct fenwick_tree {
+    int *sums;
+    int size;
+};
+
+// Function: fenwick_add
+// Purpose: adds 1 at position
+void fenwick_add(fenwick_tree &tree, int position) {
+    for (int i = position + 1; i <= tree.size; i += (i & -i)) {
+        tree.sums[i]++;
+    }
+}
+
+// Function: fenwick_count_before
+// Returns: the sum of positions 0..position-1
+int fenwick_count_before(const fenwick_tree &tree, int position) {
+    int sum = 0;
+    for (int i = position; i > 0; i -= (i & -i)) {
+        sum += tree.sums[i];
+    }
+    return sum;
+}
+
+// Function: shard_of
+// Returns: the shard of a name: high bits of its hash (the low bits pick the slot)
+int shard_of(size_t name_hash, int num_shards) {
+    return (int)((name_hash >> 32) % num_shards);
+}
+
+// Function: find_first_shard
+// Purpose: For the names in one shard, find the first entry with the same name.
 // Parameters:
-//   - new_name: The name to insert
-//   - index: The index at which to insert the new name
-//   - dup_array: The array of duplicate information
-//  - num_dups: The current number of duplicates in the array (will be updated)
-// Will ensure the array remains sorted after insertion.
-// Precondition: index is a valid position to insert (0 <= index) and 
-//               that there is enough space in dup_array. (index <= num_dups)
-void insert_name_at(string new_name, int index, dup_info *dup_array, int &num_dups) {
-    if (index < num_dups) {
-        // need to shift all entries from current by 1 
-        // must start from the end (where the free entry is)
-        for (int i = num_dups; i > index; i--) {
-            dup_array[i] = dup_array[i-1];
-        }
-    }
-    num_dups++;
-    dup_array[index].name = new_name;
-    dup_array[index].count = 1;
+//   - entries: The array of directory entries
+//   - indices: the indices of the entries of the shard, in increasing order
+//   - num_indices: number of indices
+//   - first_index: output, for each entry of the shard: index of the first entry with the same name
+// Each shard has its own hash table: shards never look at the same entries, and
+// each writes to different elements of first_index, so shards can run in parallel.
+void find_first_shard(const dir_elm_info *entries, const int *indices, int num_indices,
+                      int *first_index) {
+    int table_size = 1;     // a power of 2, at least twice the number of entries of the shard
+    while (table_size < 2 * num_indices) {
+        table_size *= 2;
+    }
+    int *table = new int[table_size];       // index of a first entry, -1: empty slot
+    for (int i = 0; i < table_size; i++) {
+        table[i] = -1;
+    }
+
+    for (int i = 0; i < num_indices; ++i) {
+        int index_to_examine = indices[i];
+        const dir_elm_info &entry = entries[index_to_examine];
+        int slot = entry.name_hash & (table_size - 1);
+        bool dup_found = false;
+        while ((!dup_found) && (table[slot] >= 0)) {
+            const dir_elm_info &first = entries[table[slot]];
+            dup_found = (first.name_hash == entry.name_hash) && (first.name == entry.name);
+            if (!dup_found)
+                slot = (slot + 1) & (table_size - 1);
+        }
+        if (!dup_found)
+            table[slot] = index_to_examine;
+        first_index[index_to_examine] = table[slot];
+    }
+    delete[] table;
 }
 
-// Function: check_dup_array   
-// Purpose: Check if a duplicate name exists in the dup_array.
-//          If it exists, increment its count.  
-//          If it does not exist, insert it in sorted order.
-// Parameters: 
-//   - dup_name: The name to check
-//   - dup_array: The array of duplicate information
-//   - num_dups: The current number of duplicates in the array (will be updated)
-// Precondition: dup_array is sorted by name.
-// Returns: The index of the duplicate name in dup_array.
-int check_dup_array(string dup_name, dup_info *dup_array, int &num_dups) {
-    bool foundInArray = false;
-    bool foundInsertIndex = false;
-    int index = 0;
-
-    // Note: dup_array is kept sorted
-    //       when looking for name in dup_array, we can stop looping as soon
-    //       as there is a name that is larger than the current name 
-    // We could have used binary search, but for simplicity, we will use linear search here.
-    while ((!foundInArray) && (!foundInsertIndex) && (index < num_dups)) {
-        foundInArray = (dup_name == dup_array[index].name);
-        foundInsertIndex = (dup_name < dup_array[index].name);
-        if ((!foundInArray) && (!foundInsertIndex))
-            index++;  // keep looking
-        // otherwise, we have found either the name, or the insert location: that is the index
-    }
-
-    if (foundInArray) {
-        dup_array[index].count++;  // simply increment the count
-    } else {
-        // interestingly, there are two conditions here:
-        //      1) foundInsertIndex is true: this is the index to insert at 
-        //      2) foundInsertIndex is false: since we know foundInArray is also false,
-        //               this says, we went through the entire array (index==num_dups) 
-        //               and all existing names are smaller than dup_name, 
-        //               so we should insert at the end. Since we know index == num_dups,
-        //               we can simply use index as the insert location.
-        // In both cases, index is the correct insert location.
-        insert_name_at(dup_name, index, dup_array, num_dups);
-    }
-    return index;
+// Function: find_first_occurrences
+// Purpose: For each entry, find the first entry with the same name.
+// Parameters:
+//   - entries: The array of directory entries
+//   - num_entries: The number of entries in the array
+//   - first_index: output, first_index[i] is the index of the first entry with the name of entries[i]
+//                  (i itself, if entries[i] is the first)
+//   - num_threads: number of threads, and of shards
+// Steps (each one on all threads, see parallel_for):
+//   1. each thread counts the entries of each shard in its chunk of the array
+//   2. the counts give where the indices of each (shard, chunk) go in by_shard:
+//      the shards one after the other, each in the order of the array
+//   3. each thread writes the indices of its chunk there
+//   4. each thread finds the first entries of one shard
+void find_first_occurrences(const dir_elm_info *entries, int num_entries, int *first_index,
+                            int num_threads) {
+    int num_shards = max(1, num_threads);
+    int *counts = new int[num_shards * num_shards];     // [chunk * num_shards + shard]
+    int *by_shard = new int[num_entries];
+    int *shard_start = new int[num_shards + 1];
+    auto chunk_begin = [num_entries, num_shards](int chunk) {
+        return (int)((long long)num_entries * chunk / num_shards);
+    };
+
+    parallel_for(num_shards, num_shards, [&](int chunk) {
+        int *chunk_counts = counts + chunk * num_shards;
+        for (int s = 0; s < num_shards; s++) {
+            chunk_counts[s] = 0;
+        }
+        for (int i = chunk_begin(chunk); i < chunk_begin(chunk + 1); i++) {
+            chunk_counts[shard_of(entries[i].name_hash, num_shards)]++;
+        }
+    });
+
+    int position = 0;   // counts become the starting positions
+    for (int s = 0; s < num_shards; s++) {
+        shard_start[s] = position;
+        for (int chunk = 0; chunk < num_shards; chunk++) {
+            int count = counts[chunk * num_shards + s];
+            counts[chunk * num_shards + s] = position;
+            position += count;
+        }
+    }
+    shard_start[num_shards] = position;
+
+    parallel_for(num_shards, num_shards, [&](int chunk) {
+        int *next = counts + chunk * num_shards;
+        for (int i = chunk_begin(chunk); i < chunk_begin(chunk + 1); i++) {
+            by_shard[next[shard_of(entries[i].name_hash, num_shards)]++] = i;
+        }
+    });
+
+    parallel_for(num_shards, num_shards, [&](int shard) {
+        find_first_shard(entries, by_shard + shard_start[shard],
+                         shard_start[shard + 1] - shard_start[shard], first_index);
+    });
+
+    delete[] shard_start;
+    delete[] by_shard;
+    delete[] counts;
 }
 
 // Function: remove_and_count_duplicate
@@ -94,46 +201,240 @@ int check_dup_array(string dup_name, dup_info *dup_array, int &num_dups) {
 // Parameters:
 //   - entries: The array of directory entries
 //   - num_entries: The current number of entries in the array (will be updated as duplicates are removed)
-//   - dup_array: The array to store duplicate information
-//   - num_dups: The current number of duplicates in dup_array (will be updated as duplicates are inserted)
-// Precondition: entries may contain duplicate names, 
-//               dup_array has enough space to hold duplicates and num_dups is initialized to 0.
-void remove_and_count_duplicate(dir_elm_info *entries, int &num_entries, dup_info *dup_array, int &num_dups) {
-
+//   - num_dups: output, the number of duplicated names in the returned array
+//   - num_threads: number of threads looking for duplicates (the result does not depend on it)
+// Precondition: entries may contain duplicate names
+// Returns: the dup array, sorted by name (nullptr if there are no duplicates)
+//
+// **NOTE**: the allocated array must be deleted by the caller
+dup_info* remove_and_count_duplicate(dir_elm_info *entries, int &num_entries, int &num_dups,
+                                     int num_threads = 1) {
+    num_dups = 0;
     if (num_entries <= 1) 
-        return; // No dups possible
+        return nullptr; // No dups possible
 
-    int last_unique = 1; // 0th is unique, so initially, the last unique is 1
+    // 1. remove the duplicates, counting them for each unique name
+    int *first_index = new int[num_entries];    // index of the first entry with the same name
+    find_first_occurrences(entries, num_entries, first_index, num_threads);
 
-    // must search the entire array
-    for (int index_to_examine = 1; index_to_examine < num_entries; ++index_to_examine) {
-        int current_index = 0;
-        bool dup_found = false;
+    int *dup_count = new int[num_entries];  // dup_count[u]: duplicates of unique entry u
+    int *new_index = first_index;           // reused: where a unique entry is kept
+    int *removed_index = new int[num_entries];  // removals, in order: original index
+    int *removed_unique = new int[num_entries]; //                     and the unique entry
+    int num_removed = 0;
 
-        // look at all entries that are currently unique
-        while ( (!dup_found) && (current_index < last_unique) ) {
-            // compare with the index_to_examine
-            dup_found = (entries[index_to_examine].name == entries[current_index].name);
-            current_index++;
-        }
-        
-        if (!dup_found) { 
-            // index_to_examine: is also unique
-            // last_unique: is the next position to store a unique entry
-            entries[last_unique] = entries[index_to_examine];
-            last_unique++;  // one more unique found
+    int last_unique = 0;
+    for (int index_to_examine = 0; index_to_examine < num_entries; ++index_to_examine) {
+        if (first_index[index_to_examine] == index_to_examine) {
+            if (last_unique != index_to_examine)
+                entries[last_unique] = entries[index_to_examine];
+            new_index[index_to_examine] = last_unique;
+            dup_count[last_unique] = 0;
+            last_unique++;
         } else {
-            // duplicate found: insert into duplicate array and print out the details of the duplicate
-            // Note the complete identical to MP4 until this point, the only difference is that now we need to
-            // keep track of the duplicate names and their counts in dup_array.
-            int index = check_dup_array(entries[index_to_examine].name, dup_array, num_dups);
-            cout << "** Removing from index=" << setw(INDEX_WIDTH) << right << index_to_examine 
-                 << ": " << setw(NAME_WIDTH) << entries[index_to_examine].name 
-                 << " Insert into index=" << index << endl;
+            // the first entry is before this one: already moved to where it is kept
+            int unique = new_index[first_index[index_to_examine]];
+            dup_count[unique]++;
+            removed_index[num_removed] = index_to_examine;
+            removed_unique[num_removed] = unique;
+            num_removed++;
+        }
+    }
+    delete[] first_index;
+
+    // 2. the dup array: names with duplicates, sorted once
+    for (int u = 0; u < last_unique; u++) {
+        if (dup_count[u] > 0)
+            num_dups++;
+    }
+    dup_info *dup_array = nullptr;
+    int *dup_position = new int[last_unique];   // position of unique entry u in dup_array
+    if (num_dups > 0) {
+        int *order = new int[num_dups];         // unique entries with duplicates
+        int n = 0;
+        for (int u = 0; u < last_unique; u++) {
+            if (dup_count[u] > 0)
+                order[n++] = u;
+        }
+        sort(order, order + num_dups, [entries](int a, int b) {
+            return entries[a].name < entries[b].name;
+        });
+        dup_array = new dup_info[num_dups];
+        for (int i = 0; i < num_dups; i++) {
+            dup_array[i].name = entries[order[i]].name;
+            dup_array[i].count = dup_count[order[i]];
+            dup_position[order[i]] = i;
+        }
+        delete[] order;
+    }
+
+    // 3. report the removals, with the index each name had in the dup array at the time
+    fenwick_tree inserted;
+    inserted.size = num_dups;
+    inserted.sums = new int[num_dups + 1];
+    for (int i = 0; i <= num_dups; i++) {
+        inserted.sums[i] = 0;
+    }
+    for (int r = 0; r < num_removed; r++) {
+        int u = removed_unique[r];
+        int position = dup_position[u];
+        if (dup_count[u] > 0) {
+            fenwick_add(inserted, position);    // first removal of this name: inserted
+            dup_count[u] = 0;                   // (count already copied to dup_array)
         }
-            
+        int index = fenwick_count_before(inserted, position);
+        cout << "** Removing from index=" << setw(INDEX_WIDTH) << right << removed_index[r] 
+             << ": " << setw(NAME_WIDTH) << entries[u].name 
+             << " Insert into index=" << index << endl;
     }
+
+    delete[] inserted.sums;
+    delete[] dup_position;
+    delete[] dup_count;
+    delete[] removed_index;
+    delete[] removed_unique;
     num_entries = last_unique; // Update the size to initially,  entries
+    return dup_array;
+}
+
+// Function: report_content_duplicates
+// Purpose: Print the groups of files with identical contents.
+// Parameters:
+//   - entries: The array of directory entries
+//   - num_entries: The number of entries in the array
+//   - num_threads: number of threads reading files
+void report_content_duplicates(const dir_elm_info *entries, int num_entries, int num_threads) {
+    int *group_of = new int[num_entries];
+    int num_groups = find_content_duplicates(entries, num_entries, group_of, num_threads);
+
+    // group g is printed with its files in the order of the flattened array
+    int *group_size = new int[num_groups];
+    for (int g = 0; g < num_groups; g++) {
+        group_size[g] = 0;
+    }
+    int num_files = 0;
+    for (int i = 0; i < num_entries; i++) {
+        if (group_of[i] >= 0) {
+            group_size[group_of[i]]++;
+            num_files++;
+        }
+    }
+    cout << "Files with identical contents:" << endl;
+    int next = 0;   // first entry that may start the next group
+    for (int g = 0; g < num_groups; g++) {
+        while (group_of[next] != g) {
+            next++;
+        }
+        error_code ec;  // the file may have been removed since it was compared
+        uintmax_t size = fs::file_size(entries[next].path, ec);
+        cout << "  Group(" << setw(INDEX_WIDTH) << right << g << "): ";
+        if (ec) {
+            cout << "?";
+        } else {
+            cout << size;
+        }
+        cout << " bytes, Count = " << group_size[g] << endl;
+        for (int i = next; i < num_entries; i++) {
+            if (group_of[i] == g) {
+                cout << "      " << entries[i].path << endl;
+            }
+        }
+    }
+    cout << endl;
+    cout << "Total files with identical contents: " << num_files
+         << " in " << num_groups << " groups" << endl;
+
+#ifdef DEBUG
+    cerr << "bytes read: " << content_bytes_read() << endl;
+#endif
+    delete[] group_size;
+    delete[] group_of;
+}
+
+// Function: parse_sort_order
+// Purpose: Read the ORDER of the -sort option.
+// Returns: false if text is not an order
+bool parse_sort_order(const string &text, sort_order &order) {
+    if (text == "none") {
+        order = SORT_NONE;
+    } else if (text == "name") {
+        order = SORT_NAME;
+    } else if (text == "natural") {
+        order = SORT_NATURAL;
+    } else if (text == "dirs-first") {
+        order = SORT_DIRS_FIRST;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Function: report_disk_usage
+// Purpose: Print the disk usage of a directory and its heaviest directories.
+// Parameters:
+//   - path: The directory to measure
+//   - top_n: The number of heaviest directories to print
+//   - num_threads: number of threads reading directories
+//   - one_file_system: directories on other file systems are not counted (-xdev)
+void report_disk_usage(const string &path, int top_n, int num_threads, bool one_file_system) {
+    dir_usage *heaviest = new dir_usage[top_n];
+    int num_heaviest = 0;
+    disk_usage total = directory_usage(path, heaviest, top_n, num_heaviest, num_threads,
+                                       one_file_system);
+
+    cout << "Disk usage: " << total.allocated_size << " bytes allocated, "
+         << total.apparent_size << " bytes apparent size, " << total.num_files << " files" << endl;
+    cout << "Heaviest directories:" << endl;
+    for (int i = 0; i < num_heaviest; i++) {
+        cout << "  (" << setw(INDEX_WIDTH) << right << i << "): "
+             << setw(NAME_WIDTH) << heaviest[i].usage.allocated_size << " bytes, "
+             << heaviest[i].usage.num_files << " files  " << heaviest[i].path << endl;
+    }
+    delete[] heaviest;
+}
+
+// Function: watch_directory
+// Purpose: Keep the flattened directory up to date with dir_watcher, and after each
+//          batch of changes, check it against the directory flattened again.
+// Parameters:
+//   - path: The directory to watch
+//   - seconds: how long to watch
+// Returns: false if the watched array differed from the flattened one (a change made
+//          while the directory is flattened again can also make them differ)
+bool watch_directory(const string &path, int seconds) {
+    dir_watcher watcher(path);
+    if (!watcher.is_watching()) {
+        return true;    // nothing to check, the watcher has warned
+    }
+    cout << "Watching for " << seconds << " seconds, number of entries (files + directories)="
+         << watcher.size() << endl;
+    bool all_same = true;
+    auto until = chrono::steady_clock::now() + chrono::seconds(seconds);
+    for (auto now = chrono::steady_clock::now(); now < until; now = chrono::steady_clock::now()) {
+        int wait_ms = chrono::duration_cast<chrono::milliseconds>(until - now).count();
+        int num_changes = watcher.process_events(wait_ms);
+        if (!watcher.is_watching()) {
+            cout << "The directory was removed or moved, it is no longer watched." << endl;
+            break;
+        }
+        if (num_changes == 0) {
+            continue;
+        }
+
+        int num_entries = 0;
+        dir_elm_info *entries = flatten_directory(path, num_entries);
+        bool same = (num_entries == watcher.size());
+        const dir_elm_info *watched = watcher.entries();
+        for (int i = 0; same && (i < num_entries); i++) {
+            same = (entries[i].path == watched[i].path)
+                   && (entries[i].is_directory == watched[i].is_directory);
+        }
+        delete[] entries;
+        cout << num_changes << " changes, number of entries (files + directories)=" << watcher.size()
+             << (same ? "" : "  **Error**: results differ from the directory flattened again") << endl;
+        all_same = all_same && same;
+    }
+    return all_same;
 }
 
 int main(int argc, char* argv[]) {
@@ -144,33 +445,136 @@ int main(int argc, char* argv[]) {
     } 
     cout << endl;
 
+    if ((argc > 2) && (string(argv[1]) == "-watch")) {
+        int seconds = max(0, stoi(argv[2]));
+        if (argc > 3) {
+            input_path = argv[3];
+        }
+        if (argc > 4) {
+            cerr << "Error: no other option can be used with -watch" << endl;
+            return 1;   // error
+        }
+        if (!is_directory(input_path)) {
+            cerr << "**Error**: Input path is not a valid directory: " << input_path << endl;
+            return 1;   // error
+        }
+        cout << "Watching directory: " << fs::absolute(input_path) << endl << endl;
+        return watch_directory(input_path, seconds) ? 0 : 1;
+    }
+
+    int num_threads = 0;    // 0: not given, see below
+    bool by_contents = false;
+    int usage_top = -1;     // -1: not given
+    sort_order order = SORT_NAME;
+    dir_filter filter;
+    while (argc > 1) {
+        if ((argc > 2) && (string(argv[1]) == "-threads")) {
+            num_threads = stoi(argv[2]);
+            if (num_threads <= 0)
+                num_threads = max(1u, thread::hardware_concurrency());
+            argc -= 2;
+            argv += 2;  // the remaining arguments are as usual
+        } else if ((argc > 2) && (string(argv[1]) == "-usage")) {
+            usage_top = max(0, stoi(argv[2]));
+            argc -= 2;
+            argv += 2;
+        } else if ((argc > 2) && (string(argv[1]) == "-sort")) {
+            if (!parse_sort_order(argv[2], order)) {
+                cerr << "Error: -sort needs none, name, natural or dirs-first: " << argv[2] << endl;
+                return 1;   // error
+            }
+            argc -= 2;
+            argv += 2;
+        } else if (string(argv[1]) == "-contents") {
+            by_contents = true;
+            argc -= 1;
+            argv += 1;
+        } else if (string(argv[1]) == "-io_uring") {
+            if (!set_directory_backend(BACKEND_IO_URING)) {
+                cerr << "Warning: io_uring is not available, directories are read with readdir." << endl;
+            }
+            argc -= 1;
+            argv += 1;
+        } else if (dir_filter::is_flag(argv[1])) {
+            filter.add_flag(argv[1]);
+            argc -= 1;
+            argv += 1;
+        } else if ((argc > 2) && dir_filter::is_option(argv[1])) {
+            if (!filter.add_option(argv[1], argv[2])) {
+                return 1;   // error
+            }
+            argc -= 2;
+            argv += 2;
+        } else {
+            break;
+        }
+    }
     if (argc > 1) {
         input_path = argv[1];
     }
+    string index_file;      // optional: index of listings from earlier runs
+    if (argc > 2) {
+        index_file = argv[2];
+        if (order != SORT_NAME) {
+            cerr << "Error: -sort cannot be used with an index_file, the index keeps its listings by name" << endl;
+            return 1;   // error
+        }
+    }
 
     if (!is_directory(input_path)) {
         cerr << "**Error**: Input path is not a valid directory: " << input_path << endl;
         return 1;   // error
     }
 
+    if (usage_top >= 0) {
+        if (!filter.keeps_everything()) {
+            cerr << "Error: -usage counts every file, only -xdev can be used with it" << endl;
+            return 1;   // error
+        }
+        // reading directories: by default, one thread per hardware thread
+        cout << "Disk usage of directory: " << fs::absolute(input_path) << endl << endl;
+        report_disk_usage(input_path, usage_top, num_threads, filter.stays_on_file_system());
+        return 0;
+    }
+
     // Inform the user: 
     cout << "Flattening directory: " << fs::absolute(input_path) << endl;
-    cout << "And, remove all duplicated names." << endl << endl;
+    if (by_contents) {
+        cout << "And, find all files with identical contents." << endl << endl;
+    } else {
+        cout << "And, remove all duplicated names." << endl << endl;
+    }
 
     // Flatten the directory entries
-    int num_entries = num_dir_entries(input_path);
-    dir_elm_info* entries = new dir_elm_info[num_entries];
-    int insert_index = 0;
-    flatten_directory_entries(input_path, entries, insert_index);
+    int num_entries = 0;
+    dir_elm_info* entries = nullptr;
+    if (index_file.empty()) {
+        entries = flatten_directory(input_path, num_entries, filter, directory_lister(order));
+    } else {
+        // only directories changed since the last run are read again
+        dir_index_cache cache(index_file);
+        entries = flatten_directory(input_path, num_entries, filter, cache.lister());
+        cache.save();
+#ifdef DEBUG
+        cerr << "Index " << index_file << ": " << cache.hits() << " directories unchanged, "
+             << cache.misses() << " read" << endl;
+#endif
+    }
+    if (by_contents) {
+        // reading files: by default, one thread per hardware thread
+        report_content_duplicates(entries, num_entries, num_threads);
+        delete[] entries;
+        return 0;
+    }
     cout << "Before removing duplicated number of entries (files + directories)=" << num_entries << endl;
     print_dir_entries(entries, num_entries);
 
-    // Allocate duplicate array: notice the size is at most half of num_entries
-    dup_info *dup_array = new dup_info[num_entries/2];
+    // The duplicate array is allocated with exactly the number of duplicated names
     int dup_count = 0;
 
     int original_num_entries = num_entries;  // save original number of entries for reporting later
-    remove_and_count_duplicate(entries, num_entries, dup_array, dup_count);
+    dup_info *dup_array = remove_and_count_duplicate(entries, num_entries, dup_count,
+                                                     max(1, num_threads));
 
 
     // Show results of removing duplicates
@@ -189,6 +593,10 @@ int main(int argc, char* argv[]) {
 
     }
 
+#ifdef DEBUG
+    cerr << "stat calls made: " << stat_calls_made()
+         << " avoided: " << stat_calls_avoided() << endl;
+#endif
     delete[] entries; // Clean up dynamically allocated memory
     delete[] dup_array;
 
@@ -8,45 +8,231 @@
 //      https://en.cppreference.com/w/cpp/filesystem/directory_entry
 // directory_entry::path example from cppreference.com
 //      https://en.cppreference.com/w/cpp/filesystem/directory_entry/path
+// readdir and d_type from the Linux manual
+//      https://man7.org/linux/man-pages/man3/readdir.3.html
 //
 #include "KFS.h"
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <dirent.h>
 
 // Local constants
 const int NAME_WIDTH = 25;
 const int NAMES_PER_LINE = 5;
+const int INITIAL_CAPACITY = 16;   // initial size of a growable entry array
+const int PREFIX_BYTES = 8;        // bytes of a name in its sort key (one 64-bit word)
+const int WRITE_BUFFER_SIZE = 256 * 1024;   // bytes, buffer of a dir_entry_writer
+const string NAME_PADDING(NAME_WIDTH, ' ');
 
+// Counters for the stat calls made/avoided when classifying entries (see KFS.h)
+atomic<long> stat_calls_made_count{0};
+atomic<long> stat_calls_avoided_count{0};
 
-// These two functions are local to this file, not exported via the KFS.h header
 
-// Function to count number of subdirectories in a directory
-// Input: directory path (string)
-// Output: number of subdirectories (int)
-// Uses C++17 filesystem library
-int num_subdir(const string &dir_path) {
-    int count = 0;
-    for (const auto& entry : fs::directory_iterator(dir_path)) {
-        if (entry.is_directory()) {
-            count++;
+// These functions are local to this file, not exported via the KFS.h header
+
+// Function to grow a dynamically allocated dir_elm_info array
+// Input: entries: array to grow (may be nullptr when capacity is 0)
+//        num_used: number of valid entries in the array
+//        capacity: current size of the array (by reference, updated)
+// Output: pointer to the new array, the old array is deleted
+dir_elm_info* grow_entries(dir_elm_info *entries, int num_used, int &capacity) {
+    int new_capacity = (capacity == 0) ? INITIAL_CAPACITY : capacity * 2;
+    dir_elm_info *bigger = new dir_elm_info[new_capacity];
+    for (int i = 0; i < num_used; i++) {
+        bigger[i] = move(entries[i]);
+    }
+    delete[] entries;
+    capacity = new_capacity;
+    return bigger;
+}
+
+// A name reduced to its first bytes, to compare names without reading them
+struct name_key {
+    unsigned long long prefix;  // PREFIX_BYTES bytes after the common prefix, big-endian, 0 after the end
+    int rank;                   // SORT_DIRS_FIRST: 0 for directories, 1 for files
+    int index;                  // of the entry in the unsorted array
+};
+
+// Function: prefix_of
+//   skip: number of bytes at the start of every name of the listing
+// Returns: PREFIX_BYTES bytes of name, after skip, as a number: comparing the numbers
+//          compares the names byte by byte (as unsigned chars, like string::compare)
+unsigned long long prefix_of(const string &name, int skip) {
+    unsigned long long prefix = 0;
+    for (int i = skip; i < skip + PREFIX_BYTES; i++) {
+        prefix = (prefix << 8) | ((i < (int)name.size()) ? (unsigned char)name[i] : 0);
+    }
+    return prefix;
+}
+
+// Function: common_prefix
+// Returns: number of bytes at the start of every name in entries ("img_0001.jpg", "img_0002.jpg": 7)
+int common_prefix(const dir_elm_info *entries, int num_entries) {
+    const string &first = entries[0].name;
+    int common = first.size();
+    for (int i = 1; (i < num_entries) && (common > 0); i++) {
+        const string &name = entries[i].name;
+        int same = 0;
+        while ((same < common) && (same < (int)name.size()) && (name[same] == first[same])) {
+            same++;
         }
+        common = same;
     }
-    return count;
+    return common;
 }
 
-// Function to count number of items (files + subdirectories) in a directory
-// Input: directory path (string)
-// Output: number of items (int)
-// Uses C++17 filesystem library
-int num_items(const string &dir_path) {
-    int count = 0;
-    for (const auto& entry : fs::directory_iterator(dir_path)) {
-        count++;
+// Function: natural_less
+// Returns: true if a is before b, runs of digits compared by their value:
+//          "file2" before "file10" (same value: fewer leading zeros first)
+bool natural_less(const string &a, const string &b) {
+    size_t i = 0, j = 0;
+    while ((i < a.size()) && (j < b.size())) {
+        if (isdigit((unsigned char)a[i]) && isdigit((unsigned char)b[j])) {
+            size_t start_a = i, start_b = j;
+            while ((i < a.size()) && (a[i] == '0')) i++;
+            while ((j < b.size()) && (b[j] == '0')) j++;
+            size_t digits_a = i, digits_b = j;
+            while ((i < a.size()) && isdigit((unsigned char)a[i])) i++;
+            while ((j < b.size()) && isdigit((unsigned char)b[j])) j++;
+            // more significant digits: larger number, else compare digit by digit
+            if (i - digits_a != j - digits_b) {
+                return (i - digits_a) < (j - digits_b);
+            }
+            int order = a.compare(digits_a, i - digits_a, b, digits_b, j - digits_b);
+            if (order != 0) {
+                return order < 0;
+            }
+            if (digits_a - start_a != digits_b - start_b) {
+                return (digits_a - start_a) < (digits_b - start_b);
+            }
+        } else {
+            if (a[i] != b[j]) {
+                return (unsigned char)a[i] < (unsigned char)b[j];
+            }
+            i++;
+            j++;
+        }
     }
-    return count;
+    return (a.size() - i) < (b.size() - j);
+}
+
+// Function: sort_entries
+//   entries: listing of a directory (deleted, and replaced by the returned array)
+//   order: how to sort it
+// Returns: the entries in order
+// Purpose:
+// SORT_NAME and SORT_DIRS_FIRST sort small keys instead of the entries: most names
+// differ in their first PREFIX_BYTES bytes after the prefix they all share, and are
+// compared without reading the strings; the entries are then moved once, to their place.
+dir_elm_info* sort_entries(dir_elm_info *entries, int num_entries, sort_order order) {
+    if ((order == SORT_NONE) || (num_entries < 2)) {
+        return entries;
+    }
+    if (order == SORT_NATURAL) {
+        sort(entries, entries + num_entries, [](const dir_elm_info &a, const dir_elm_info &b) {
+            return natural_less(a.name, b.name);});
+        return entries;
+    }
+
+    int skip = common_prefix(entries, num_entries);
+    name_key *keys = new name_key[num_entries];
+    for (int i = 0; i < num_entries; i++) {
+        keys[i].prefix = prefix_of(entries[i].name, skip);
+        keys[i].rank = ((order == SORT_DIRS_FIRST) && entries[i].is_directory) ? 0 : 1;
+        keys[i].index = i;
+    }
+    sort(keys, keys + num_entries, [entries](const name_key &a, const name_key &b) {
+        if (a.rank != b.rank) {
+            return a.rank < b.rank;
+        }
+        if (a.prefix != b.prefix) {
+            return a.prefix < b.prefix;
+        }
+        return entries[a.index].name < entries[b.index].name;  // same first bytes
+    });
+    dir_elm_info *sorted = new dir_elm_info[num_entries];
+    for (int i = 0; i < num_entries; i++) {
+        sorted[i] = move(entries[keys[i].index]);
+    }
+    delete[] keys;
+    delete[] entries;
+    return sorted;
 }
 
 // --- Begin exported functions ---
 
+dir_entry_writer::dir_entry_writer(ostream &out, print_format format) :
+    out(out), format(format), used(0), count(0)
+{
+    buffer = new char[WRITE_BUFFER_SIZE];
+}
+
+dir_entry_writer::~dir_entry_writer() {
+    if (used > 0) {
+        out.write(buffer, used);
+    }
+    delete[] buffer;
+}
+
+// Function: append
+//   data, size: bytes to add to the output
+// Purpose:
+// copies into the buffer, the buffer is written out when it is full
+void dir_entry_writer::append(const char *data, int size) {
+    if (used + size > WRITE_BUFFER_SIZE) {
+        out.write(buffer, used);
+        used = 0;
+        if (size > WRITE_BUFFER_SIZE) {
+            out.write(data, size);  // larger than the whole buffer
+            return;
+        }
+    }
+    memcpy(buffer + used, data, size);
+    used += size;
+}
+
+void dir_entry_writer::write(const dir_elm_info &entry) {
+    count++;
+    if (format == PRINT_LINES) {
+        append(entry.path.data(), entry.path.size());
+        append(entry.is_directory ? "/\n" : "\n", entry.is_directory ? 2 : 1);
+        return;
+    }
+
+    // same as print_dir_entry: name, "/ " or " ", left aligned in NAME_WIDTH
+    int width = entry.name.size() + (entry.is_directory ? 2 : 1);
+    append(entry.name.data(), entry.name.size());
+    append(entry.is_directory ? "/ " : " ", entry.is_directory ? 2 : 1);
+    if (width < NAME_WIDTH) {
+        append(NAME_PADDING.data(), NAME_WIDTH - width);
+    }
+    if (count % NAMES_PER_LINE == 0) {
+        append("\n", 1);
+    }
+}
+
+void dir_entry_writer::write(const dir_elm_info *entries, int num_entries) {
+    for (int i = 0; i < num_entries; i++) {
+        write(entries[i]);
+    }
+}
+
+void dir_entry_writer::finish() {
+    if (format == PRINT_COLUMNS) {
+        append("\n", 1);
+    }
+    flush();
+}
+
+void dir_entry_writer::flush() {
+    out.write(buffer, used);
+    used = 0;
+    out.flush();
+}
+
 // Function: print_dir_entry
 //   entry: a dir_elm_info struct
 // Precondition: none
@@ -69,16 +255,36 @@ void print_dir_entry(const dir_elm_info &entry) {
 // and prints no more than NAMES_PER_LINE
 // for directories, prints "/" after the name
 void print_dir_entries(const dir_elm_info *entries, int num_entries) {
-    int count = 0;
-    
-    for (int i = 0; i < num_entries; i++) {
-        print_dir_entry(entries[i]);
-        count++;
-        if (count % NAMES_PER_LINE == 0) {
-            cout << endl;
-        }
+    print_dir_entries(entries, num_entries, PRINT_COLUMNS);
+}
+
+// Function: print_dir_entries
+//   entries: pointer to an array of dir_elm_info
+//   num_entries: number of entries in the array
+//   format: PRINT_COLUMNS or PRINT_LINES
+// Purpose:
+// prints the entries through a dir_entry_writer on cout
+void print_dir_entries(const dir_elm_info *entries, int num_entries, print_format format) {
+    dir_entry_writer writer(cout, format);
+    writer.write(entries, num_entries);
+    writer.finish();
+}
+
+// Function: print_dir_entries
+//   entries: a dir_stream, printed until there are no more entries
+//   format: PRINT_COLUMNS or PRINT_LINES
+// Precondition: none
+// Postcondition: returns the number of entries printed
+// Purpose:
+// same format as print_dir_entries on an array, but the entries are printed
+// as soon as they are found (one buffer at a time)
+int print_dir_entries(dir_stream &entries, print_format format) {
+    dir_entry_writer writer(cout, format);
+    for (const dir_elm_info &entry : entries) {
+        writer.write(entry);
     }
-    cout << endl;
+    writer.finish();
+    return writer.size();
 }
 
 // Function: num_dir_entries
@@ -86,7 +292,17 @@ void print_dir_entries(const dir_elm_info *entries, int num_entries) {
 // Precondition: dir_path is a valid directory path
 // Postcondition: returns number of entries in the directory and all of its subdirectories
 int num_dir_entries(const string &dir_path) {
+    dir_visit_set visited;
+    return num_dir_entries(dir_path, visited);
+}
+
+// Function: num_dir_entries
+//   visited: directories already counted, each physical directory is counted once
+int num_dir_entries(const string &dir_path, dir_visit_set &visited) {
     int count = 0;
+    if (!visited.first_visit(dir_path)) {
+        return 0;   // already counted through another path
+    }
     // Get a list of all files and directories in the current directory
     dir_elm_info* entries = nullptr;
     int num_entries = 0;
@@ -98,7 +314,7 @@ int num_dir_entries(const string &dir_path) {
         count++;
         if (entries[i].is_directory) {
             // If the entry is a directory, count its contents recursively
-            count += num_dir_entries(entries[i].path);
+            count += num_dir_entries(entries[i].path, visited);
         }
     }
     delete[] entries; // Clean up dynamically allocated memory
@@ -116,6 +332,19 @@ int num_dir_entries(const string &dir_path) {
 void flatten_directory_entries(const string &path,
                     dir_elm_info *flattened_dir_info, int &insert_index)
 {
+    dir_visit_set visited;
+    flatten_directory_entries(path, flattened_dir_info, insert_index, visited);
+}
+
+// Function: flatten_directory_entries
+//   visited: directories already listed, each physical directory is listed once
+//            (num_dir_entries counts the same entries)
+void flatten_directory_entries(const string &path,
+                    dir_elm_info *flattened_dir_info, int &insert_index, dir_visit_set &visited)
+{
+    if (!visited.first_visit(path)) {
+        return;     // already listed through another path
+    }
     int num_entries = 0;
     dir_elm_info* entries = get_directory_entries(path, num_entries);
 
@@ -133,12 +362,98 @@ void flatten_directory_entries(const string &path,
     for (int i = 0; i < num_entries; ++i) {
         if (entries[i].is_directory) {
             flattened_dir_info[insert_index++] = entries[i];
-            flatten_directory_entries(entries[i].path, flattened_dir_info, insert_index);
+            flatten_directory_entries(entries[i].path, flattened_dir_info, insert_index, visited);
         }
     }
     delete[] entries; // Clean up dynamically allocated memory
 }
 
+// Function: append_directory_entries
+//   path: path to the directory to be flattened
+//   flattened_dir_info: reference to the growable array to append to
+//   num_entries: reference to the number of entries already in the array
+//   capacity: reference to the size of the array
+//   lister: function used to list each directory
+//   filter: entries to keep (nullptr: all of them)
+//   depth: depth of the entries of path (0: the top directory)
+//   visited: directories already listed
+// Purpose:
+// same order as flatten_directory_entries, but grows the array as entries are found,
+// so each directory is listed only once
+void append_directory_entries(const string &path, dir_elm_info *&flattened_dir_info,
+                    int &num_entries, int &capacity, const dir_lister &lister,
+                    const dir_filter *filter, int depth, dir_visit_set &visited)
+{
+    if (!visited.first_visit(path)) {
+        return;     // already listed through another path (or on another file system)
+    }
+    int dir_size = 0;
+    dir_elm_info* entries = lister(path, dir_size);
+    if (filter != nullptr) {
+        dir_size = filter->apply(entries, dir_size);
+    }
+
+    // First:  info of files skipping all directories
+    for (int i = 0; i < dir_size; ++i) {
+        if (!entries[i].is_directory) {
+            if (num_entries == capacity) {
+                flattened_dir_info = grow_entries(flattened_dir_info, num_entries, capacity);
+            }
+            flattened_dir_info[num_entries++] = move(entries[i]);
+        }
+    }
+
+    // Second: info of directories and recursively append their contents
+    for (int i = 0; i < dir_size; ++i) {
+        if (entries[i].is_directory) {
+            if (num_entries == capacity) {
+                flattened_dir_info = grow_entries(flattened_dir_info, num_entries, capacity);
+            }
+            flattened_dir_info[num_entries++] = entries[i];
+            if ((filter == nullptr) || filter->descends(entries[i], depth)) {
+                append_directory_entries(entries[i].path, flattened_dir_info, num_entries, capacity,
+                                         lister, filter, depth + 1, visited);
+            }
+        }
+    }
+    delete[] entries; // Clean up dynamically allocated memory
+}
+
+// Function: flatten_directory
+//   path: path to the directory to be flattened
+//   num_entries: output parameter to return the number of entries in the array
+//   lister: function used to list each directory (get_directory_entries by default)
+// Precondition: path is a valid directory path
+// Postcondition: returns the flattened array, in the same order as flatten_directory_entries
+// Purpose:
+// replaces num_dir_entries + flatten_directory_entries with a single traversal
+dir_elm_info* flatten_directory(const string &path, int &num_entries, const dir_lister &lister) {
+    int capacity = 0;
+    dir_elm_info *flattened_dir_info = nullptr;
+    num_entries = 0;
+    dir_visit_set visited;
+    append_directory_entries(path, flattened_dir_info, num_entries, capacity, lister, nullptr, 0, visited);
+    return flattened_dir_info;
+}
+
+dir_elm_info* flatten_directory(const string &path, int &num_entries) {
+    return flatten_directory(path, num_entries, get_directory_entries);
+}
+
+// Function: flatten_directory
+//   filter: entries to keep, excluded and pruned directories (and, if the filter
+//           stays on the file system, directories on other file systems) are not listed
+// Postcondition: returns the flattened array of the kept entries, in the same order
+dir_elm_info* flatten_directory(const string &path, int &num_entries, const dir_filter &filter,
+                    const dir_lister &lister) {
+    int capacity = 0;
+    dir_elm_info *flattened_dir_info = nullptr;
+    num_entries = 0;
+    dir_visit_set visited(filter.stays_on_file_system());
+    append_directory_entries(path, flattened_dir_info, num_entries, capacity, lister, &filter, 0, visited);
+    return flattened_dir_info;
+}
+
 
 // Function to determine if the input string is a valid directory
 // Input: directory path (string)
@@ -152,6 +467,78 @@ bool is_directory(const string &dir_path) {
     return true;
 }
 
+// Function: for_each_directory_entry
+//   dir_path: path to the directory to read
+//   visit: called once for each entry with its name and whether it is a directory
+// Purpose:
+// reads a directory once, in file system order. Where the file system reports
+// the type of the entry (d_type), the entry is classified without calling stat.
+// stat is only called for symbolic links (to follow them, like fs::is_directory)
+// and for entries of unknown type.
+// With BACKEND_IO_URING (see set_directory_backend), these stats are all
+// submitted at once to io_uring (in KFSUring.cpp).
+void for_each_directory_entry(const string &dir_path,
+                    const function<void(const string &name, bool is_directory)> &visit)
+{
+    if ((get_directory_backend() == BACKEND_IO_URING) && uring_for_each_directory_entry(dir_path, visit)) {
+        return;
+    }
+#ifdef _DIRENT_HAVE_D_TYPE
+    DIR *dir = opendir(dir_path.c_str());
+    if (dir != nullptr) {
+        // opendir checked dir_path is a directory: no need for is_directory(dir_path)
+        // (not counted: the counters are about classifying the entries)
+        struct dirent *dp;
+        while ((dp = readdir(dir)) != nullptr) {
+            string name(dp->d_name);
+            if ((name == ".") || (name == "..")) {
+                continue;
+            }
+            bool entry_is_directory;
+            if ((dp->d_type == DT_DIR) || (dp->d_type == DT_REG)) {
+                entry_is_directory = (dp->d_type == DT_DIR);
+                stat_calls_avoided_count++;
+            } else if ((dp->d_type == DT_LNK) || (dp->d_type == DT_UNKNOWN)) {
+                error_code ec;  // a broken link is not a directory
+                entry_is_directory = fs::is_directory(fs::path(dir_path) / name, ec);
+                stat_calls_made_count++;
+            } else {
+                entry_is_directory = false;  // fifo, socket, device
+                stat_calls_avoided_count++;
+            }
+            visit(name, entry_is_directory);
+        }
+        closedir(dir);
+        return;
+    }
+    // could not open: report and fail the same way as directory_iterator
+#endif
+    is_directory(dir_path);
+    for (const auto& entry : fs::directory_iterator(dir_path)) {
+        visit(entry.path().filename().string(), entry.is_directory());
+        stat_calls_made_count++;
+    }
+}
+
+// Function: hash_name
+//   name: a file or directory name
+// Returns: the hash value stored in dir_elm_info::name_hash
+size_t hash_name(const string_view &name) {
+    return hash<string_view>()(name);
+}
+
+// Function: stat_calls_made
+// Returns: number of stat calls made to classify entries so far
+long stat_calls_made() {
+    return stat_calls_made_count;
+}
+
+// Function: stat_calls_avoided
+// Returns: number of stat calls avoided by using the type reported by readdir so far
+long stat_calls_avoided() {
+    return stat_calls_avoided_count;
+}
+
 // Function to get directory entries
 // Input: directory path (string)
 // Output: array of dir_elm_info structs (dynamically allocated)
@@ -160,24 +547,44 @@ bool is_directory(const string &dir_path) {
 // Uses C++17 filesystem library
 //     #include <filesystem> included in KFS.h
 dir_elm_info* get_directory_entries(const string &dir_path, int &num_entries) {
-    is_directory(dir_path);
+    return get_directory_entries_ordered(dir_path, num_entries, SORT_NAME);
+}
 
-    num_entries = num_items(dir_path);
+// Function: get_directory_entries_ordered
+//   dir_path: path to the directory to read
+//   num_entries: output parameter to return number of entries found
+//   order: order of the entries in the array (see sort_order)
+// Returns: array of dir_elm_info structs (dynamically allocated), nullptr if empty
+dir_elm_info* get_directory_entries_ordered(const string &dir_path, int &num_entries, sort_order order) {
+    // Single pass: read each entry once, growing the array as needed.
+    // Entries created or removed while reading cannot overflow or under-fill
+    // the array, since num_entries is whatever was actually read.
+    int capacity = 0;
+    dir_elm_info *entries = nullptr;
+    num_entries = 0;
+    for_each_directory_entry(dir_path, [&](const string &name, bool entry_is_directory) {
+        if (num_entries == capacity) {
+            entries = grow_entries(entries, num_entries, capacity);
+        }
+        entries[num_entries].path = (fs::path(dir_path) / name).string();
+        entries[num_entries].name = name;
+        entries[num_entries].is_directory = entry_is_directory;
+        entries[num_entries].name_hash = hash_name(name);
+        num_entries++;
+    });
     if (num_entries == 0) {
         return nullptr;    // empty directory
     }
-    
-    dir_elm_info *entries = new dir_elm_info[num_entries];
-    int i = 0;
-    for (const auto& entry : fs::directory_iterator(dir_path)) {
-        entries[i].path = entry.path().string();
-        entries[i].name = entry.path().filename().string();
-        entries[i].is_directory = entry.is_directory();
-        i++;
-    }
 
-    sort(entries, entries + num_entries, [](const dir_elm_info &a, const dir_elm_info &b) {
-        return a.name < b.name;});
-    return entries;
+    return sort_entries(entries, num_entries, order);
+}
+
+// Function: directory_lister
+//   order: order of the entries of each listing
+// Returns: a dir_lister (e.g., for flatten_directory) listing directories in that order
+dir_lister directory_lister(sort_order order) {
+    return [order](const string &dir_path, int &num_entries) {
+        return get_directory_entries_ordered(dir_path, num_entries, order);
+    };
 }
 
@@ -0,0 +1,290 @@
+// File: KFSIndex.cpp
+// Implementation of dir_index_cache: an on-disk index of directory listings
+//
+// Index file format (integers in the native byte order of the machine):
+//      "KFSIDX01"                      8 bytes
+//      number of directories           4 bytes
+//      then, for each directory, one record:
+//          path length, path           4 bytes + path
+//          mtime                       8 bytes
+//          number of entries           4 bytes
+//          then, for each entry (sorted by name):
+//              is_directory            1 byte
+//              name length, name       4 bytes + name
+//
+// A listing is used again while the mtime of its directory has not changed. A
+// directory modified less than RACY_MARGIN before it was listed may still change in
+// the same timestamp tick, after the listing, and keep its mtime: its mtime is recorded
+// as 0 (unknown), so it is listed again next time (the same rule as KFSSnapshot.cpp).
+//
+// mmap from the Linux manual
+//      https://man7.org/linux/man-pages/man2/mmap.2.html
+//
+#include "KFS.h"
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Local constants
+const char INDEX_MAGIC[] = "KFSIDX01";
+const int INDEX_MAGIC_SIZE = 8;
+const chrono::seconds RACY_MARGIN(1);   // file system timestamps lag the clock
+
+// Function: read_u32, read_i64
+//   p: reference to the read position, moved past the value
+//   end: end of the buffer
+//   value: output, the value read
+// Returns: false if the buffer is too short
+bool read_u32(const char *&p, const char *end, unsigned int &value) {
+    if (end - p < (long)sizeof(value)) {
+        return false;
+    }
+    memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return true;
+}
+
+bool read_i64(const char *&p, const char *end, long long &value) {
+    if (end - p < (long)sizeof(value)) {
+        return false;
+    }
+    memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return true;
+}
+
+// Function: write_u32, write_i64, write_string
+//   out: binary output file
+// Purpose:
+// writes a value in the index file format
+void write_u32(ofstream &out, unsigned int value) {
+    out.write((const char *)&value, sizeof(value));
+}
+
+void write_i64(ofstream &out, long long value) {
+    out.write((const char *)&value, sizeof(value));
+}
+
+void write_string(ofstream &out, const string &value) {
+    write_u32(out, value.size());
+    out.write(value.data(), value.size());
+}
+
+// Function: directory_mtime
+//   dir_path: path to a directory
+//   mtime: output, modification time of the directory
+// Returns: false if the modification time could not be read
+bool directory_mtime(const string &dir_path, long long &mtime) {
+    error_code ec;
+    fs::file_time_type time = fs::last_write_time(dir_path, ec);
+    if (ec) {
+        return false;
+    }
+    mtime = time.time_since_epoch().count();
+    return true;
+}
+
+// Function: racy_since
+// Returns: now - RACY_MARGIN, in the unit of directory_mtime: a directory with a later
+//          mtime may change again without a new mtime
+long long racy_since() {
+    return (fs::file_time_type::clock::now() - RACY_MARGIN).time_since_epoch().count();
+}
+
+dir_index_cache::dir_index_cache(const string &index_file) :
+    index_file(index_file), map(nullptr), map_size(0), num_hits(0), num_misses(0)
+{
+    load();
+}
+
+dir_index_cache::~dir_index_cache() {
+    for (auto &item : fresh) {
+        delete[] item.second.entries;
+    }
+    if (map != nullptr) {
+        munmap(map, map_size);
+    }
+}
+
+// Function: load
+// Purpose:
+// maps the index file and records where each directory's listing is.
+// A missing or damaged index file simply gives an empty cache.
+void dir_index_cache::load() {
+    int fd = open(index_file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;     // no index yet
+    }
+    struct stat info;
+    if ((fstat(fd, &info) != 0) || (info.st_size < INDEX_MAGIC_SIZE)) {
+        close(fd);
+        return;
+    }
+    map_size = info.st_size;
+    void *addr = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);      // the mapping stays valid
+    if (addr == MAP_FAILED) {
+        map_size = 0;
+        return;
+    }
+    map = (char *)addr;
+
+    const char *p = map;
+    const char *end = map + map_size;
+    unsigned int num_dirs = 0;
+    bool ok = (memcmp(p, INDEX_MAGIC, INDEX_MAGIC_SIZE) == 0);
+    p += INDEX_MAGIC_SIZE;
+    ok = ok && read_u32(p, end, num_dirs);
+    for (unsigned int d = 0; ok && (d < num_dirs); d++) {
+        mapped_listing listing;
+        unsigned int path_len = 0, num_entries = 0;
+        listing.record = p;
+        ok = read_u32(p, end, path_len) && (end - p >= (long)path_len);
+        if (!ok) {
+            break;
+        }
+        string_view path(p, path_len);
+        p += path_len;
+        ok = read_i64(p, end, listing.mtime) && read_u32(p, end, num_entries);
+        listing.entries = p;
+        listing.num_entries = num_entries;
+        // skip over the entries, checking they are all inside the file
+        for (unsigned int i = 0; ok && (i < num_entries); i++) {
+            unsigned int name_len = 0;
+            ok = (end - p >= 1);
+            p += ok ? 1 : 0;
+            ok = ok && read_u32(p, end, name_len) && (end - p >= (long)name_len);
+            p += ok ? name_len : 0;
+        }
+        listing.record_size = p - listing.record;
+        if (ok) {
+            mapped[path] = listing;
+        }
+    }
+    if (!ok) {
+        cerr << "Warning: ignoring damaged index file: " << index_file << endl;
+        mapped.clear();
+    }
+}
+
+dir_elm_info* dir_index_cache::get_directory_entries(const string &dir_path, int &num_entries) {
+    long long mtime = 0;
+    if (!directory_mtime(dir_path, mtime)) {
+        return ::get_directory_entries(dir_path, num_entries);  // reports the error
+    }
+
+    // 1. read earlier in this run
+    auto found_fresh = fresh.find(dir_path);
+    if ((found_fresh != fresh.end()) && (found_fresh->second.mtime == mtime)) {
+        num_hits++;
+        num_entries = found_fresh->second.num_entries;
+        if (num_entries == 0) {
+            return nullptr;
+        }
+        dir_elm_info *entries = new dir_elm_info[num_entries];
+        for (int i = 0; i < num_entries; i++) {
+            entries[i] = found_fresh->second.entries[i];
+        }
+        return entries;
+    }
+
+    // 2. recorded in the index file, and not changed since
+    auto found_mapped = mapped.find(dir_path);
+    if ((found_mapped != mapped.end()) && (found_mapped->second.mtime == mtime)) {
+        num_hits++;
+        mapped_used.insert(found_mapped->first);
+        num_entries = found_mapped->second.num_entries;
+        if (num_entries == 0) {
+            return nullptr;
+        }
+        dir_elm_info *entries = new dir_elm_info[num_entries];
+        const char *p = found_mapped->second.entries;
+        for (int i = 0; i < num_entries; i++) {
+            unsigned int name_len = 0;
+            entries[i].is_directory = (*p++ != 0);
+            memcpy(&name_len, p, sizeof(name_len));
+            p += sizeof(name_len);
+            entries[i].name.assign(p, name_len);
+            entries[i].name_hash = hash_name(entries[i].name);
+            p += name_len;
+            entries[i].path = (fs::path(dir_path) / entries[i].name).string();
+        }
+        return entries;
+    }
+
+    // 3. new or changed: read the directory, and keep a copy for save()
+    num_misses++;
+    long long racy = racy_since();
+    dir_elm_info *entries = ::get_directory_entries(dir_path, num_entries);
+    fresh_listing &listing = fresh[dir_path];
+    delete[] listing.entries;   // a previous copy, if the directory changed during this run
+    listing.mtime = (mtime >= racy) ? 0 : mtime;    // 0: never used again
+    listing.num_entries = num_entries;
+    listing.entries = nullptr;
+    if (num_entries > 0) {
+        listing.entries = new dir_elm_info[num_entries];
+        for (int i = 0; i < num_entries; i++) {
+            listing.entries[i] = entries[i];
+        }
+    }
+    return entries;
+}
+
+dir_lister dir_index_cache::lister() {
+    return [this](const string &dir_path, int &num_entries) {
+        return get_directory_entries(dir_path, num_entries);
+    };
+}
+
+bool dir_index_cache::save() {
+    // write to a temporary file first, so a failed save never damages the index
+    string tmp_file = index_file + ".tmp";
+    ofstream out(tmp_file, ios::binary | ios::trunc);
+    if (!out) {
+        cerr << "Error: cannot write index file: " << tmp_file << endl;
+        return false;
+    }
+
+    out.write(INDEX_MAGIC, INDEX_MAGIC_SIZE);
+    int num_dirs = fresh.size();
+    for (const string_view &path : mapped_used) {
+        if (fresh.find(string(path)) == fresh.end()) {
+            num_dirs++;
+        }
+    }
+    write_u32(out, num_dirs);
+
+    for (const auto &item : fresh) {
+        write_string(out, item.first);
+        write_i64(out, item.second.mtime);
+        write_u32(out, item.second.num_entries);
+        for (int i = 0; i < item.second.num_entries; i++) {
+            out.put(item.second.entries[i].is_directory ? 1 : 0);
+            write_string(out, item.second.entries[i].name);
+        }
+    }
+    // unchanged listings are copied straight from the mapped file
+    for (const string_view &path : mapped_used) {
+        if (fresh.find(string(path)) == fresh.end()) {
+            const mapped_listing &listing = mapped.at(path);
+            out.write(listing.record, listing.record_size);
+        }
+    }
+
+    out.close();
+    if (!out) {
+        cerr << "Error: cannot write index file: " << tmp_file << endl;
+        return false;
+    }
+    error_code ec;
+    fs::rename(tmp_file, index_file, ec);
+    if (ec) {
+        cerr << "Error: cannot replace index file: " << index_file << endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,328 @@
+// File: KFSUring.cpp
+// The io_uring directory backend, chosen at run time with set_directory_backend
+//
+// Linux only, uses the io_uring system calls directly (no liburing needed).
+// io_uring has no getdents operation, so a directory is read with getdents64
+// in big batches (DENTS_BUFFER_SIZE bytes per system call). The entries the file
+// system does not report the type of (symbolic links, DT_UNKNOWN) then need a
+// stat: all of these statx are submitted to the ring at once, up to QUEUE_DEPTH
+// in flight, instead of one blocking stat after the other. On a cold cache, the
+// disk can then serve them in the order that suits it.
+//
+// The getdents64 calls themselves are not sent through the ring: on a file system
+// that reports the type of each entry (d_type), there is almost nothing to stat and
+// this backend reads a directory with the same blocking calls as readdir. It only
+// helps on file systems without d_type, and on trees with many symbolic links.
+//
+// Each thread has its own ring (flatten_directory_entries_parallel lists
+// directories from several threads).
+//
+// io_uring from the Linux manual
+//      https://man7.org/linux/man-pages/man7/io_uring.7.html
+// io_uring_setup, io_uring_enter
+//      https://man7.org/linux/man-pages/man2/io_uring_setup.2.html
+//      https://man7.org/linux/man-pages/man2/io_uring_enter.2.html
+// getdents64
+//      https://man7.org/linux/man-pages/man2/getdents.2.html
+//
+#include "KFS.h"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Local constants
+const unsigned QUEUE_DEPTH = 256;           // operations in flight at most
+const int DENTS_BUFFER_SIZE = 64 * 1024;    // bytes read by one getdents64
+
+atomic<int> current_backend{BACKEND_READDIR};
+
+// A directory entry as returned by getdents64 (not declared by glibc)
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Class: uring
+// A submission and a completion queue shared with the kernel
+class uring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe *sqes;
+    io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned to_submit;     // queued since the last submit
+    bool failed;            // io_uring_enter failed
+
+public:
+    uring();
+    ~uring();
+
+    // the mappings cannot be shared
+    uring(const uring &other) = delete;
+    uring& operator=(const uring &other) = delete;
+
+    bool ok() const { return (fd >= 0) && !failed; }
+
+    // Function: queue_statx
+    //   dir_fd, name: the entry to stat, as for statx (symbolic links are followed)
+    //   result: where the kernel writes the result
+    //   tag: returned with the completion
+    void queue_statx(int dir_fd, const char *name, struct statx *result, unsigned long long tag);
+
+    // Function: submit_and_wait
+    //   wait_nr: number of completions to wait for (at least)
+    // Returns: false if io_uring_enter failed
+    bool submit_and_wait(unsigned wait_nr);
+
+    // Function: next_completion
+    //   tag, res: output, the tag of the operation and its result
+    // Returns: false if there is no completion ready
+    bool next_completion(unsigned long long &tag, int &res);
+};
+
+uring::uring() :
+    fd(-1), sqes(nullptr), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED),
+    to_submit(0), failed(false)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, QUEUE_DEPTH, &params);
+    if (fd < 0) {
+        return;     // not supported, or not allowed
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+    }
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQ_RING);
+    cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_ring
+            : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_CQ_RING);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd, IORING_OFF_SQES);
+    if ((sq_ring == MAP_FAILED) || (cq_ring == MAP_FAILED) || (sqes_map == MAP_FAILED)) {
+        if (sqes_map != MAP_FAILED) {
+            munmap(sqes_map, sqes_size);
+        }
+        close(fd);
+        fd = -1;
+        return;
+    }
+    sqes = (io_uring_sqe *)sqes_map;
+
+    char *sq = (char *)sq_ring;
+    sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + params.sq_off.array);
+    char *cq = (char *)cq_ring;
+    cq_head = (unsigned *)(cq + params.cq_off.head);
+    cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+}
+
+uring::~uring() {
+    if (fd < 0) {
+        return;
+    }
+    munmap(sqes, sqes_size);
+    if (cq_ring != sq_ring) {
+        munmap(cq_ring, cq_ring_size);
+    }
+    munmap(sq_ring, sq_ring_size);
+    close(fd);
+}
+
+void uring::queue_statx(int dir_fd, const char *name, struct statx *result, unsigned long long tag) {
+    unsigned tail = *sq_tail;   // only this thread writes the tail
+    unsigned index = tail & *sq_mask;
+    io_uring_sqe &sqe = sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_STATX;
+    sqe.fd = dir_fd;
+    sqe.addr = (unsigned long long)name;
+    sqe.len = STATX_TYPE;
+    sqe.off = (unsigned long long)result;
+    sqe.statx_flags = 0;        // follow symbolic links, like fs::is_directory
+    sqe.user_data = tag;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    to_submit++;
+}
+
+bool uring::submit_and_wait(unsigned wait_nr) {
+    int done = 0;
+    while ((to_submit > 0) && (done >= 0)) {
+        done = syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, nullptr, 0);
+        if (done > 0) {
+            to_submit -= done;
+        } else if ((done < 0) && (errno == EINTR)) {
+            done = 0;
+        }
+    }
+    while (done >= 0) {
+        done = syscall(__NR_io_uring_enter, fd, 0, wait_nr, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (done >= 0) {
+            return true;
+        }
+        if (errno == EINTR) {
+            done = 0;
+        }
+    }
+    failed = true;      // operations may be left in the ring: never use it again
+    return false;
+}
+
+bool uring::next_completion(unsigned long long &tag, int &res) {
+    unsigned head = *cq_head;   // only this thread moves the head
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    const io_uring_cqe &cqe = cqes[head & *cq_mask];
+    tag = cqe.user_data;
+    res = cqe.res;
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Function: thread_ring
+// Returns: the ring of the calling thread, set up the first time it is used
+uring& thread_ring() {
+    static thread_local uring ring;
+    return ring;
+}
+
+// --- Begin exported functions ---
+
+// Function: uring_for_each_directory_entry
+//   dir_path, visit: as for for_each_directory_entry
+// Returns: false if the directory could not be read this way (nothing was visited)
+bool uring_for_each_directory_entry(const string &dir_path,
+                    const function<void(const string &name, bool is_directory)> &visit)
+{
+    uring &ring = thread_ring();
+    if (!ring.ok()) {
+        return false;
+    }
+    int dir_fd = open(dir_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        return false;
+    }
+    // the open checked dir_path is a directory: no need for is_directory(dir_path)
+    // (not counted: the counters are about classifying the entries)
+
+    // 1. read all the names, in big batches
+    vector<string> names;
+    vector<unsigned char> types;
+    char *buffer = new char[DENTS_BUFFER_SIZE];
+    long size;
+    while ((size = syscall(SYS_getdents64, dir_fd, buffer, DENTS_BUFFER_SIZE)) > 0) {
+        for (long offset = 0; offset < size; ) {
+            const linux_dirent64 *dp = (const linux_dirent64 *)(buffer + offset);
+            offset += dp->d_reclen;
+            if ((strcmp(dp->d_name, ".") == 0) || (strcmp(dp->d_name, "..") == 0)) {
+                continue;
+            }
+            names.push_back(dp->d_name);
+            types.push_back(dp->d_type);
+        }
+    }
+    delete[] buffer;
+
+    // 2. stat the entries of unknown type, all in flight at the same time
+    int num_names = names.size();
+    bool *entry_is_directory = new bool[num_names];
+    int *to_stat = new int[num_names];
+    int num_to_stat = 0;
+    for (int i = 0; i < num_names; i++) {
+        entry_is_directory[i] = (types[i] == DT_DIR);
+        if ((types[i] == DT_LNK) || (types[i] == DT_UNKNOWN)) {
+            to_stat[num_to_stat++] = i;
+        } else {
+            stat_calls_avoided_count++;
+        }
+    }
+    struct statx *results = new struct statx[QUEUE_DEPTH];
+    string *paths = new string[QUEUE_DEPTH];
+    for (int first = 0; first < num_to_stat; first += QUEUE_DEPTH) {
+        int batch = min((int)QUEUE_DEPTH, num_to_stat - first);
+        for (int b = 0; b < batch; b++) {
+            // the full path, not relative to dir_fd: the symbolic links met on the
+            // way count towards ELOOP the same way as for fs::is_directory
+            paths[b] = (fs::path(dir_path) / names[to_stat[first + b]]).string();
+            ring.queue_statx(AT_FDCWD, paths[b].c_str(), &results[b], b);
+        }
+        bool submitted = ring.submit_and_wait(batch);
+        int completed = 0;
+        while (submitted && (completed < batch)) {
+            unsigned long long tag;
+            int res;
+            if (!ring.next_completion(tag, res)) {
+                submitted = ring.submit_and_wait(1);  // wait for the others
+                continue;
+            }
+            int i = to_stat[first + tag];
+            if (res == -EINVAL) {
+                // no IORING_OP_STATX before Linux 5.6: a plain stat
+                error_code ec;
+                entry_is_directory[i] = fs::is_directory(paths[tag], ec);
+            } else {
+                // a broken link (res < 0) is not a directory
+                entry_is_directory[i] = (res == 0) && S_ISDIR(results[tag].stx_mode);
+            }
+            completed++;
+        }
+        if (completed < batch) {
+            // io_uring_enter failed: stat the whole batch one at a time
+            for (int b = 0; b < batch; b++) {
+                error_code ec;
+                entry_is_directory[to_stat[first + b]] =
+                    fs::is_directory(fs::path(dir_path) / names[to_stat[first + b]], ec);
+            }
+        }
+        stat_calls_made_count += batch;
+    }
+    delete[] paths;
+    delete[] results;
+    delete[] to_stat;
+    close(dir_fd);
+
+    for (int i = 0; i < num_names; i++) {
+        visit(names[i], entry_is_directory[i]);
+    }
+    delete[] entry_is_directory;
+    return true;
+}
+
+// Function: set_directory_backend
+//   backend: how directories are read from now on, by all threads
+// Returns: false if the backend is not available (the backend is then unchanged)
+bool set_directory_backend(directory_backend backend) {
+    if ((backend == BACKEND_IO_URING) && !thread_ring().ok()) {
+        return false;
+    }
+    current_backend = backend;
+    return true;
+}
+
+// Function: get_directory_backend
+// Returns: how directories are read
+directory_backend get_directory_backend() {
+    return (directory_backend)current_backend.load();
+}
@@ -0,0 +1,258 @@
+// File: KFSUsage.cpp
+// Implementation of directory_usage: disk usage of a directory tree, like du
+//
+// Each entry is stat'ed once (fstatat, relative to its open directory, without
+// following symbolic links: a link is counted as a file, as du does), and each
+// directory's total is its own size plus the totals of its subdirectories.
+// Files with several hard links are counted once, and so are directories reached
+// through several paths (bind mounts): each directory is read the first time its
+// (device, inode) is seen (see dir_visit_set). With one_file_system, directories on
+// another file system than the top directory are not read or counted (du -x).
+//
+// Totals are computed bottom-up (post-order): the total of a directory is known
+// only after all of its subdirectories. To spread the work over threads:
+//   1. the top of the tree is listed breadth-first into a table, until there are
+//      enough unlisted subdirectories for the threads (each row: path, parent row)
+//   2. each thread takes the next unlisted subdirectory and computes its total
+//      (recursively, post-order)
+//   3. one sweep of the table, from the last row to the first, adds the total of
+//      each row to its parent row: rows are after their parent, so a row is
+//      complete when it is reached
+// The heaviest directories are kept as they are completed, in a bounded heap of
+// top_n directories (one per thread, merged at the end): no list of all of the
+// directories is kept or sorted.
+//
+// fstatat from the Linux manual
+//      https://man7.org/linux/man-pages/man2/fstatat.2.html
+// du from the GNU coreutils manual
+//      https://www.gnu.org/software/coreutils/manual/html_node/du-invocation.html
+//
+#include "KFS.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Local constants
+const int SUBTREES_PER_THREAD = 8;      // unlisted subdirectories per thread before step 2
+const long long STAT_BLOCK_SIZE = 512;  // unit of st_blocks
+
+// A directory of the top of the tree (step 1)
+struct usage_row {
+    string path;
+    int parent;             // row of the parent directory, -1 for the top directory
+    disk_usage total;
+};
+
+// Files with several hard links already counted, shared by all threads
+struct inode_set {
+    mutex lock;
+    set<pair<dev_t, ino_t>> seen;
+};
+
+// The heaviest directories found so far, a heap with the lightest on top
+struct top_list {
+    dir_usage *items;
+    int size;
+    int capacity;
+};
+
+// Function: heavier
+// Returns: true if a is heavier than b (more allocated, then more apparent size, then by path)
+bool heavier(const dir_usage &a, const dir_usage &b) {
+    if (a.usage.allocated_size != b.usage.allocated_size) {
+        return a.usage.allocated_size > b.usage.allocated_size;
+    }
+    if (a.usage.apparent_size != b.usage.apparent_size) {
+        return a.usage.apparent_size > b.usage.apparent_size;
+    }
+    return a.path < b.path;
+}
+
+// Function: top_add
+// Purpose: keeps the directory if it is one of the capacity heaviest so far
+void top_add(top_list &top, const string &path, const disk_usage &usage) {
+    if (top.capacity == 0) {
+        return;
+    }
+    dir_usage candidate = {path, usage};
+    if (top.size < top.capacity) {
+        top.items[top.size++] = move(candidate);
+        push_heap(top.items, top.items + top.size, heavier);
+    } else if (heavier(candidate, top.items[0])) {
+        pop_heap(top.items, top.items + top.size, heavier);
+        top.items[top.size - 1] = move(candidate);
+        push_heap(top.items, top.items + top.size, heavier);
+    }
+}
+
+// Function: add_usage
+void add_usage(disk_usage &total, const disk_usage &more) {
+    total.apparent_size += more.apparent_size;
+    total.allocated_size += more.allocated_size;
+    total.num_files += more.num_files;
+}
+
+// Function: read_usage
+//   dir_path: directory to read
+//   own: the sizes of the directory and of its files are added to it
+//   subdirs: output, paths of the subdirectories to read (first visits only)
+//   inodes: files with several hard links already counted
+//   visited: directories already read, or on another file system
+// Purpose: stats each entry of one directory, once
+void read_usage(const string &dir_path, disk_usage &own, vector<string> &subdirs, inode_set &inodes,
+                dir_visit_set &visited) {
+    DIR *dir = opendir(dir_path.c_str());
+    if (dir == nullptr) {
+        cerr << "Warning: cannot read directory: " << dir_path << endl;
+        return;
+    }
+    int dir_fd = dirfd(dir);
+    struct stat info;
+    if (fstat(dir_fd, &info) == 0) {
+        own.apparent_size += info.st_size;
+        own.allocated_size += info.st_blocks * STAT_BLOCK_SIZE;
+    }
+    string prefix = (dir_path.back() == '/') ? dir_path : dir_path + "/";
+    while (struct dirent *entry = readdir(dir)) {
+        const char *name = entry->d_name;
+        if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
+            continue;
+        }
+        if (fstatat(dir_fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;   // removed while reading
+        }
+        if (S_ISDIR(info.st_mode)) {
+            if (visited.first_visit(info.st_dev, info.st_ino)) {
+                subdirs.push_back(prefix + name);
+            }
+            continue;
+        }
+        if (info.st_nlink > 1) {
+            lock_guard<mutex> guard(inodes.lock);
+            if (!inodes.seen.insert({info.st_dev, info.st_ino}).second) {
+                continue;   // another link to a file already counted
+            }
+        }
+        own.apparent_size += info.st_size;
+        own.allocated_size += info.st_blocks * STAT_BLOCK_SIZE;
+        own.num_files++;
+    }
+    closedir(dir);
+}
+
+// Function: subtree_usage
+//   dir_path: directory to measure
+//   top: the heaviest directories of this thread
+//   inodes: files with several hard links already counted
+//   visited: directories already read
+// Returns: total of dir_path and everything below it
+disk_usage subtree_usage(const string &dir_path, top_list &top, inode_set &inodes,
+                         dir_visit_set &visited) {
+    disk_usage total = {0, 0, 0};
+    vector<string> subdirs;
+    read_usage(dir_path, total, subdirs, inodes, visited);
+    for (const string &subdir : subdirs) {
+        add_usage(total, subtree_usage(subdir, top, inodes, visited));
+    }
+    top_add(top, dir_path, total);
+    return total;
+}
+
+// --- Begin exported functions ---
+
+// Function: directory_usage
+//   path: path to the directory to measure
+//   heaviest: output array of top_n entries
+//   top_n: number of heaviest directories wanted (0: none, heaviest may be nullptr)
+//   num_heaviest: output, number of entries filled in heaviest (less than top_n
+//                 if there are fewer directories)
+//   num_threads: number of threads, 0 means one per hardware thread
+//   one_file_system: directories on another file system than path are not counted
+// Precondition: path is a valid directory path
+// Returns: total usage of path and everything below it
+disk_usage directory_usage(const string &path, dir_usage *heaviest, int top_n, int &num_heaviest,
+                           int num_threads, bool one_file_system) {
+    if (num_threads <= 0) {
+        num_threads = max(1u, thread::hardware_concurrency());
+    }
+    if (heaviest == nullptr) {
+        top_n = 0;
+    }
+    inode_set inodes;
+    dir_visit_set visited(one_file_system);
+    visited.first_visit(path);      // the top directory: sets the file system of -xdev
+    top_list *tops = new top_list[num_threads + 1];     // one per thread, and the table's
+    for (int t = 0; t <= num_threads; t++) {
+        tops[t].items = new dir_usage[top_n + 1];
+        tops[t].size = 0;
+        tops[t].capacity = top_n;
+    }
+    top_list &table_top = tops[num_threads];
+
+    // 1. the top of the tree, breadth-first: rows [0, num_listed) are listed
+    vector<usage_row> rows;
+    rows.push_back({path, -1, {0, 0, 0}});
+    int num_listed = 0;
+    int wanted = (num_threads > 1) ? num_threads * SUBTREES_PER_THREAD : 0;
+    while ((num_listed < (int)rows.size()) && ((int)rows.size() - num_listed <= wanted)) {
+        vector<string> subdirs;
+        read_usage(rows[num_listed].path, rows[num_listed].total, subdirs, inodes, visited);
+        for (string &subdir : subdirs) {
+            rows.push_back({move(subdir), num_listed, {0, 0, 0}});
+        }
+        num_listed++;
+    }
+
+    // 2. the unlisted rows, in parallel: each thread takes the next one, with its own heap
+    atomic<int> next{num_listed};
+    auto worker = [&](int t) {
+        for (int r = next++; r < (int)rows.size(); r = next++) {
+            rows[r].total = subtree_usage(rows[r].path, tops[t], inodes, visited);
+        }
+    };
+    int num_workers = min(num_threads, (int)rows.size() - num_listed) - 1;  // this thread works too
+    thread *workers = new thread[max(num_workers, 0)];
+    for (int t = 0; t < num_workers; t++) {
+        workers[t] = thread(worker, t + 1);
+    }
+    worker(0);
+    for (int t = 0; t < num_workers; t++) {
+        workers[t].join();
+    }
+    delete[] workers;
+
+    // 3. post-order sweep of the table
+    for (int r = rows.size() - 1; r >= 0; r--) {
+        if (r < num_listed) {
+            top_add(table_top, rows[r].path, rows[r].total);   // subtrees added their own
+        }
+        if (rows[r].parent >= 0) {
+            add_usage(rows[rows[r].parent].total, rows[r].total);
+        }
+    }
+
+    // the heaviest of all the heaps, heaviest first
+    for (int t = 0; t < num_threads; t++) {
+        for (int i = 0; i < tops[t].size; i++) {
+            top_add(table_top, tops[t].items[i].path, tops[t].items[i].usage);
+        }
+    }
+    sort(table_top.items, table_top.items + table_top.size, heavier);
+    num_heaviest = table_top.size;
+    for (int i = 0; i < num_heaviest; i++) {
+        heaviest[i] = move(table_top.items[i]);
+    }
+
+    for (int t = 0; t <= num_threads; t++) {
+        delete[] tops[t].items;
+    }
+    delete[] tops;
+    return rows[0].total;
+}
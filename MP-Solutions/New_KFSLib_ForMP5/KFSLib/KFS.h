@@ -3,18 +3,43 @@
 // Purpose: Header file for a library to work with file system
 // Functions exported:
 //      is_directory
-//      get_directory_entries
+//      get_directory_entries, get_directory_entries_ordered, directory_lister
 //          NOTE: the allocated array must be deleted by the caller
+//      for_each_directory_entry
+//      stat_calls_made, stat_calls_avoided
 // New functions added for MP5:
 //      print_dir_entry
 //      print_dir_entries
+//      dir_entry_writer class
 //      num_dir_entries
 //      flatten_directory_entries
+//      flatten_directory
+//      dir_filter class, dir_visit_set class (in ../../KFSShared, see KFSShared.h)
+//      flatten_directory_entries_parallel, parallel_for (in ../../KFSShared/KFSParallel.cpp)
+//      flatten_directory_sorted, for_each_sorted_entry (in KFSSorted.cpp)
+//      dir_stream class (in KFSStream.cpp)
+//      compact_dir_table class, flatten_directory_compact (in KFSCompact.cpp)
+//      dir_index_cache class (in KFSIndex.cpp)
+//      dir_watcher class (in KFSWatch.cpp, Linux only)
+//      find_content_duplicates, content_bytes_read (in KFSContent.cpp)
+//      directory_usage (in KFSUsage.cpp)
+//      parent_indices, export_ndjson, export_binary, exported_listing class,
+//      write_snapshot, snapshot_time, dir_snapshot class, diff_trees (in ../../KFSShared)
+//      set_directory_backend, get_directory_backend, uring_for_each_directory_entry
+//          (in KFSUring.cpp, Linux only)
 //
 #pragma once
 
 #include <iostream>
+#include <atomic>
 #include <filesystem>
+#include <functional>
+#include <mutex>
+#include <regex>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 namespace fs = std::filesystem;  // shorthand for std::filesystem
 using namespace std;
@@ -24,8 +49,13 @@ struct dir_elm_info {     // this is the data type
     string path;            // full path name
     string name;            // file or directory name only
     bool is_directory;      // true if directory, false otherwise
+    size_t name_hash;       // hash_name(name), computed once when the entry is listed
 };
 
+// Classes and functions shared with the other copies of KFSLib: dir_visit_set, dir_filter,
+// exports, snapshots and diffs (the sources are in ../../KFSShared)
+#include "../../KFSShared/KFSShared.h"
+
 
 // Function to check if a path is a valid directory
 // dir_path: path to the directory to check (full or relative path)
@@ -40,6 +70,67 @@ bool is_directory(const string &dir_path);
 // **NOTE**: the allocated array must be deleted by the caller
 dir_elm_info* get_directory_entries(const string &dir_path, int &num_entries);
 
+// Orders of a directory listing, for get_directory_entries_ordered
+enum sort_order {
+    SORT_NONE,          // file system order: no sorting, for callers that do not need any
+    SORT_NAME,          // by name, byte by byte (the order of get_directory_entries)
+    SORT_NATURAL,       // by name, runs of digits by their value: "file2" before "file10"
+    SORT_DIRS_FIRST     // directories by name, then files by name
+};
+
+// Function to get directory entries in a given order
+// Same as get_directory_entries, the entries sorted by order
+dir_elm_info* get_directory_entries_ordered(const string &dir_path, int &num_entries,
+                    sort_order order);
+
+// Function to hash a file or directory name
+// name: the name to hash
+// returns: the hash value stored in dir_elm_info::name_hash
+size_t hash_name(const string_view &name);
+
+// Function to read a directory without building an array
+// dir_path: path to the directory to read
+// visit: called once for each entry (file system order) with its name and
+//        whether it is a directory
+// Note: uses the entry type reported by the file system when it is known,
+//       stat is only called for symbolic links and entries of unknown type
+void for_each_directory_entry(const string &dir_path,
+                    const function<void(const string &name, bool is_directory)> &visit);
+
+// Ways to read a directory, for for_each_directory_entry (and so get_directory_entries,
+// flatten_directory, ...)
+enum directory_backend {
+    BACKEND_READDIR,    // readdir, a blocking stat for each entry of unknown type (default)
+    BACKEND_IO_URING    // getdents64 in big batches, the stats all in flight at once (Linux io_uring)
+};
+// Note: io_uring only takes the stats of symbolic links and of entries of unknown type:
+// on a file system that reports the type of entries (d_type: ext4, xfs, btrfs, tmpfs, ...)
+// without many symbolic links, both backends make the same blocking getdents64 calls,
+// and BACKEND_IO_URING gains little; it helps on file systems without d_type (some
+// network and FUSE file systems) and on trees with many symbolic links.
+
+// Function to choose how directories are read, by all threads (in KFSUring.cpp)
+// backend: the backend to use from now on
+// returns: false if the backend is not available (the backend is then unchanged)
+bool set_directory_backend(directory_backend backend);
+directory_backend get_directory_backend();
+
+// Function to read a directory with the io_uring backend (in KFSUring.cpp), for
+// for_each_directory_entry
+// returns: false if the directory could not be read this way (nothing was visited)
+bool uring_for_each_directory_entry(const string &dir_path,
+                    const function<void(const string &name, bool is_directory)> &visit);
+
+// Functions to check the gain of for_each_directory_entry
+// stat_calls_made: number of stat calls made to classify entries so far
+// stat_calls_avoided: number of stat calls avoided so far
+long stat_calls_made();
+long stat_calls_avoided();
+// the counters behind them (in KFS.cpp), also kept by the io_uring backend
+// (atomic: directories may be listed by several threads)
+extern atomic<long> stat_calls_made_count;
+extern atomic<long> stat_calls_avoided_count;
+
 // new functions added for MP5
 // Function: print_dir_entry
 //   entry: a dir_elm_info struct
@@ -61,19 +152,459 @@ void print_dir_entry(const dir_elm_info &entry);
 // for directories, prints "/" after the name
 void print_dir_entries(const dir_elm_info *entries, int num_entries);
 
+// Output formats of a dir_entry_writer
+enum print_format {
+    PRINT_COLUMNS,      // same layout as print_dir_entries: padded names, NAMES_PER_LINE per line
+    PRINT_LINES         // one full path per line ("/" after directories), for piping into other tools
+};
+
+// Class: dir_entry_writer
+// Formats entries into a large buffer, the buffer is written to the output
+// stream in big chunks (not once per entry, and never flushed per line).
+// Usage:
+//      dir_entry_writer writer(cout, PRINT_LINES);
+//      writer.write(entries, num_entries);
+//      writer.finish();
+class dir_entry_writer {
+    ostream &out;
+    print_format format;
+    char *buffer;
+    int used;           // bytes in buffer, not yet written
+    int count;          // entries written, for the line breaks of PRINT_COLUMNS
+
+    void append(const char *data, int size);
+
+public:
+    dir_entry_writer(ostream &out = cout, print_format format = PRINT_COLUMNS);
+    ~dir_entry_writer();    // writes what is left in the buffer
+
+    // the buffer cannot be shared
+    dir_entry_writer(const dir_entry_writer &other) = delete;
+    dir_entry_writer& operator=(const dir_entry_writer &other) = delete;
+
+    void write(const dir_elm_info &entry);
+    void write(const dir_elm_info *entries, int num_entries);
+
+    // Function: finish
+    // Purpose:
+    // ends the output the way print_dir_entries does (PRINT_COLUMNS: a final
+    // line break), writes the buffer and flushes the stream
+    void finish();
+
+    // Function: flush
+    // Purpose: writes the buffer and flushes the stream
+    void flush();
+
+    int size() const { return count; }
+};
+
+// Function: print_dir_entries
+//   entries: pointer to an array of dir_elm_info
+//   num_entries: number of entries in the array
+//   format: PRINT_COLUMNS (the same as above) or PRINT_LINES
+// Purpose:
+// prints the entries through a dir_entry_writer on cout
+void print_dir_entries(const dir_elm_info *entries, int num_entries, print_format format);
+
 // Function: num_dir_entries
 //   dir_path: path to a directory
+//   visited: directories already counted (a new set if not given)
 // Precondition: dir_path is a valid directory path
-// Postcondition: returns number of entries in the directory and all of its subdirectories
+// Postcondition: returns number of entries in the directory and all of its subdirectories,
+//                each physical directory counted once (see dir_visit_set)
 int num_dir_entries(const string &dir_path);
+int num_dir_entries(const string &dir_path, dir_visit_set &visited);
 
 // Function: flatten_directory_entries
 //   path: path to the directory to be flattened
 //   flattened_dir_info: pointer to the array to fill with flattened directory info
 //   insert_index: reference to the index at which to insert the next entry
+//   visited: directories already listed (a new set if not given)
 // Precondition: flattened_dir_info points to an array large enough to hold all entries
 // Postcondition: flattened_dir_info is filled with the entries in the directory and its subdirectories
 // Purpose:
-// fills in the entries with the entries in the directory and all of its subdirectories
+// fills in the entries with the entries in the directory and all of its subdirectories,
+// each physical directory is listed once (see dir_visit_set)
 void flatten_directory_entries(const string &path,
                     dir_elm_info *flattened_dir_info, int &insert_index);
+void flatten_directory_entries(const string &path,
+                    dir_elm_info *flattened_dir_info, int &insert_index, dir_visit_set &visited);
+
+// A function that lists one directory, with the same contract as get_directory_entries
+typedef function<dir_elm_info*(const string &dir_path, int &num_entries)> dir_lister;
+
+// Function: directory_lister
+// Returns: a dir_lister calling get_directory_entries_ordered with order
+dir_lister directory_lister(sort_order order);
+
+// Function: flatten_directory
+//   path: path to the directory to be flattened
+//   num_entries: output parameter to return the number of entries in the array
+//   lister: function used to list each directory (get_directory_entries if not given)
+//   filter: entries to keep, applied while the tree is traversed (see dir_filter)
+// Precondition: path is a valid directory path
+// Postcondition: returns the flattened array, in the same order as flatten_directory_entries
+// Purpose:
+// same result as num_dir_entries + flatten_directory_entries, but the tree is
+// traversed only once: the array grows as the entries are found
+//
+// **NOTE**: the allocated array must be deleted by the caller
+dir_elm_info* flatten_directory(const string &path, int &num_entries);
+dir_elm_info* flatten_directory(const string &path, int &num_entries, const dir_lister &lister);
+dir_elm_info* flatten_directory(const string &path, int &num_entries, const dir_filter &filter,
+                    const dir_lister &lister = get_directory_entries);
+
+// Function: flatten_directory_sorted
+//   path: path to the directory to be flattened
+//   num_entries: output parameter to return the number of entries in the array
+// Precondition: path is a valid directory path
+// Postcondition: returns all the entries of path and its subdirectories, sorted by name
+//                (the same name: in the order of the flattened array, as a stable sort)
+// Purpose:
+// the listing of each directory is already sorted: the listings are merged
+// (O(N log k) for k directories) instead of sorting the flattened array again
+//
+// **NOTE**: the allocated array must be deleted by the caller
+dir_elm_info* flatten_directory_sorted(const string &path, int &num_entries);
+
+// Function: for_each_sorted_entry
+//   path: path to the directory to be flattened
+//   visit: called with each entry, in the order of flatten_directory_sorted
+//   max_in_memory: at most this many entries are kept in memory, the others are
+//                  merged into sorted runs in a temporary file (0: no limit)
+// Precondition: path is a valid directory path
+void for_each_sorted_entry(const string &path, const function<void(const dir_elm_info &entry)> &visit,
+                           int max_in_memory = 0);
+
+// Class: dir_stream
+// Lazily walks a directory and all of its subdirectories, producing one
+// dir_elm_info at a time instead of a fully flattened array.
+//   keep_order = true: same order as flatten_directory_entries; only the listings
+//                      of the directories on the current path are kept in memory
+//   keep_order = false: the order returned by the file system, entries are
+//                      produced as they are read (memory: the directories visited)
+//   one_file_system: directories on another device than path are not listed (like -xdev)
+// Either way, each physical directory is listed once (see dir_visit_set).
+// Usage:
+//      for (const dir_elm_info &entry : dir_stream(path)) { ... }
+// or
+//      dir_stream entries(path);
+//      dir_elm_info entry;
+//      while (entries.next(entry)) { ... }
+class dir_stream {
+private:
+    // Listing of one directory on the current path, kept as a linked stack
+    struct Frame {
+        dir_elm_info *entries;  // from get_directory_entries
+        int num_entries;
+        int index;              // next entry to examine
+        bool files_done;        // false: producing files, true: producing directories
+        Frame *next;            // parent directory
+    };
+
+    Frame *top;                                 // keep_order: current directory
+    bool keep_order;
+    dir_visit_set visited;                      // directories listed
+    fs::recursive_directory_iterator unordered; // !keep_order: file system order
+
+    void push_frame(const string &path);
+    void pop_frame();
+
+public:
+    class iterator {
+    private:
+        dir_stream *stream;     // nullptr: end of the stream
+        dir_elm_info current;
+    public:
+        iterator(dir_stream *s);
+        const dir_elm_info& operator*() const { return current; }
+        const dir_elm_info* operator->() const { return &current; }
+        iterator& operator++();
+        bool operator!=(const iterator &other) const { return stream != other.stream; }
+    };
+
+    dir_stream(const string &path, bool keep_order = true, bool one_file_system = false);
+    ~dir_stream();
+
+    // Walking a directory cannot be copied
+    dir_stream(const dir_stream &other) = delete;
+    dir_stream& operator=(const dir_stream &other) = delete;
+
+    // Function: next
+    //   entry: output, the next entry
+    // Returns: false when there are no more entries
+    bool next(dir_elm_info &entry);
+
+    iterator begin() { return iterator(this); }
+    iterator end() { return iterator(nullptr); }
+};
+
+// Function: print_dir_entries
+//   entries: a dir_stream, printed until there are no more entries
+// Returns: the number of entries printed
+// Purpose:
+// same format as print_dir_entries on an array, but starts printing right away
+int print_dir_entries(dir_stream &entries, print_format format = PRINT_COLUMNS);
+
+// Compact version of dir_elm_info, an entry in a compact_dir_table
+// the name is stored once in the table's name arena, the path is not stored at all
+struct compact_dir_elm {
+    int parent;         // index of the parent directory in the table, -1 for the top directory
+    int name_offset;    // where the name begins in the name arena
+    int name_length;    // length of the name
+    bool is_directory;  // true if directory, false otherwise
+};
+
+// Class: compact_dir_table
+// A flattened directory where all names are interned in one shared arena:
+// identical names (e.g., "Makefile" in many directories) are stored only once,
+// and the full path of an entry is rebuilt from its parents only when asked for.
+class compact_dir_table {
+private:
+    string root;                // path of the top directory that was flattened
+
+    char *names;                // name arena: all distinct names, '\0' terminated
+    int names_size;
+    int names_capacity;
+
+    int *intern_slots;          // hash table of name offsets, -1 for an empty slot
+    int intern_capacity;        // always a power of 2
+    int num_names;              // distinct names in the arena
+
+    compact_dir_elm *elms;      // the entries
+    int num_elms;
+    int elms_capacity;
+
+    void grow_intern_slots();
+
+public:
+    compact_dir_table(const string &root_path);
+    ~compact_dir_table();
+
+    // A table owns its arrays, and is not meant to be copied
+    compact_dir_table(const compact_dir_table &other) = delete;
+    compact_dir_table& operator=(const compact_dir_table &other) = delete;
+
+    // Function: intern
+    //   name: a file or directory name
+    // Returns: offset of name in the arena, name is added only if not already there
+    int intern(const string_view &name);
+
+    // Function: add
+    //   parent: index of the parent directory, -1 for the top directory
+    //   name_offset, name_length: an interned name
+    //   is_directory: true if directory
+    // Returns: index of the new entry
+    int add(int parent, int name_offset, int name_length, bool is_directory);
+
+    int size() const { return num_elms; }
+    int num_distinct_names() const { return num_names; }
+    const compact_dir_elm& operator[](int index) const { return elms[index]; }
+
+    // an interned name, no copy
+    string_view arena_name(int name_offset, int name_length) const {
+        return string_view(names + name_offset, name_length);
+    }
+    string_view name(int index) const;      // name of the entry, no copy
+    string path(int index) const;           // full path, rebuilt from the parents
+    dir_elm_info info(int index) const;     // the entry as a dir_elm_info
+
+    // Function: memory_used
+    // Returns: number of bytes allocated by the table
+    long memory_used() const;
+};
+
+// Function: flatten_directory_compact
+//   path: path to the directory to be flattened
+//   one_file_system: directories on another device than path are not listed (like -xdev)
+// Precondition: path is a valid directory path
+// Postcondition: returns a table in the same order as flatten_directory_entries,
+//                each physical directory listed once (see dir_visit_set)
+// Purpose:
+// same result as flatten_directory, in a much smaller compact_dir_table
+//
+// **NOTE**: the allocated table must be deleted by the caller
+compact_dir_table* flatten_directory_compact(const string &path, bool one_file_system = false);
+
+// Class: dir_index_cache
+// An on-disk index of directory listings. Each directory is recorded with its
+// modification time (mtime). A directory is only read again when its mtime has
+// changed: adding, removing or renaming an entry changes the mtime of its directory.
+// A directory modified just before it was listed is read again next time (its mtime
+// may not change again if it is modified in the same timestamp tick).
+// The index file is memory-mapped when loaded, a listing is decoded only when asked for.
+// Usage:
+//      dir_index_cache cache(index_file);      // loads index_file if it exists
+//      dir_elm_info *entries = flatten_directory(path, num_entries, cache.lister());
+//      cache.save();                           // only the directories looked up are saved
+class dir_index_cache {
+private:
+    // A listing read from the file system during this run
+    struct fresh_listing {
+        long long mtime = 0;
+        dir_elm_info *entries = nullptr;    // sorted, as from get_directory_entries
+        int num_entries = 0;
+    };
+    // A listing still in the memory-mapped index file
+    struct mapped_listing {
+        long long mtime;
+        const char *record;         // whole record, copied as is by save()
+        size_t record_size;
+        const char *entries;        // encoded entries inside the record
+        int num_entries;
+    };
+
+    string index_file;
+    char *map;                      // the memory-mapped index file, nullptr if none
+    size_t map_size;
+
+    unordered_map<string_view, mapped_listing> mapped;  // keys point into map
+    unordered_map<string, fresh_listing> fresh;
+    unordered_set<string_view> mapped_used;  // mapped listings looked up this run
+
+    int num_hits;
+    int num_misses;
+
+    void load();
+
+public:
+    dir_index_cache(const string &index_file);
+    ~dir_index_cache();
+
+    // The cache owns the mapping and the listings, and is not meant to be copied
+    dir_index_cache(const dir_index_cache &other) = delete;
+    dir_index_cache& operator=(const dir_index_cache &other) = delete;
+
+    // Function: get_directory_entries
+    // same as get_directory_entries, but the listing comes from the index when
+    // the directory has not changed since it was recorded
+    // **NOTE**: the allocated array must be deleted by the caller
+    dir_elm_info* get_directory_entries(const string &dir_path, int &num_entries);
+
+    // Returns: a dir_lister using this cache, for flatten_directory
+    dir_lister lister();
+
+    // Function: save
+    // writes the listings of all directories looked up during this run to the index file
+    // Returns: false if the index file could not be written
+    bool save();
+
+    int hits() const { return num_hits; }
+    int misses() const { return num_misses; }
+};
+
+// Class: dir_watcher
+// Keeps a flattened directory (same order as flatten_directory_entries) up to date:
+// every directory in it is watched with Linux inotify, and the listing of a
+// directory is patched as files and directories are created, removed or renamed
+// in it, instead of walking the whole tree again. If the watched directory itself
+// is removed or moved, the watcher stops watching and the array becomes empty.
+// Usage:
+//      dir_watcher watcher(path);
+//      while (...) {
+//          if (watcher.process_events(1000) > 0)     // wait up to 1 second
+//              print_dir_entries(watcher.entries(), watcher.size());
+//      }
+class dir_watcher {
+private:
+    // Listing of one directory, each part sorted by name
+    struct dir_listing {
+        vector<dir_elm_info> files;
+        vector<dir_elm_info> subdirs;
+        int wd;                         // watch descriptor, -1: not watched
+    };
+
+    string root;                        // the directory being flattened
+    int inotify_fd;                     // -1 if inotify is not available
+    // path of a listed directory -> its listing (a directory reached through
+    // several paths is listed under the first one only)
+    unordered_map<string, dir_listing> listings;
+    // watch descriptor -> path of the directory it is listed under (inotify gives
+    // the same descriptor for all the paths of a directory)
+    unordered_map<int, string> watched;
+    int num_listed;                     // number of entries in all the listings
+    mutable vector<dir_elm_info> flattened;     // built from listings when asked for
+    mutable bool flattened_stale;
+
+    bool list_directory(const string &dir_path, dir_visit_set &visited);
+    void unwatch_subtree(const string &dir_path);
+    void rescan();
+    void append_flattened(const string &dir_path) const;
+    const vector<dir_elm_info>& flattened_entries() const;
+    bool insert_entry(const string &dir_path, const string &name, bool is_directory);
+    bool remove_entry(const string &dir_path, const string &name);
+    int refresh_entry(const string &dir_path);
+    void invalidate();
+
+public:
+    dir_watcher(const string &path);
+    ~dir_watcher();
+
+    // A watcher owns its inotify file descriptor, and is not meant to be copied
+    dir_watcher(const dir_watcher &other) = delete;
+    dir_watcher& operator=(const dir_watcher &other) = delete;
+
+    // Returns: false if inotify could not be set up (the array is then never patched),
+    //          or if the watched directory was removed or moved (the array is then empty)
+    bool is_watching() const { return inotify_fd >= 0; }
+
+    // Function: process_events
+    //   timeout_ms: how long to wait for a change, 0: do not wait, -1: wait forever
+    // Returns: the number of changes applied to the flattened array
+    int process_events(int timeout_ms);
+
+    // the flattened array, valid until the next call to process_events; after changes,
+    // it is built again from all the listings: O(number of entries) per batch of changes
+    const dir_elm_info* entries() const { return flattened_entries().data(); }
+    // number of entries in the array, kept with each change (does not build the array)
+    int size() const { return num_listed; }
+};
+
+// Function: find_content_duplicates
+//   entries: pointer to an array of dir_elm_info (e.g., from flatten_directory)
+//   num_entries: number of entries in the array
+//   group_of: output array of num_entries, group of each file with duplicated contents,
+//             -1 for directories and files with unique contents
+//   num_threads: number of threads reading files, 0 means one per hardware thread
+// Returns: number of groups, groups are numbered in order of their first file in entries
+// Purpose:
+// finds files with identical contents, reading as few bytes as possible:
+// files are compared by size, then by a hash of their first and last blocks,
+// and only files that still match are hashed completely. The files of a group
+// are then compared byte by byte: only files with the same bytes are reported.
+int find_content_duplicates(const dir_elm_info *entries, int num_entries, int *group_of,
+                            int num_threads = 0);
+
+// Function: content_bytes_read
+// Returns: number of file bytes read by find_content_duplicates so far
+long long content_bytes_read();
+
+// Disk usage of a directory and everything below it, like du
+struct disk_usage {
+    long long apparent_size;    // bytes, sum of the file sizes (du --apparent-size)
+    long long allocated_size;   // bytes allocated on disk (du)
+    long long num_files;        // files (symbolic links included), not directories
+};
+
+// A directory and its disk usage
+struct dir_usage {
+    string path;
+    disk_usage usage;
+};
+
+// Function: directory_usage
+//   path: path to the directory to measure
+//   heaviest: output array of top_n entries, the directories with the most allocated
+//             bytes, heaviest first (nullptr: not wanted)
+//   top_n: size of heaviest
+//   num_heaviest: output, number of entries filled in heaviest (at most top_n)
+//   num_threads: number of threads, 0 means one per hardware thread
+//   one_file_system: directories on another file system than path are not counted (du -x)
+// Precondition: path is a valid directory path
+// Returns: total usage of path and everything below it
+// Purpose:
+// each entry is stat'ed once (symbolic links are not followed, hard links and directories
+// reached through several paths, e.g. bind mounts, are counted once), and the totals are
+// added up bottom-up, subtrees in parallel
+disk_usage directory_usage(const string &path, dir_usage *heaviest, int top_n, int &num_heaviest,
+                           int num_threads = 0, bool one_file_system = false);
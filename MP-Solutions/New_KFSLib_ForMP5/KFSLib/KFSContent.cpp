@@ -0,0 +1,335 @@
+// File: KFSContent.cpp
+// Implementation of find_content_duplicates: files with identical contents
+//
+// Reading every byte of every file is what makes content comparison slow, so
+// files are filtered in stages, each stage only looking at files that are
+// still possible duplicates:
+//   1. size: files of different sizes cannot be identical (no reads, one stat per file)
+//   2. partial hash: hash of the first and the last block of the file
+//   3. full hash: hash of the whole file, read sequentially
+//   4. byte comparison: each file against the first file of its group
+// Files of at most two blocks are completely read by stage 2, and skip stage 3, and so
+// do groups of two files: stage 4 compares them anyway.
+// The reads of each stage are spread over a pool of threads.
+//
+// The hash (128 bits, two 64-bit hashes with different seeds) only sorts the files
+// into groups: the files of a group are only reported as identical once their bytes
+// are compared, since the result may be used to delete files.
+// Files are read with pread, not memory-mapped: a mapped file truncated by another
+// process while it is read raises SIGBUS, a pread just returns fewer bytes.
+//
+// pread from the Linux manual
+//      https://man7.org/linux/man-pages/man2/pread.2.html
+//
+#include "KFS.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Local constants
+const long long BLOCK_SIZE = 64 * 1024;     // bytes hashed at each end of a file in stage 2
+const long long READ_SIZE = 1024 * 1024;    // bytes read at a time in stages 3 and 4
+const unsigned long long HASH_SEED_1 = 0x9E3779B97F4A7C15ULL;
+const unsigned long long HASH_SEED_2 = 0xC2B2AE3D27D4EB4FULL;
+
+atomic<long long> content_bytes_read_count{0};
+
+// What is known about one file
+struct content_info {
+    int entry;                      // index in the flattened array
+    long long size;
+    unsigned long long hash[2];     // partial, then full hash
+    bool failed;                    // could not be read, never a duplicate
+};
+
+// Function: mix64
+// Returns: a well-mixed 64-bit value (the finalizer of MurmurHash3)
+unsigned long long mix64(unsigned long long x) {
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Function: hash_bytes
+//   data, size: bytes to hash
+//   hash: input/output, the two 64-bit hashes to continue
+// Purpose:
+// adds the bytes to the hashes, 8 bytes at a time
+void hash_bytes(const char *data, long size, unsigned long long hash[2]) {
+    long i = 0;
+    for (; i + 8 <= size; i += 8) {
+        unsigned long long word;
+        memcpy(&word, data + i, 8);
+        hash[0] = mix64(hash[0] ^ word) + HASH_SEED_1;
+        hash[1] = mix64(hash[1] + word) ^ HASH_SEED_2;
+    }
+    unsigned long long last = 0;
+    memcpy(&last, data + i, size - i);
+    hash[0] = mix64(hash[0] ^ last ^ size);
+    hash[1] = mix64(hash[1] + last + size);
+}
+
+// Function: hash_partial
+// Purpose:
+// stage 2: hashes the first and the last BLOCK_SIZE bytes of the file
+void hash_partial(const string &path, content_info &info) {
+    info.hash[0] = HASH_SEED_1;
+    info.hash[1] = HASH_SEED_2;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        info.failed = true;
+        return;
+    }
+    char *buffer = new char[BLOCK_SIZE];
+    long long first_size = min(info.size, BLOCK_SIZE);
+    long long last_offset = max(first_size, info.size - BLOCK_SIZE);
+    long long last_size = info.size - last_offset;
+    if (pread(fd, buffer, first_size, 0) != first_size) {
+        info.failed = true;
+    } else {
+        hash_bytes(buffer, first_size, info.hash);
+        if (last_size > 0) {
+            if (pread(fd, buffer, last_size, last_offset) != last_size) {
+                info.failed = true;
+            } else {
+                hash_bytes(buffer, last_size, info.hash);
+            }
+        }
+        content_bytes_read_count += first_size + last_size;
+    }
+    delete[] buffer;
+    close(fd);
+}
+
+// Function: hash_full
+// Purpose:
+// stage 3: hashes the whole file, read sequentially, READ_SIZE bytes at a time
+// (a file that is now shorter than its size in stage 1 fails)
+void hash_full(const string &path, content_info &info) {
+    info.hash[0] = HASH_SEED_1;
+    info.hash[1] = HASH_SEED_2;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        info.failed = true;
+        return;
+    }
+    posix_fadvise(fd, 0, info.size, POSIX_FADV_SEQUENTIAL);
+    char *buffer = new char[READ_SIZE];
+    for (long long offset = 0; offset < info.size; offset += READ_SIZE) {
+        long long size = min(READ_SIZE, info.size - offset);
+        if (pread(fd, buffer, size, offset) != size) {
+            info.failed = true;
+            break;
+        }
+        hash_bytes(buffer, size, info.hash);
+        content_bytes_read_count += size;
+    }
+    delete[] buffer;
+    close(fd);
+}
+
+// Function: same_contents
+//   path_a, path_b: two files
+//   size: their size in stage 1
+// Returns: true if both files still have size bytes, and the same bytes
+// Purpose:
+// stage 4: compares the files READ_SIZE bytes at a time, stops at the first difference
+bool same_contents(const string &path_a, const string &path_b, long long size) {
+    int fd_a = open(path_a.c_str(), O_RDONLY);
+    int fd_b = open(path_b.c_str(), O_RDONLY);
+    struct stat info_a, info_b;
+    bool same = (fd_a >= 0) && (fd_b >= 0) && (fstat(fd_a, &info_a) == 0) && (fstat(fd_b, &info_b) == 0)
+             && (info_a.st_size == size) && (info_b.st_size == size);
+    char *buffer_a = new char[READ_SIZE];
+    char *buffer_b = new char[READ_SIZE];
+    for (long long offset = 0; same && (offset < size); offset += READ_SIZE) {
+        long long chunk = min(READ_SIZE, size - offset);
+        same = (pread(fd_a, buffer_a, chunk, offset) == chunk) && (pread(fd_b, buffer_b, chunk, offset) == chunk)
+            && (memcmp(buffer_a, buffer_b, chunk) == 0);
+        content_bytes_read_count += 2 * chunk;
+    }
+    delete[] buffer_a;
+    delete[] buffer_b;
+    if (fd_a >= 0) {
+        close(fd_a);
+    }
+    if (fd_b >= 0) {
+        close(fd_b);
+    }
+    return same;
+}
+
+// Function: same_group
+// Returns: true if a and b are still possible duplicates
+bool same_group(const content_info &a, const content_info &b) {
+    return (a.size == b.size) && (a.hash[0] == b.hash[0]) && (a.hash[1] == b.hash[1]);
+}
+
+// Function: group_less
+// Purpose: sort order that puts possible duplicates next to each other
+bool group_less(const content_info &a, const content_info &b) {
+    if (a.size != b.size)
+        return a.size < b.size;
+    if (a.hash[0] != b.hash[0])
+        return a.hash[0] < b.hash[0];
+    if (a.hash[1] != b.hash[1])
+        return a.hash[1] < b.hash[1];
+    return a.entry < b.entry;
+}
+
+// Function: keep_candidates
+//   files, num_files: reference, files sorted by group_less
+// Purpose:
+// keeps only the files that share their group with at least one other file
+void keep_candidates(content_info *files, int &num_files) {
+    int kept = 0;
+    for (int i = 0; i < num_files; i++) {
+        bool has_twin = ((i > 0) && same_group(files[i - 1], files[i]))
+                     || ((i + 1 < num_files) && same_group(files[i], files[i + 1]));
+        if (has_twin && !files[i].failed) {
+            files[kept++] = files[i];
+        }
+    }
+    num_files = kept;
+}
+
+// Function: find_groups
+//   files, num_files: files sorted by group_less
+//   group_end: output array of num_files, group_end[g]: index after the last file of group g
+// Returns: number of groups (files still possible duplicates of each other)
+int find_groups(const content_info *files, int num_files, int *group_end) {
+    int num_groups = 0;
+    for (int i = 0; i < num_files; i++) {
+        if ((i + 1 == num_files) || !same_group(files[i], files[i + 1])) {
+            group_end[num_groups++] = i + 1;
+        }
+    }
+    return num_groups;
+}
+
+// --- Begin exported functions ---
+
+// Function: find_content_duplicates
+//   entries: pointer to an array of dir_elm_info (e.g., from flatten_directory)
+//   num_entries: number of entries in the array
+//   group_of: output array of num_entries, group of each file with duplicated contents,
+//             -1 for directories and files with unique contents
+//   num_threads: number of threads reading files, 0 means one per hardware thread
+// Returns: number of groups, groups are numbered in order of their first file in entries
+int find_content_duplicates(const dir_elm_info *entries, int num_entries, int *group_of,
+                            int num_threads)
+{
+    if (num_threads <= 0) {
+        num_threads = max(1u, thread::hardware_concurrency());
+    }
+    for (int i = 0; i < num_entries; i++) {
+        group_of[i] = -1;
+    }
+
+    // Stage 1: size of every regular file
+    content_info *files = new content_info[num_entries];
+    int num_files = 0;
+    for (int i = 0; i < num_entries; i++) {
+        if (!entries[i].is_directory) {
+            files[num_files].entry = i;
+            files[num_files].hash[0] = files[num_files].hash[1] = 0;
+            files[num_files].failed = false;
+            num_files++;
+        }
+    }
+    parallel_for(num_files, num_threads, [&](int f) {
+        struct stat info;
+        const string &path = entries[files[f].entry].path;
+        files[f].failed = (stat(path.c_str(), &info) != 0) || !S_ISREG(info.st_mode);
+        files[f].size = files[f].failed ? 0 : info.st_size;
+    });
+    sort(files, files + num_files, group_less);
+    keep_candidates(files, num_files);
+
+    // Stage 2: first and last blocks (empty files are already known to be identical)
+    parallel_for(num_files, num_threads, [&](int f) {
+        if (files[f].size > 0) {
+            hash_partial(entries[files[f].entry].path, files[f]);
+        }
+    });
+    sort(files, files + num_files, group_less);
+    keep_candidates(files, num_files);
+
+    // Stage 3: whole files, only if stage 2 did not already read them completely,
+    // and only in groups of more than two files
+    int *group_end = new int[num_files];
+    int num_hash_groups = find_groups(files, num_files, group_end);
+    parallel_for(num_hash_groups, num_threads, [&](int g) {
+        int start = (g == 0) ? 0 : group_end[g - 1];
+        for (int f = start; (group_end[g] - start > 2) && (f < group_end[g]); f++) {
+            if (files[f].size > 2 * BLOCK_SIZE) {
+                hash_full(entries[files[f].entry].path, files[f]);
+            }
+        }
+    });
+    sort(files, files + num_files, group_less);
+    keep_candidates(files, num_files);
+
+    // Stage 4: in each group, each file is compared with the first file of each set of
+    // identical files found so far (within a group, files are sorted by entry: the
+    // first file of a set is its smallest entry)
+    int *same_as = new int[num_files];     // index in files of the first identical file
+    num_hash_groups = find_groups(files, num_files, group_end);
+    parallel_for(num_hash_groups, num_threads, [&](int g) {
+        int start = (g == 0) ? 0 : group_end[g - 1];
+        for (int f = start; f < group_end[g]; f++) {
+            same_as[f] = f;
+            for (int first = start; (same_as[f] == f) && (first < f); first++) {
+                if ((same_as[first] == first)
+                    && same_contents(entries[files[first].entry].path, entries[files[f].entry].path,
+                                     files[f].size)) {
+                    same_as[f] = first;
+                }
+            }
+        }
+    });
+    int *set_size = new int[num_files];    // for the first file of a set: number of files in it
+    for (int i = 0; i < num_files; i++) {
+        set_size[i] = 0;
+    }
+    for (int i = 0; i < num_files; i++) {
+        set_size[same_as[i]]++;
+    }
+
+    // Number the sets of at least two files in order of their first file in entries
+    int num_groups = 0;
+    for (int i = 0; i < num_files; i++) {
+        if ((same_as[i] == i) && (set_size[i] > 1)) {
+            group_of[files[i].entry] = -2;  // first of a group, numbered below
+        }
+    }
+    for (int e = 0; e < num_entries; e++) {
+        if (group_of[e] == -2) {
+            group_of[e] = num_groups++;
+        }
+    }
+    for (int i = 0; i < num_files; i++) {
+        if (set_size[same_as[i]] > 1) {
+            group_of[files[i].entry] = group_of[files[same_as[i]].entry];
+        }
+    }
+
+    delete[] set_size;
+    delete[] same_as;
+    delete[] group_end;
+    delete[] files;
+    return num_groups;
+}
+
+// Function: content_bytes_read
+// Returns: number of file bytes read by find_content_duplicates so far
+long long content_bytes_read() {
+    return content_bytes_read_count;
+}
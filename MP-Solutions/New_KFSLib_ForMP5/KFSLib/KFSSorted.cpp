@@ -0,0 +1,389 @@
+// File: KFSSorted.cpp
+// Implementation of flatten_directory_sorted and for_each_sorted_entry:
+// all the entries of a directory tree, sorted by name
+//
+// get_directory_entries already returns each directory sorted by name: the files of
+// a directory are a sorted run. Instead of sorting the whole flattened array again
+// (O(N log N)), the runs are merged with a heap that holds the next entry of each run
+// (O(N log k) for k runs). Entries with the same name are in the order of the
+// flattened array (flatten_directory_entries), as with a stable sort of the array:
+// the runs are made in that order, the files of a directory in one run, then each
+// subdirectory in a run of its own, just before the runs of its contents, and the
+// merge keeps the entries of equal names in the order of their runs.
+//
+// External merge (for_each_sorted_entry): at most max_in_memory entries are kept
+// in memory. When the runs in memory reach that size, they are merged into one
+// run written to a temporary file. At the end, the runs on disk (MAX_FAN_IN at a
+// time, each read through its own buffer) and the runs left in memory are merged.
+//
+// push_heap/pop_heap from cppreference.com
+//      https://en.cppreference.com/w/cpp/algorithm/push_heap
+// External sorting
+//      https://en.wikipedia.org/wiki/External_sorting
+//
+#include "KFS.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+// Local constants
+const int MAX_FAN_IN = 64;                  // runs on disk merged at the same time
+const int RUN_BUFFER_SIZE = 64 * 1024;      // bytes, read buffer of a run on disk
+const int INITIAL_RUNS_CAPACITY = 64;
+const int RUN_RECORD_FIXED_SIZE = 1 + 4 + 4;
+
+// A sorted run in memory: the listing of one directory, or a merge of several
+struct memory_run {
+    dir_elm_info *entries;
+    int num_entries;
+};
+
+// A sorted run in the temporary file, read sequentially through a buffer
+struct disk_run {
+    long start;         // offset of the next bytes to read into buffer
+    long end;           // offset after the last entry of the run
+    char *buffer;
+    int buffer_size;
+    int buffer_used;    // valid bytes in buffer
+    int buffer_pos;     // next entry in buffer
+};
+
+// The next entry of a run, in the merge heap
+struct merge_head {
+    dir_elm_info *entry;    // in its run in memory, or read from its run on disk
+    int run;                // runs listed earlier have smaller numbers
+};
+
+// Function: heap_after
+// Purpose: ordering of the merge heap, std heaps keep the largest element on top
+bool heap_after(const merge_head &a, const merge_head &b) {
+    int order = a.entry->name.compare(b.entry->name);
+    return (order > 0) || ((order == 0) && (a.run > b.run));
+}
+
+// Function: add_run
+//   runs, num_runs, capacity: reference to the growable array of runs
+//   entries, num_entries: the sorted run, owned by the array of runs from now on
+void add_run(memory_run *&runs, int &num_runs, int &capacity, dir_elm_info *entries, int num_entries) {
+    if (num_runs == capacity) {
+        capacity = (capacity == 0) ? INITIAL_RUNS_CAPACITY : capacity * 2;
+        memory_run *bigger = new memory_run[capacity];
+        for (int r = 0; r < num_runs; r++) {
+            bigger[r] = runs[r];
+        }
+        delete[] runs;
+        runs = bigger;
+    }
+    runs[num_runs++] = {entries, num_entries};
+}
+
+// Function: collect_runs
+//   dir_path: directory to list
+//   runs, num_runs, capacity: reference to the growable array of runs
+//   on_listed: called after each run is added (e.g., to spill)
+//   visited: directories already listed
+// Purpose:
+// lists dir_path and its subdirectories into runs in the order of
+// flatten_directory_entries: the files of dir_path, then for each subdirectory,
+// a run of that one entry followed by the runs of its contents
+void collect_runs(const string &dir_path, memory_run *&runs, int &num_runs, int &capacity,
+                  const function<void()> &on_listed, dir_visit_set &visited) {
+    if (!visited.first_visit(dir_path)) {
+        return;     // already listed through another path
+    }
+    int num_listed = 0;
+    dir_elm_info *listed = get_directory_entries(dir_path, num_listed);
+    int num_files = 0;
+    for (int i = 0; i < num_listed; i++) {
+        num_files += listed[i].is_directory ? 0 : 1;
+    }
+    int num_subdirs = num_listed - num_files;
+    dir_elm_info *files = (num_files > 0) ? new dir_elm_info[num_files] : nullptr;
+    dir_elm_info *subdirs = new dir_elm_info[num_subdirs];
+    for (int i = 0, f = 0, s = 0; i < num_listed; i++) {
+        if (listed[i].is_directory) {
+            subdirs[s++] = move(listed[i]);
+        } else {
+            files[f++] = move(listed[i]);
+        }
+    }
+    delete[] listed;
+
+    if (num_files > 0) {
+        add_run(runs, num_runs, capacity, files, num_files);
+        on_listed();    // may spill (and delete) the run
+    }
+    for (int s = 0; s < num_subdirs; s++) {
+        dir_elm_info *subdir = new dir_elm_info[1];
+        subdir[0] = subdirs[s];
+        add_run(runs, num_runs, capacity, subdir, 1);
+        on_listed();
+        collect_runs(subdirs[s].path, runs, num_runs, capacity, on_listed, visited);
+    }
+    delete[] subdirs;
+}
+
+// Function: write_entry
+// Purpose: appends an entry to a run file (is_directory, name length, path length, name, path)
+// Returns: the number of bytes written
+long write_entry(FILE *file, const dir_elm_info &entry) {
+    char fixed[RUN_RECORD_FIXED_SIZE];
+    unsigned int name_len = entry.name.size();
+    unsigned int path_len = entry.path.size();
+    fixed[0] = entry.is_directory ? 1 : 0;
+    memcpy(fixed + 1, &name_len, 4);
+    memcpy(fixed + 5, &path_len, 4);
+    fwrite(fixed, 1, RUN_RECORD_FIXED_SIZE, file);
+    fwrite(entry.name.data(), 1, name_len, file);
+    fwrite(entry.path.data(), 1, path_len, file);
+    return RUN_RECORD_FIXED_SIZE + name_len + path_len;
+}
+
+// Function: read_entry
+//   fd: file descriptor of the run file
+//   run: the run to read from
+//   entry: output, the next entry of the run
+// Returns: false at the end of the run
+bool read_entry(int fd, disk_run &run, dir_elm_info &entry) {
+    while (true) {
+        int available = run.buffer_used - run.buffer_pos;
+        const char *p = run.buffer + run.buffer_pos;
+        int needed = RUN_RECORD_FIXED_SIZE;
+        if (available >= RUN_RECORD_FIXED_SIZE) {
+            unsigned int name_len = 0, path_len = 0;
+            memcpy(&name_len, p + 1, 4);
+            memcpy(&path_len, p + 5, 4);
+            needed += name_len + path_len;
+            if (available >= needed) {
+                entry.is_directory = (p[0] != 0);
+                entry.name.assign(p + RUN_RECORD_FIXED_SIZE, name_len);
+                entry.path.assign(p + RUN_RECORD_FIXED_SIZE + name_len, path_len);
+                entry.name_hash = hash_name(entry.name);
+                run.buffer_pos += needed;
+                return true;
+            }
+        }
+        if (run.start == run.end) {
+            return false;
+        }
+        // keep the partial entry at the front of the buffer and read behind it
+        if (needed > run.buffer_size) {
+            char *bigger = new char[needed];
+            memcpy(bigger, p, available);
+            delete[] run.buffer;
+            run.buffer = bigger;
+            run.buffer_size = needed;
+        } else {
+            memmove(run.buffer, p, available);
+        }
+        long to_read = min((long)(run.buffer_size - available), run.end - run.start);
+        ssize_t got = pread(fd, run.buffer + available, to_read, run.start);
+        if (got <= 0) {
+            return false;
+        }
+        run.start += got;
+        run.buffer_used = available + got;
+        run.buffer_pos = 0;
+    }
+}
+
+// Function: allocate_buffers
+// Purpose: gives each run on disk an empty read buffer
+void allocate_buffers(disk_run *runs, int num_runs) {
+    for (int r = 0; r < num_runs; r++) {
+        runs[r].buffer = new char[RUN_BUFFER_SIZE];
+        runs[r].buffer_size = RUN_BUFFER_SIZE;
+        runs[r].buffer_used = 0;
+        runs[r].buffer_pos = 0;
+    }
+}
+
+// Function: free_buffers
+void free_buffers(disk_run *runs, int num_runs) {
+    for (int r = 0; r < num_runs; r++) {
+        delete[] runs[r].buffer;
+        runs[r].buffer = nullptr;
+    }
+}
+
+// Function: merge_runs
+//   fd: file descriptor of the run file (-1: none)
+//   on_disk, num_on_disk: runs in the file, in listing order
+//   in_memory, num_in_memory: runs in memory, listed after all of the runs on disk
+//   emit: called with each entry, in name order (the entry may be moved from)
+void merge_runs(int fd, disk_run *on_disk, int num_on_disk,
+                memory_run *in_memory, int num_in_memory,
+                const function<void(dir_elm_info &entry)> &emit) {
+    int num_runs = num_on_disk + num_in_memory;
+    dir_elm_info *read = new dir_elm_info[num_on_disk];     // next entry of each run on disk
+    int *next = new int[num_in_memory];                     // next entry of each run in memory
+    merge_head *heap = new merge_head[num_runs];
+    int heap_size = 0;
+
+    // the next entry of run r, nullptr at the end of the run
+    auto advance = [&](int r) -> dir_elm_info* {
+        if (r < num_on_disk) {
+            return read_entry(fd, on_disk[r], read[r]) ? &read[r] : nullptr;
+        }
+        memory_run &run = in_memory[r - num_on_disk];
+        int &i = next[r - num_on_disk];
+        return (i < run.num_entries) ? &run.entries[i++] : nullptr;
+    };
+
+    for (int r = 0; r < num_in_memory; r++) {
+        next[r] = 0;
+    }
+    for (int r = 0; r < num_runs; r++) {
+        dir_elm_info *entry = advance(r);
+        if (entry != nullptr) {
+            heap[heap_size++] = {entry, r};
+            push_heap(heap, heap + heap_size, heap_after);
+        }
+    }
+    while (heap_size > 0) {
+        pop_heap(heap, heap + heap_size, heap_after);
+        merge_head &top = heap[heap_size - 1];
+        emit(*top.entry);
+        top.entry = advance(top.run);
+        if (top.entry != nullptr) {
+            push_heap(heap, heap + heap_size, heap_after);
+        } else {
+            heap_size--;
+        }
+    }
+    delete[] heap;
+    delete[] next;
+    delete[] read;
+}
+
+// --- Begin exported functions ---
+
+// Function: for_each_sorted_entry
+//   path: path to the directory to be flattened
+//   visit: called with each entry of path and its subdirectories, in name order
+//   max_in_memory: at most this many entries are kept in memory, the rest wait in
+//                  a temporary file (0: no limit, everything is merged in memory)
+// Precondition: path is a valid directory path
+void for_each_sorted_entry(const string &path, const function<void(const dir_elm_info &entry)> &visit,
+                           int max_in_memory) {
+    memory_run *runs = nullptr;
+    int num_runs = 0;
+    int capacity = 0;
+    long in_memory = 0;     // entries in runs
+
+    FILE *file = nullptr;   // the runs spilled to disk
+    long file_size = 0;
+    disk_run *spilled = nullptr;
+    int num_spilled = 0;
+    int spilled_capacity = 0;
+
+    // add a run on disk for the bytes written since start
+    auto add_spilled = [&](long start) {
+        if (num_spilled == spilled_capacity) {
+            spilled_capacity = (spilled_capacity == 0) ? INITIAL_RUNS_CAPACITY : spilled_capacity * 2;
+            disk_run *bigger = new disk_run[spilled_capacity];
+            for (int r = 0; r < num_spilled; r++) {
+                bigger[r] = spilled[r];
+            }
+            delete[] spilled;
+            spilled = bigger;
+        }
+        spilled[num_spilled++] = {start, file_size, nullptr, 0, 0, 0};
+    };
+
+    // runs in memory beyond the limit: merge them into one run on disk
+    auto spill = [&]() {
+        in_memory += runs[num_runs - 1].num_entries;
+        if ((max_in_memory <= 0) || (in_memory < max_in_memory)) {
+            return;
+        }
+        if (file == nullptr) {
+            file = tmpfile();
+            if (file == nullptr) {
+                cerr << "Error: cannot create a temporary file, sorting in memory" << endl;
+                max_in_memory = 0;
+                return;
+            }
+        }
+        long start = file_size;
+        merge_runs(-1, nullptr, 0, runs, num_runs, [&](dir_elm_info &entry) {
+            file_size += write_entry(file, entry);
+        });
+        add_spilled(start);
+        for (int r = 0; r < num_runs; r++) {
+            delete[] runs[r].entries;
+        }
+        num_runs = 0;
+        in_memory = 0;
+    };
+
+    dir_visit_set visited;
+    collect_runs(path, runs, num_runs, capacity, spill, visited);
+
+    if (file == nullptr) {
+        merge_runs(-1, nullptr, 0, runs, num_runs, [&](dir_elm_info &entry) { visit(entry); });
+    } else {
+        // more runs on disk than can be merged at once: merge groups of them into
+        // longer runs, written after the others, until MAX_FAN_IN are left
+        int fd = fileno(file);
+        while (num_spilled > MAX_FAN_IN) {
+            fflush(file);       // the runs to read must be in the file for pread
+            int num_merged = 0;
+            for (int first = 0; first < num_spilled; first += MAX_FAN_IN) {
+                int group = min(MAX_FAN_IN, num_spilled - first);
+                allocate_buffers(spilled + first, group);
+                long start = file_size;
+                merge_runs(fd, spilled + first, group, nullptr, 0, [&](dir_elm_info &entry) {
+                    file_size += write_entry(file, entry);
+                });
+                free_buffers(spilled + first, group);
+                spilled[num_merged++] = {start, file_size, nullptr, 0, 0, 0};
+            }
+            num_spilled = num_merged;
+        }
+        fflush(file);
+        allocate_buffers(spilled, num_spilled);
+        merge_runs(fd, spilled, num_spilled, runs, num_runs,
+                   [&](dir_elm_info &entry) { visit(entry); });
+        free_buffers(spilled, num_spilled);
+        fclose(file);   // a tmpfile is removed when closed
+    }
+
+    for (int r = 0; r < num_runs; r++) {
+        delete[] runs[r].entries;
+    }
+    delete[] runs;
+    delete[] spilled;
+}
+
+// Function: flatten_directory_sorted
+//   path: path to the directory to be flattened
+//   num_entries: output parameter to return the number of entries in the array
+// Precondition: path is a valid directory path
+// Postcondition: returns all the entries of path and its subdirectories, sorted by name
+//
+// **NOTE**: the allocated array must be deleted by the caller
+dir_elm_info* flatten_directory_sorted(const string &path, int &num_entries) {
+    memory_run *runs = nullptr;
+    int num_runs = 0;
+    int capacity = 0;
+    dir_visit_set visited;
+    collect_runs(path, runs, num_runs, capacity, []() {}, visited);
+
+    num_entries = 0;
+    for (int r = 0; r < num_runs; r++) {
+        num_entries += runs[r].num_entries;
+    }
+    dir_elm_info *sorted = (num_entries > 0) ? new dir_elm_info[num_entries] : nullptr;
+    int next = 0;
+    merge_runs(-1, nullptr, 0, runs, num_runs, [&](dir_elm_info &entry) {
+        sorted[next++] = move(entry);
+    });
+
+    for (int r = 0; r < num_runs; r++) {
+        delete[] runs[r].entries;
+    }
+    delete[] runs;
+    return sorted;
+}